@@ -0,0 +1,433 @@
+#pragma once
+
+#include "static_files.hpp"
+#include <string>
+#include <string_view>
+#include <vector>
+#include <memory>
+#include <unordered_map>
+#include <shared_mutex>
+#include <mutex>
+#include <thread>
+#include <cstdint>
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <poll.h>
+#endif
+
+namespace boo { namespace network {
+
+struct asset_cache_opts {
+    /* larger files are left to the sendfile path */
+    size_t max_file_size = 256 * 1024;
+    /* cached bytes over all files and encodings, files that don't fit are not cached */
+    size_t max_bytes = 64 * 1024 * 1024;
+};
+
+/* a file below the webroot with one ready to send response per encoding */
+struct cached_asset {
+    struct variant {
+        /* empty for identity */
+        std::string encoding;
+        std::string etag;
+        /* the response after its status line and Date: headers, blank line, body */
+        std::string response;
+        size_t head_len = 0;
+        /* the same for a 304 */
+        std::string not_modified;
+    };
+
+    std::string path;
+    time_t mtime = 0;
+    int64_t size = 0;
+    /* identity first */
+    std::vector<variant> variants;
+    size_t bytes = 0;
+
+    /* for static_files, which serves the plain file whenever the cache can't */
+    known_etag validator() const
+    {
+        known_etag k;
+        k.etag = variants[0].etag;
+        k.mtime = mtime;
+        k.size = size;
+        return k;
+    }
+
+    /* br over gzip over identity, as far as accept_encoding allows */
+    const variant & choose(std::string_view accept_encoding) const
+    {
+        const variant * best = &variants[0];
+        int rank = 0;
+        for (auto & v : variants) {
+            int r = v.encoding == "br" ? 2 : (v.encoding == "gzip" ? 1 : 0);
+            if (r > rank && accepts(accept_encoding, v.encoding)) {
+                best = &v;
+                rank = r;
+            }
+        }
+        return *best;
+    }
+
+    static bool accepts(std::string_view list, std::string_view coding)
+    {
+        while (!list.empty()) {
+            auto comma = list.find(',');
+            auto item = list.substr(0, comma);
+            list = comma == std::string_view::npos ? std::string_view() : list.substr(comma + 1);
+            auto semi = item.find(';');
+            auto name = item.substr(0, semi);
+            while (!name.empty() && name[0] == ' ') {
+                name.remove_prefix(1);
+            }
+            while (!name.empty() && name.back() == ' ') {
+                name.remove_suffix(1);
+            }
+            if (!http_headers::iequals(name, coding)) {
+                continue;
+            }
+            if (semi == std::string_view::npos) {
+                return true;
+            }
+            /* q=0 means not acceptable */
+            auto q = item.find("q=", semi);
+            if (q == std::string_view::npos) {
+                return true;
+            }
+            auto v = item.substr(q + 2);
+            for (char c : v) {
+                if (c >= '1' && c <= '9') {
+                    return true;
+                }
+                if (c != '0' && c != '.') {
+                    break;
+                }
+            }
+            return false;
+        }
+        return false;
+    }
+};
+
+/*
+ * Small webroot files kept in memory as ready responses, with precompressed
+ * .gz and .br siblings as extra variants. ETags are strong, hashed from the
+ * content when a file is loaded; the requests left to static_files (ranges,
+ * Connection: close) get the identity one too. Entries are dropped when
+ * inotify reports a change to the file or one of its variants.
+ *
+ * Lookups take a shared lock and may run on any reactor.
+ */
+class asset_cache {
+    asset_cache_opts _opts;
+    std::unordered_map<std::string, std::shared_ptr<const cached_asset>> _assets;
+    size_t _bytes = 0;
+    /* bumped by every invalidation, a load that raced one is not stored */
+    uint64_t _gen = 0;
+    mutable std::shared_mutex _m;
+
+    int _inotify = -1;
+    int _stop[2] = { -1, -1 };
+    std::thread _watcher;
+    /* guarded by _m */
+    std::unordered_map<int, std::string> _dirs;
+    std::unordered_map<std::string, int> _watches;
+
+public:
+    explicit asset_cache(const asset_cache_opts & opts = asset_cache_opts()): _opts(opts)
+    {
+#ifdef __linux__
+        _inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (_inotify < 0 || pipe2(_stop, O_CLOEXEC) != 0) {
+            throw "create inotify failed";
+        }
+        _watcher = std::thread([this]() {
+            watch_loop();
+        });
+#endif
+    }
+
+    asset_cache(const asset_cache &) = delete;
+    asset_cache & operator=(const asset_cache &) = delete;
+
+    ~asset_cache()
+    {
+#ifdef __linux__
+        char c = 0;
+        auto n = write(_stop[1], &c, 1);
+        (void)n;
+        if (_watcher.joinable()) {
+            _watcher.join();
+        }
+        close(_stop[0]);
+        close(_stop[1]);
+        close(_inotify);
+#endif
+    }
+
+    std::shared_ptr<const cached_asset> find(std::string_view uri) const
+    {
+        thread_local std::string key;
+        key.assign(uri.data(), uri.size());
+        std::shared_lock<std::shared_mutex> locker(_m);
+        auto i = _assets.find(key);
+        return i == _assets.end() ? nullptr : i->second;
+    }
+
+    /* reads the file uri maps to, null when it can't or shouldn't be cached */
+    std::shared_ptr<const cached_asset> load(const mg_serve_http_opts & opts, std::string_view uri)
+    {
+#ifdef __linux__
+        std::string path;
+        struct stat st;
+        if (!static_files::locate(opts, uri, path, st) || (size_t)st.st_size > _opts.max_file_size) {
+            return nullptr;
+        }
+        uint64_t gen;
+        {
+            std::unique_lock<std::shared_mutex> locker(_m);
+            if (!watch(path.substr(0, path.rfind('/')))) {
+                return nullptr;
+            }
+            gen = _gen;
+        }
+        auto a = std::make_shared<cached_asset>();
+        a->path = path;
+        a->mtime = st.st_mtime;
+        a->size = (int64_t)st.st_size;
+        std::string body;
+        if (!read_file(path, st, body)) {
+            return nullptr;
+        }
+        std::string extra;
+        if (opts.extra_headers != nullptr) {
+            extra = opts.extra_headers;
+        }
+        auto type = static_files::mime_type(path, opts.custom_mime_types);
+        a->variants.push_back(make_variant("", std::move(body), type, *a, extra));
+        static const char * encodings[][2] = { { "gzip", ".gz" }, { "br", ".br" } };
+        for (auto & e : encodings) {
+            struct stat vst;
+            std::string vpath = path + e[1];
+            if (stat(vpath.c_str(), &vst) != 0 || !S_ISREG(vst.st_mode) || (size_t)vst.st_size > _opts.max_file_size) {
+                continue;
+            }
+            std::string vbody;
+            if (read_file(vpath, vst, vbody)) {
+                a->variants.push_back(make_variant(e[0], std::move(vbody), type, *a, extra));
+            }
+        }
+        if (a->variants.size() > 1) {
+            for (auto & v : a->variants) {
+                add_vary(v);
+            }
+        }
+        for (auto & v : a->variants) {
+            a->bytes += v.response.size() + v.not_modified.size();
+        }
+
+        std::unique_lock<std::shared_mutex> locker(_m);
+        if (gen != _gen) {
+            return a;
+        }
+        auto key = std::string(uri);
+        auto i = _assets.find(key);
+        size_t replaced = i == _assets.end() ? 0 : i->second->bytes;
+        if (_bytes - replaced + a->bytes > _opts.max_bytes) {
+            return a;
+        }
+        _bytes = _bytes - replaced + a->bytes;
+        _assets[key] = a;
+        return a;
+#else
+        return nullptr;
+#endif
+    }
+
+    /* drop every entry served from path, or from the file path is a .gz or .br of */
+    void invalidate(const std::string & path)
+    {
+        std::unique_lock<std::shared_mutex> locker(_m);
+        _gen++;
+        for (auto i = _assets.begin(); i != _assets.end();) {
+            auto & p = i->second->path;
+            bool hit = p == path || (path.size() == p.size() + 3 && path.compare(0, p.size(), p) == 0
+                && (path.compare(p.size(), 3, ".gz") == 0 || path.compare(p.size(), 3, ".br") == 0));
+            if (hit) {
+                _bytes -= i->second->bytes;
+                i = _assets.erase(i);
+            } else {
+                ++i;
+            }
+        }
+    }
+
+    void clear()
+    {
+        std::unique_lock<std::shared_mutex> locker(_m);
+        _gen++;
+        _assets.clear();
+        _bytes = 0;
+    }
+
+    size_t size() const
+    {
+        std::shared_lock<std::shared_mutex> locker(_m);
+        return _assets.size();
+    }
+
+    size_t bytes() const
+    {
+        std::shared_lock<std::shared_mutex> locker(_m);
+        return _bytes;
+    }
+
+private:
+#ifdef __linux__
+    static bool read_file(const std::string & path, struct stat & st, std::string & out)
+    {
+        unique_fd file(::open(path.c_str(), O_RDONLY | O_CLOEXEC));
+        struct stat now;
+        if (!file || fstat(file.get(), &now) != 0 || now.st_size != st.st_size || now.st_mtime != st.st_mtime) {
+            return false;
+        }
+        out.resize((size_t)st.st_size);
+        size_t got = 0;
+        while (got < out.size()) {
+            auto n = pread(file.get(), &out[got], out.size() - got, (off_t)got);
+            if (n <= 0) {
+                return false;
+            }
+            got += (size_t)n;
+        }
+        return true;
+    }
+
+    static std::string strong_etag(const std::string & body)
+    {
+        /* FNV-1a 64 over the content */
+        uint64_t h = 14695981039346656037ull;
+        for (unsigned char c : body) {
+            h ^= c;
+            h *= 1099511628211ull;
+        }
+        char buf[24];
+        snprintf(buf, sizeof(buf), "\"%016llx\"", (unsigned long long)h);
+        return buf;
+    }
+
+    static cached_asset::variant make_variant(const char * encoding, std::string && body, const char * type,
+        const cached_asset & a, const std::string & extra)
+    {
+        cached_asset::variant v;
+        v.encoding = encoding;
+        v.etag = strong_etag(body);
+        std::string common = "Last-Modified: " + static_files::http_date(a.mtime) + "\r\n"
+            "ETag: " + v.etag + "\r\n";
+        if (!extra.empty()) {
+            common += extra + "\r\n";
+        }
+        v.not_modified = common + "\r\n";
+        v.response = common + "Content-Type: " + type + "\r\n";
+        if (!v.encoding.empty()) {
+            v.response += "Content-Encoding: " + v.encoding + "\r\n";
+        }
+        v.response += "Accept-Ranges: bytes\r\n"
+            "Content-Length: " + std::to_string(body.size()) + "\r\n\r\n";
+        v.head_len = v.response.size();
+        v.response += body;
+        return v;
+    }
+
+    static void add_vary(cached_asset::variant & v)
+    {
+        static const std::string vary = "Vary: Accept-Encoding\r\n";
+        v.response.insert(0, vary);
+        v.head_len += vary.size();
+        v.not_modified.insert(0, vary);
+    }
+
+    /* under the unique lock */
+    bool watch(const std::string & dir)
+    {
+        if (_watches.find(dir) != _watches.end()) {
+            return true;
+        }
+        int wd = inotify_add_watch(_inotify, dir.c_str(), IN_CLOSE_WRITE | IN_MODIFY | IN_ATTRIB | IN_CREATE
+            | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF);
+        if (wd < 0) {
+            return false;
+        }
+        _watches[dir] = wd;
+        _dirs[wd] = dir;
+        return true;
+    }
+
+    void watch_loop()
+    {
+        alignas(struct inotify_event) char buf[16 * 1024];
+        struct pollfd fds[2] = { { _inotify, POLLIN, 0 }, { _stop[0], POLLIN, 0 } };
+        for (;;) {
+            if (poll(fds, 2, -1) < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return;
+            }
+            if (fds[1].revents != 0) {
+                return;
+            }
+            ssize_t n;
+            while ((n = read(_inotify, buf, sizeof(buf))) > 0) {
+                for (char * p = buf; p < buf + n;) {
+                    auto ev = (struct inotify_event *)p;
+                    p += sizeof(struct inotify_event) + ev->len;
+                    on_event(ev);
+                }
+            }
+        }
+    }
+
+    void on_event(const struct inotify_event * ev)
+    {
+        if (ev->mask & IN_Q_OVERFLOW) {
+            return clear();
+        }
+        std::string dir;
+        {
+            std::shared_lock<std::shared_mutex> locker(_m);
+            auto i = _dirs.find(ev->wd);
+            if (i == _dirs.end()) {
+                return;
+            }
+            dir = i->second;
+        }
+        if (ev->len > 0) {
+            return invalidate(dir + "/" + ev->name);
+        }
+        if (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) {
+            std::unique_lock<std::shared_mutex> locker(_m);
+            _gen++;
+            for (auto i = _assets.begin(); i != _assets.end();) {
+                if (i->second->path.compare(0, dir.size() + 1, dir + "/") == 0) {
+                    _bytes -= i->second->bytes;
+                    i = _assets.erase(i);
+                } else {
+                    ++i;
+                }
+            }
+            if (ev->mask & IN_MOVE_SELF) {
+                /* the path is stale now, IN_IGNORED follows */
+                inotify_rm_watch(_inotify, ev->wd);
+            }
+            if (ev->mask & IN_IGNORED) {
+                _dirs.erase(ev->wd);
+                _watches.erase(dir);
+            }
+        }
+    }
+#endif
+};
+
+}}
@@ -0,0 +1,116 @@
+/*
+ * Outbound queue throughput: the lock-free mpsc_queue the reactors drain
+ * against the std::mutex + std::vector path it replaced, where the consumer
+ * held the lock while it sent every queued message. Producers push
+ * messages shaped like the server's outbound frames; the consumer "sends"
+ * by touching each payload.
+ *
+ *     bench_mpsc [messages per run, default 2000000]
+ */
+#include "mpsc_queue.hpp"
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+using boo::network::mpsc_queue;
+
+struct msg_t {
+    uint64_t conn_id = 0;
+    std::string payload;
+};
+
+static uint64_t consume(const msg_t & m)
+{
+    return m.conn_id + m.payload.size() + (uint8_t)m.payload[0];
+}
+
+/* the old path: one lock shared by the producers and the sending consumer */
+static double run_mutex(size_t producers, size_t total, uint64_t & sum)
+{
+    std::mutex m;
+    std::vector<msg_t> for_send;
+    size_t each = total / producers;
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> threads;
+    for (size_t p = 0; p < producers; ++p) {
+        threads.push_back(std::thread([&, p]() {
+            for (size_t i = 0; i < each; ++i) {
+                msg_t msg;
+                msg.conn_id = p;
+                msg.payload.assign(64, 'x');
+                std::lock_guard<std::mutex> locker(m);
+                for_send.push_back(std::move(msg));
+            }
+        }));
+    }
+    size_t seen = 0;
+    while (seen < each * producers) {
+        std::lock_guard<std::mutex> locker(m);
+        for (auto & msg : for_send) {
+            sum += consume(msg);
+        }
+        seen += for_send.size();
+        for_send.clear();
+    }
+    for (auto & t : threads) {
+        t.join();
+    }
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+/* the ring: producers retry when it is full, the consumer never blocks them */
+static double run_ring(size_t producers, size_t total, uint64_t & sum)
+{
+    mpsc_queue<msg_t> for_send(4096);
+    size_t each = total / producers;
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> threads;
+    for (size_t p = 0; p < producers; ++p) {
+        threads.push_back(std::thread([&, p]() {
+            for (size_t i = 0; i < each; ++i) {
+                msg_t msg;
+                msg.conn_id = p;
+                msg.payload.assign(64, 'x');
+                while (!for_send.push(std::move(msg))) {
+                    std::this_thread::yield();
+                }
+            }
+        }));
+    }
+    size_t seen = 0;
+    msg_t msg;
+    while (seen < each * producers) {
+        if (for_send.pop(msg)) {
+            sum += consume(msg);
+            ++seen;
+        } else {
+            std::this_thread::yield();
+        }
+    }
+    for (auto & t : threads) {
+        t.join();
+    }
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+int main(int argc, char ** argv)
+{
+    size_t total = argc > 1 ? strtoull(argv[1], nullptr, 10) : 2000000;
+    uint64_t sum = 0;
+    printf("%-10s %-8s %12s %14s\n", "producers", "queue", "seconds", "msgs/s");
+    for (size_t producers : { 1, 8, 32 }) {
+        size_t n = total / producers * producers;
+        double t = run_mutex(producers, total, sum);
+        printf("%-10zu %-8s %12.3f %14.0f\n", producers, "mutex", t, n / t);
+        t = run_ring(producers, total, sum);
+        printf("%-10zu %-8s %12.3f %14.0f\n", producers, "ring", t, n / t);
+    }
+    /* keeps the consumer's work from being optimized away */
+    return sum == 0 ? 1 : 0;
+}
@@ -0,0 +1,182 @@
+#pragma once
+
+#include <string>
+#include <cstdint>
+#include <cstddef>
+#include <algorithm>
+
+namespace boo { namespace network {
+
+/*
+ * Takes the HTTP/1.1 framing off a request body that arrives in pieces:
+ * Content-Length bytes, or the chunked transfer coding with its chunk
+ * extensions and trailers dropped.
+ */
+class body_decoder {
+    enum state_t {
+        st_length,
+        st_size,
+        st_data,
+        st_data_end,
+        st_trailer,
+        st_done,
+        st_error
+    };
+
+    state_t _state = st_done;
+    /* bytes left of the body or of the current chunk */
+    uint64_t _left = 0;
+    uint64_t _size = 0;
+    /* the line being read: chunk size, CRLF after data, or a trailer */
+    std::string _line;
+
+    static constexpr size_t max_line = 4096;
+
+public:
+    body_decoder() {}
+
+    static body_decoder length(uint64_t n)
+    {
+        body_decoder d;
+        d._left = n;
+        d._state = n > 0 ? st_length : st_done;
+        return d;
+    }
+
+    static body_decoder chunked()
+    {
+        body_decoder d;
+        d._state = st_size;
+        return d;
+    }
+
+    bool done() const
+    {
+        return _state == st_done;
+    }
+
+    bool failed() const
+    {
+        return _state == st_error;
+    }
+
+    /* body bytes decoded so far */
+    uint64_t size() const
+    {
+        return _size;
+    }
+
+    /*
+     * Appends the body bytes found in [p, p + n) to out and returns how many
+     * input bytes were used; input past the end of the body is left alone.
+     * Check failed() for malformed chunked framing.
+     */
+    size_t feed(const char * p, size_t n, std::string & out)
+    {
+        size_t i = 0;
+        while (i < n && _state != st_done && _state != st_error) {
+            switch (_state) {
+                case st_length:
+                case st_data: {
+                    size_t take = (size_t)std::min<uint64_t>(_left, n - i);
+                    out.append(p + i, take);
+                    i += take;
+                    _size += take;
+                    _left -= take;
+                    if (_left == 0) {
+                        _state = _state == st_length ? st_done : st_data_end;
+                    }
+                    break;
+                }
+                default: {
+                    if (!read_line(p, n, i)) {
+                        break;
+                    }
+                    end_line();
+                    break;
+                }
+            }
+        }
+        return i;
+    }
+
+private:
+    /* collects up to and including LF, true once a line is complete */
+    bool read_line(const char * p, size_t n, size_t & i)
+    {
+        while (i < n) {
+            char ch = p[i++];
+            if (ch == '\n') {
+                if (!_line.empty() && _line.back() == '\r') {
+                    _line.pop_back();
+                }
+                return true;
+            }
+            if (_line.size() >= max_line) {
+                _state = st_error;
+                return false;
+            }
+            _line.push_back(ch);
+        }
+        return false;
+    }
+
+    void end_line()
+    {
+        switch (_state) {
+            case st_size:
+                _state = parse_size() ? (_left > 0 ? st_data : st_trailer) : st_error;
+                break;
+            case st_data_end:
+                _state = _line.empty() ? st_size : st_error;
+                break;
+            case st_trailer:
+                if (_line.empty()) {
+                    _state = st_done;
+                }
+                break;
+            default:
+                break;
+        }
+        _line.clear();
+    }
+
+    /* hex digits, optionally followed by whitespace and ";extensions" */
+    bool parse_size()
+    {
+        uint64_t v = 0;
+        size_t i = 0;
+        for (; i < _line.size(); ++i) {
+            char ch = _line[i];
+            int d;
+            if (ch >= '0' && ch <= '9') {
+                d = ch - '0';
+            } else if (ch >= 'a' && ch <= 'f') {
+                d = ch - 'a' + 10;
+            } else if (ch >= 'A' && ch <= 'F') {
+                d = ch - 'A' + 10;
+            } else {
+                break;
+            }
+            if (v >> 60) {
+                return false;
+            }
+            v = (v << 4) | (uint64_t)d;
+        }
+        if (i == 0) {
+            return false;
+        }
+        for (; i < _line.size(); ++i) {
+            if (_line[i] == ';') {
+                break;
+            }
+            if (_line[i] != ' ' && _line[i] != '\t') {
+                return false;
+            }
+        }
+        _left = v;
+        return true;
+    }
+};
+
+}}
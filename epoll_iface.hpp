@@ -0,0 +1,399 @@
+#pragma once
+
+#include "3rd/mongoose.h"
+#include <vector>
+#include <cstring>
+
+#if defined(__linux__)
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <errno.h>
+
+extern "C" {
+    extern const struct mg_iface_vtable mg_socket_iface_vtable;
+    int mg_if_poll(struct mg_connection *nc, double now);
+}
+#endif
+
+namespace boo { namespace network {
+
+/*
+ * Edge-triggered epoll replacement for the select() based socket interface of
+ * mongoose. Readiness is remembered per connection until a read or write
+ * would block, and EPOLLOUT is only registered while a connection has bytes
+ * queued in send_mbuf (or a connect in progress) and the socket is known not
+ * to be writable. There is no FD_SETSIZE limit.
+ *
+ * mg_broadcast is not supported on managers using this interface.
+ */
+class epoll_iface {
+public:
+    /*
+     * Set by the owner of a connection that writes to the socket itself (see
+     * http_server's writev path): keeps write interest registered while
+     * send_mbuf is empty. Writability is reported through MG_EV_POLL.
+     */
+    static const unsigned long want_write_flag = MG_F_USER_6;
+
+    static const struct mg_iface_vtable * vtable()
+    {
+#if defined(__linux__)
+        static const struct mg_iface_vtable vt = make_vtable();
+        return &vt;
+#else
+        return nullptr;
+#endif
+    }
+
+    static bool available()
+    {
+        return vtable() != nullptr;
+    }
+
+    static bool manages(const struct mg_connection * nc)
+    {
+        return available() && nc->iface != nullptr && nc->iface->vtable == vtable();
+    }
+
+    /* the owner's own write would have blocked, wait for EPOLLOUT again */
+    static void write_blocked(struct mg_connection * nc)
+    {
+#if defined(__linux__)
+        auto st = state_of(nc);
+        if (st != nullptr) {
+            st->writable = false;
+        }
+#endif
+    }
+
+    /*
+     * mg_mgr_init with the epoll interface as main interface when use_epoll is
+     * set and the platform supports it, plain mg_mgr_init otherwise.
+     */
+    static void mgr_init(mg_mgr * mgr, void * user_data, bool use_epoll)
+    {
+        if (!use_epoll || !available()) {
+            mg_mgr_init(mgr, user_data);
+            return;
+        }
+        /* mg_mgr_init_opt writes main_iface into opts.ifaces, never hand it the global table */
+        std::vector<const struct mg_iface_vtable *> ifaces(mg_ifaces, mg_ifaces + mg_num_ifaces);
+        struct mg_mgr_init_opts opts;
+        memset(&opts, 0, sizeof(opts));
+        opts.main_iface = vtable();
+        opts.num_ifaces = (int)ifaces.size();
+        opts.ifaces = ifaces.data();
+        mg_mgr_init_opt(mgr, user_data, opts);
+    }
+
+#if defined(__linux__)
+private:
+    struct conn_state {
+        sock_t fd = INVALID_SOCKET;
+        uint32_t events = 0;
+        bool readable = false;
+        bool writable = false;
+    };
+
+    struct iface_data {
+        int epfd = -1;
+        std::vector<struct epoll_event> events;
+    };
+
+    static const int max_accepts_per_poll = 64;
+
+    static const struct mg_iface_vtable & base()
+    {
+        return mg_socket_iface_vtable;
+    }
+
+    static struct mg_iface_vtable make_vtable()
+    {
+        struct mg_iface_vtable vt = mg_socket_iface_vtable;
+        vt.init = init;
+        vt.free = free;
+        vt.add_conn = add_conn;
+        vt.remove_conn = remove_conn;
+        vt.poll = poll;
+        vt.tcp_send = tcp_send;
+        vt.udp_send = udp_send;
+        vt.tcp_recv = tcp_recv;
+        vt.udp_recv = udp_recv;
+        return vt;
+    }
+
+    static iface_data * data_of(struct mg_iface * iface)
+    {
+        return (iface_data *)iface->data;
+    }
+
+    static conn_state * state_of(struct mg_connection * nc)
+    {
+        return (conn_state *)nc->mgr_data;
+    }
+
+    static void init(struct mg_iface * iface)
+    {
+        auto d = new iface_data();
+        d->epfd = epoll_create1(EPOLL_CLOEXEC);
+        d->events.resize(256);
+        iface->data = d;
+    }
+
+    static void free(struct mg_iface * iface)
+    {
+        auto d = data_of(iface);
+        if (d == nullptr) {
+            return;
+        }
+        if (d->epfd >= 0) {
+            close(d->epfd);
+        }
+        delete d;
+        iface->data = nullptr;
+    }
+
+    static void add_conn(struct mg_connection * nc)
+    {
+        if (nc->mgr_data == nullptr) {
+            nc->mgr_data = new conn_state();
+        }
+    }
+
+    static void remove_conn(struct mg_connection * nc)
+    {
+        auto d = data_of(nc->iface);
+        auto st = state_of(nc);
+        if (st == nullptr) {
+            return;
+        }
+        if (st->fd != INVALID_SOCKET) {
+            epoll_ctl(d->epfd, EPOLL_CTL_DEL, st->fd, nullptr);
+        }
+        delete st;
+        nc->mgr_data = nullptr;
+    }
+
+    static bool want_write(struct mg_connection * nc)
+    {
+        if (nc->flags & MG_F_CONNECTING) {
+            return !(nc->flags & MG_F_WANT_READ);
+        }
+        return nc->send_mbuf.len > 0 || (nc->flags & want_write_flag);
+    }
+
+    static bool can_read(struct mg_connection * nc, conn_state * st)
+    {
+        if ((nc->flags & MG_F_UDP) && nc->listener != NULL) {
+            return false;
+        }
+        return st->readable && nc->recv_mbuf.len < nc->recv_mbuf_limit;
+    }
+
+    /*
+     * Keep the kernel registration in line with the connection: (re)add when
+     * the socket changed, toggle EPOLLOUT only when write interest changed.
+     * Returns true when the connection can make progress without waiting.
+     */
+    static bool sync(iface_data * d, struct mg_connection * nc)
+    {
+        if (nc->sock == INVALID_SOCKET) {
+            return false;
+        }
+        /* mongoose skips add_conn for accepted connections, their socket is set afterwards */
+        add_conn(nc);
+        auto st = state_of(nc);
+        if (st->fd != nc->sock) {
+            if (st->fd != INVALID_SOCKET) {
+                epoll_ctl(d->epfd, EPOLL_CTL_DEL, st->fd, nullptr);
+            }
+            st->fd = nc->sock;
+            st->events = 0;
+            st->readable = false;
+            st->writable = !(nc->flags & (MG_F_CONNECTING | MG_F_LISTENING));
+        }
+        uint32_t events = EPOLLIN | EPOLLRDHUP | EPOLLET;
+        if (want_write(nc) && !st->writable) {
+            events |= EPOLLOUT;
+        }
+        if (events != st->events) {
+            struct epoll_event ev;
+            ev.events = events;
+            ev.data.ptr = nc;
+            int op = st->events == 0 ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+            if (epoll_ctl(d->epfd, op, st->fd, &ev) == 0) {
+                st->events = events;
+            }
+        }
+        return can_read(nc, st) || (st->writable && want_write(nc) && !(nc->flags & MG_F_CONNECTING));
+    }
+
+    static void accept_conns(struct mg_connection * lc, conn_state * st)
+    {
+        for (int i = 0; i < max_accepts_per_poll; ++i) {
+            union socket_address sa;
+            socklen_t sa_len = sizeof(sa);
+            sock_t sock = accept4(lc->sock, &sa.sa, &sa_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (sock == INVALID_SOCKET) {
+                /* also on EMFILE and friends, otherwise we would spin on the listener */
+                st->readable = false;
+                return;
+            }
+            auto nc = mg_if_accept_new_conn(lc);
+            if (nc == NULL) {
+                closesocket(sock);
+                return;
+            }
+            nc->iface->vtable->sock_set(nc, sock);
+            mg_if_accept_tcp_cb(nc, &sa, sa_len);
+        }
+    }
+
+    static void handle_conn(struct mg_connection * nc, uint32_t revents, double now)
+    {
+        if (!mg_if_poll(nc, now)) {
+            return;
+        }
+        auto st = state_of(nc);
+        if (st == nullptr || nc->sock == INVALID_SOCKET) {
+            return;
+        }
+        if (nc->flags & MG_F_CONNECTING) {
+            if (revents != 0) {
+                int err = 0;
+                socklen_t len = sizeof(err);
+                if (getsockopt(nc->sock, SOL_SOCKET, SO_ERROR, (char *)&err, &len) != 0) {
+                    err = 1;
+                } else if (err == EAGAIN || err == EWOULDBLOCK) {
+                    err = 0;
+                }
+                st->writable = err == 0;
+                mg_if_connect_cb(nc, err);
+            } else if (nc->err != 0) {
+                mg_if_connect_cb(nc, nc->err);
+            }
+        }
+        if ((nc->flags & MG_F_LISTENING) && !(nc->flags & MG_F_UDP)) {
+            if (st->readable) {
+                accept_conns(nc, st);
+            }
+            return;
+        }
+        if (can_read(nc, st)) {
+            mg_if_can_recv_cb(nc);
+        }
+        if (st->writable && nc->send_mbuf.len > 0) {
+            mg_if_can_send_cb(nc);
+        }
+    }
+
+    static time_t poll(struct mg_iface * iface, int timeout_ms)
+    {
+        auto d = data_of(iface);
+        struct mg_mgr * mgr = iface->mgr;
+        struct mg_connection * nc, * tmp;
+        double min_timer = 0;
+        int num_timers = 0;
+        bool ready = false;
+
+        for (nc = mgr->active_connections; nc != NULL; nc = nc->next) {
+            if (sync(d, nc)) {
+                ready = true;
+            }
+            if (nc->ev_timer_time > 0) {
+                if (num_timers == 0 || nc->ev_timer_time < min_timer) {
+                    min_timer = nc->ev_timer_time;
+                }
+                num_timers++;
+            }
+        }
+        if (num_timers > 0) {
+            double timer_timeout_ms = (min_timer - mg_time()) * 1000 + 1;
+            if (timer_timeout_ms < timeout_ms) {
+                timeout_ms = (int)timer_timeout_ms;
+            }
+        }
+        if (ready || timeout_ms < 0) {
+            timeout_ms = 0;
+        }
+
+        int n = epoll_wait(d->epfd, d->events.data(), (int)d->events.size(), timeout_ms);
+        for (int i = 0; i < n; ++i) {
+            auto c = (struct mg_connection *)d->events[i].data.ptr;
+            auto st = state_of(c);
+            uint32_t e = d->events[i].events;
+            if (e & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+                st->readable = true;
+            }
+            if (e & (EPOLLOUT | EPOLLHUP | EPOLLERR)) {
+                st->writable = true;
+            }
+        }
+        if (n == (int)d->events.size()) {
+            d->events.resize(d->events.size() * 2);
+        }
+
+        double now = mg_time();
+        for (nc = mgr->active_connections; nc != NULL; nc = tmp) {
+            tmp = nc->next;
+            auto st = state_of(nc);
+            uint32_t revents = 0;
+            if (st != nullptr && (nc->flags & MG_F_CONNECTING) && (st->writable || st->readable)) {
+                revents = EPOLLOUT;
+            }
+            handle_conn(nc, revents, now);
+        }
+        /* connections added while dispatching are picked up by the next sync pass */
+        return (time_t)now;
+    }
+
+    static void update_readable(struct mg_connection * nc, int n, size_t len)
+    {
+        auto st = state_of(nc);
+        if (st != nullptr && (n <= 0 || (size_t)n < len)) {
+            st->readable = false;
+        }
+    }
+
+    static void update_writable(struct mg_connection * nc, int n, size_t len)
+    {
+        auto st = state_of(nc);
+        if (st != nullptr && (n <= 0 || (size_t)n < len)) {
+            st->writable = false;
+        }
+    }
+
+    static int tcp_send(struct mg_connection * nc, const void * buf, size_t len)
+    {
+        int n = base().tcp_send(nc, buf, len);
+        update_writable(nc, n, len);
+        return n;
+    }
+
+    static int udp_send(struct mg_connection * nc, const void * buf, size_t len)
+    {
+        int n = base().udp_send(nc, buf, len);
+        update_writable(nc, n, len);
+        return n;
+    }
+
+    static int tcp_recv(struct mg_connection * nc, void * buf, size_t len)
+    {
+        int n = base().tcp_recv(nc, buf, len);
+        update_readable(nc, n, len);
+        return n;
+    }
+
+    static int udp_recv(struct mg_connection * nc, void * buf, size_t len, union socket_address * sa, size_t * sa_len)
+    {
+        int n = base().udp_recv(nc, buf, len, sa, sa_len);
+        if (n <= 0) {
+            update_readable(nc, n, len);
+        }
+        return n;
+    }
+#endif
+};
+
+}}
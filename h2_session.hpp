@@ -0,0 +1,1050 @@
+#pragma once
+
+#include "hpack.hpp"
+#include "http_message.hpp"
+#include <string>
+#include <string_view>
+#include <vector>
+#include <map>
+#include <functional>
+#include <algorithm>
+#include <cstring>
+#include <cstdint>
+
+namespace boo { namespace network {
+
+struct h2_opts {
+    /* streams a client may have open at once, more are refused */
+    uint32_t max_concurrent_streams = 100;
+    /* receive window of each stream, replenished as request bodies arrive */
+    uint32_t initial_window_size = 65535;
+    /* receive window of the connection */
+    uint32_t connection_window_size = 1024 * 1024;
+    uint32_t max_frame_size = 16384;
+    /* decoded request headers, larger header blocks are answered 431 */
+    uint32_t max_header_list_size = 64 * 1024;
+    /* larger request bodies are answered 413 */
+    size_t max_body_size = 8 * 1024 * 1024;
+    /* response bytes the transport may hold unwritten, further DATA waits in the session */
+    size_t max_buffered = 256 * 1024;
+};
+
+/*
+ * Server side of one HTTP/2 connection (RFC 9113), without the transport:
+ * bytes read from the socket go into feed(), frames to send come out of the
+ * writer. Complete requests are handed to the request callback with their
+ * stream id, responses go back through respond() or send_headers() and
+ * send_data(). DATA is held back while the peer's connection or stream
+ * window is exhausted and resumed by its WINDOW_UPDATEs, or while the
+ * transport reports more than max_buffered bytes unwritten and resumed by
+ * resume().
+ *
+ * Not thread safe, meant to live on the reactor owning the connection.
+ */
+class h2_session {
+public:
+    typedef std::function<void(const char * data, size_t len)> writer_t;
+    /* req may be moved from, it is gone once the callback returns */
+    typedef std::function<void(uint32_t stream, http_request & req)> request_t;
+    /* bytes written to the transport that have not reached the socket yet */
+    typedef std::function<size_t()> buffered_t;
+
+    static constexpr const char * preface = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+    static constexpr size_t preface_len = 24;
+
+    enum error_code : uint32_t {
+        no_error = 0,
+        protocol_error = 1,
+        internal_error = 2,
+        flow_control_error = 3,
+        stream_closed = 5,
+        frame_size_error = 6,
+        refused_stream = 7,
+        compression_error = 9,
+        enhance_your_calm = 11
+    };
+
+private:
+    enum frame_type : uint8_t {
+        frame_data = 0,
+        frame_headers = 1,
+        frame_priority = 2,
+        frame_rst_stream = 3,
+        frame_settings = 4,
+        frame_push_promise = 5,
+        frame_ping = 6,
+        frame_goaway = 7,
+        frame_window_update = 8,
+        frame_continuation = 9
+    };
+
+    enum frame_flag : uint8_t {
+        flag_end_stream = 0x1,
+        flag_ack = 0x1,
+        flag_end_headers = 0x4,
+        flag_padded = 0x8,
+        flag_priority = 0x20
+    };
+
+    static constexpr int64_t max_window = 0x7fffffff;
+    static constexpr uint32_t default_window = 65535;
+
+    struct stream {
+        http_request req;
+        /* END_STREAM seen, or the request was answered early and the rest is ignored */
+        bool remote_closed = false;
+        bool head = false;
+        int64_t recv_window;
+        int64_t send_window;
+        bool headers_sent = false;
+        /* END_STREAM is queued, it goes out after pending */
+        bool ended = false;
+        /* body bytes still to come when the response announced a length, -1 otherwise */
+        int64_t length_left = -1;
+        /* DATA waiting for window */
+        std::string pending;
+        size_t pending_off = 0;
+    };
+
+    h2_opts _opts;
+    writer_t _writer;
+    request_t _on_request;
+    buffered_t _buffered;
+    hpack_decoder _decoder;
+    hpack_encoder _encoder;
+    std::map<uint32_t, stream> _streams;
+    /* highest stream the client opened */
+    uint32_t _last_stream = 0;
+
+    /* unparsed input and frames not yet handed to the writer */
+    std::string _in;
+    std::string _out;
+    bool _preface_seen = false;
+    bool _settings_seen = false;
+    bool _settings_acked = false;
+    bool _going_away = false;
+    bool _dead = false;
+
+    /* a header block spread over HEADERS and CONTINUATION frames */
+    std::string _block;
+    uint32_t _block_stream = 0;
+    bool _block_end_stream = false;
+    uint32_t _continuing = 0;
+    std::vector<hpack::field> _fields;
+
+    int64_t _recv_window = default_window;
+    int64_t _send_window = default_window;
+    int64_t _peer_initial_window = default_window;
+    uint32_t _peer_max_frame = 16384;
+    size_t _pending_bytes = 0;
+
+public:
+    h2_session(const h2_opts & opts, writer_t writer, request_t on_request, buffered_t buffered = nullptr):
+        _opts(opts), _writer(std::move(writer)), _on_request(std::move(on_request)), _buffered(std::move(buffered)) {}
+
+    h2_session(const h2_session &) = delete;
+    h2_session & operator=(const h2_session &) = delete;
+
+    /* the server preface: our SETTINGS and the connection window */
+    void start()
+    {
+        char payload[24];
+        size_t n = 0;
+        n += put_setting(payload + n, 3, _opts.max_concurrent_streams);
+        n += put_setting(payload + n, 4, _opts.initial_window_size);
+        n += put_setting(payload + n, 5, _opts.max_frame_size);
+        n += put_setting(payload + n, 6, _opts.max_header_list_size);
+        frame(frame_settings, 0, 0, payload, n);
+        if (_opts.connection_window_size > default_window) {
+            window_update(0, _opts.connection_window_size - default_window);
+            _recv_window = _opts.connection_window_size;
+        }
+        commit();
+    }
+
+    /*
+     * The value of an HTTP2-Settings header, base64url without padding, as
+     * a SETTINGS payload. False when it is not one.
+     */
+    static bool decode_settings(std::string_view b64, std::string & payload)
+    {
+        payload.clear();
+        uint32_t acc = 0;
+        int bits = 0;
+        for (char ch : b64) {
+            int v;
+            if (ch >= 'A' && ch <= 'Z') {
+                v = ch - 'A';
+            } else if (ch >= 'a' && ch <= 'z') {
+                v = ch - 'a' + 26;
+            } else if (ch >= '0' && ch <= '9') {
+                v = ch - '0' + 52;
+            } else if (ch == '-' || ch == '+') {
+                v = 62;
+            } else if (ch == '_' || ch == '/') {
+                v = 63;
+            } else if (ch == '=') {
+                break;
+            } else {
+                return false;
+            }
+            acc = (acc << 6) | v;
+            bits += 6;
+            if (bits >= 8) {
+                bits -= 8;
+                payload.push_back((char)(acc >> bits));
+            }
+        }
+        return payload.size() % 6 == 0;
+    }
+
+    /*
+     * Takes over a connection upgraded from HTTP/1.1: payload is the
+     * client's HTTP2-Settings, the request becomes stream 1, half closed.
+     * Call after start(), before feeding what follows the upgrade request.
+     */
+    bool upgrade(const std::string & payload, const http_request & req)
+    {
+        if (!apply_settings((const uint8_t *)payload.data(), payload.size())) {
+            return false;
+        }
+        auto & s = open_stream(1);
+        s.remote_closed = true;
+        s.head = req.method == "HEAD";
+        _last_stream = 1;
+        commit();
+        return true;
+    }
+
+    /*
+     * Parses what the client sent. Requests that are complete are handed to
+     * the request callback before it returns. False on a connection error,
+     * the GOAWAY is written and the connection should be closed.
+     */
+    bool feed(const char * p, size_t n)
+    {
+        if (_dead) {
+            return false;
+        }
+        const char * data = p;
+        size_t size = n;
+        if (!_in.empty()) {
+            _in.append(p, n);
+            data = _in.data();
+            size = _in.size();
+        }
+        size_t pos = 0;
+        bool ok = true;
+        if (!_preface_seen) {
+            size_t m = std::min(size, preface_len);
+            if (memcmp(data, preface, m) != 0) {
+                _dead = true;
+                return false;
+            }
+            if (size >= preface_len) {
+                _preface_seen = true;
+                pos = preface_len;
+            } else {
+                pos = size;
+                ok = false;
+            }
+        }
+        while (ok && size - pos >= 9) {
+            auto h = (const uint8_t *)data + pos;
+            uint32_t len = (h[0] << 16) | (h[1] << 8) | h[2];
+            if (len > _opts.max_frame_size) {
+                ok = fail(frame_size_error);
+                break;
+            }
+            if (size - pos < 9 + len) {
+                break;
+            }
+            pos += 9 + len;
+            ok = on_frame(h[3], h[4], read32(h + 5) & 0x7fffffff, h + 9, len);
+        }
+        if (!_preface_seen) {
+            /* only part of the preface so far, keep it */
+            _in.assign(data, size);
+            return true;
+        }
+        if (data == _in.data()) {
+            _in.erase(0, pos);
+        } else {
+            _in.assign(data + pos, size - pos);
+        }
+        commit();
+        return ok;
+    }
+
+    /*
+     * A complete response. Content-Length is set from len, connection
+     * specific headers are dropped. False when the stream is gone or has
+     * already started its response, the latter resets it.
+     */
+    bool respond(uint32_t id, int status_code, const http_headers * headers, const char * body, size_t len)
+    {
+        return respond_body(id, status_code, headers, std::string_view(body, len), nullptr);
+    }
+
+    /* respond() taking over the body instead of copying it */
+    bool respond(uint32_t id, int status_code, const http_headers * headers, std::string && body)
+    {
+        return respond_body(id, status_code, headers, std::string_view(body), &body);
+    }
+
+    /*
+     * Starts a response whose body follows through send_data(). With a
+     * length >= 0 the stream ends once that many bytes were sent.
+     */
+    bool send_headers(uint32_t id, int status_code, const http_headers * headers, int64_t length = -1)
+    {
+        auto i = _streams.find(id);
+        if (i == _streams.end() || i->second.headers_sent) {
+            return false;
+        }
+        bool has_body = status_code >= 200 && status_code != 204 && status_code != 304;
+        write_headers(i, status_code, headers, has_body ? length : 0);
+        commit();
+        return true;
+    }
+
+    /* body bytes after send_headers(), end closes the stream */
+    bool send_data(uint32_t id, const char * p, size_t n, bool end)
+    {
+        auto i = _streams.find(id);
+        if (i == _streams.end() || !i->second.headers_sent || i->second.ended) {
+            return false;
+        }
+        queue_data(i, p, n, end);
+        commit();
+        return true;
+    }
+
+    /* a response that will never be completed, the client sees INTERNAL_ERROR */
+    void abandon(uint32_t id)
+    {
+        auto i = _streams.find(id);
+        if (i != _streams.end() && !i->second.ended) {
+            reset(i, internal_error);
+            commit();
+        }
+    }
+
+    /* the transport wrote some of what it buffered, DATA held back for it may follow */
+    void resume()
+    {
+        if (_pending_bytes > 0) {
+            flush_all();
+            commit();
+        }
+    }
+
+    /* no new streams are taken, those open are answered */
+    void go_away()
+    {
+        if (_going_away || _dead) {
+            return;
+        }
+        _going_away = true;
+        goaway(no_error);
+        commit();
+    }
+
+    /* streams opened and not answered yet, including those waiting for window */
+    size_t open_streams() const
+    {
+        return _streams.size();
+    }
+
+    /* response bytes held back by flow control */
+    size_t pending_bytes() const
+    {
+        return _pending_bytes;
+    }
+
+    bool going_away() const
+    {
+        return _going_away;
+    }
+
+private:
+    /* owned, when given, is body's storage and may be taken over */
+    bool respond_body(uint32_t id, int status_code, const http_headers * headers, std::string_view body, std::string * owned)
+    {
+        auto i = _streams.find(id);
+        if (i == _streams.end()) {
+            return false;
+        }
+        if (i->second.headers_sent) {
+            reset(i, internal_error);
+            commit();
+            return false;
+        }
+        bool has_body = status_code >= 200 && status_code != 204 && status_code != 304;
+        bool head = i->second.head;
+        write_headers(i, status_code, headers, has_body ? (int64_t)body.size() : 0);
+        if (has_body && !body.empty() && !head) {
+            if (owned != nullptr && i->second.pending.empty()) {
+                i->second.pending = std::move(*owned);
+                _pending_bytes += i->second.pending.size();
+                i->second.length_left = 0;
+                i->second.ended = true;
+                flush(i);
+            } else {
+                queue_data(i, body.data(), body.size(), true);
+            }
+        }
+        commit();
+        return true;
+    }
+
+    static uint32_t read32(const uint8_t * p)
+    {
+        return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+    }
+
+    static void put32(char * p, uint32_t v)
+    {
+        p[0] = (char)(v >> 24);
+        p[1] = (char)(v >> 16);
+        p[2] = (char)(v >> 8);
+        p[3] = (char)v;
+    }
+
+    static size_t put_setting(char * p, uint16_t id, uint32_t value)
+    {
+        p[0] = (char)(id >> 8);
+        p[1] = (char)id;
+        put32(p + 2, value);
+        return 6;
+    }
+
+    void frame(uint8_t type, uint8_t flags, uint32_t id, const char * payload, size_t len)
+    {
+        char h[9];
+        h[0] = (char)(len >> 16);
+        h[1] = (char)(len >> 8);
+        h[2] = (char)len;
+        h[3] = (char)type;
+        h[4] = (char)flags;
+        put32(h + 5, id);
+        _out.append(h, 9);
+        if (len >= 4096) {
+            /* large DATA goes to the writer as is instead of through _out */
+            commit();
+            _writer(payload, len);
+            return;
+        }
+        _out.append(payload, len);
+    }
+
+    void commit()
+    {
+        if (!_out.empty()) {
+            _writer(_out.data(), _out.size());
+            _out.clear();
+        }
+    }
+
+    void window_update(uint32_t id, uint32_t increment)
+    {
+        char p[4];
+        put32(p, increment);
+        frame(frame_window_update, 0, id, p, 4);
+    }
+
+    void rst(uint32_t id, error_code code)
+    {
+        char p[4];
+        put32(p, code);
+        frame(frame_rst_stream, 0, id, p, 4);
+    }
+
+    void goaway(error_code code)
+    {
+        char p[8];
+        put32(p, _last_stream);
+        put32(p + 4, code);
+        frame(frame_goaway, 0, 0, p, 8);
+    }
+
+    /* connection error */
+    bool fail(error_code code)
+    {
+        goaway(code);
+        commit();
+        _dead = true;
+        return false;
+    }
+
+    void reset(std::map<uint32_t, stream>::iterator i, error_code code)
+    {
+        rst(i->first, code);
+        erase(i);
+    }
+
+    void erase(std::map<uint32_t, stream>::iterator i)
+    {
+        _pending_bytes -= i->second.pending.size() - i->second.pending_off;
+        _streams.erase(i);
+    }
+
+    stream & open_stream(uint32_t id)
+    {
+        auto & s = _streams[id];
+        /* the client may use the default window until it saw our SETTINGS */
+        s.recv_window = _settings_acked ? _opts.initial_window_size : std::max<uint32_t>(_opts.initial_window_size, default_window);
+        s.send_window = _peer_initial_window;
+        return s;
+    }
+
+    bool on_frame(uint8_t type, uint8_t flags, uint32_t id, const uint8_t * p, uint32_t len)
+    {
+        if (_continuing != 0 && (type != frame_continuation || id != _continuing)) {
+            return fail(protocol_error);
+        }
+        if (!_settings_seen && type != frame_settings) {
+            return fail(protocol_error);
+        }
+        switch (type) {
+            case frame_data:
+                return on_data(flags, id, p, len);
+            case frame_headers:
+                return on_headers(flags, id, p, len);
+            case frame_continuation:
+                if (_continuing == 0) {
+                    return fail(protocol_error);
+                }
+                if (_block.size() + len > (size_t)_opts.max_header_list_size * 2) {
+                    return fail(enhance_your_calm);
+                }
+                _block.append((const char *)p, len);
+                if (flags & flag_end_headers) {
+                    _continuing = 0;
+                    return on_header_block();
+                }
+                return true;
+            case frame_priority:
+                if (id == 0) {
+                    return fail(protocol_error);
+                }
+                if (len != 5) {
+                    rst(id, frame_size_error);
+                }
+                return true;
+            case frame_rst_stream: {
+                if (len != 4) {
+                    return fail(frame_size_error);
+                }
+                if (id == 0 || id > _last_stream) {
+                    return fail(protocol_error);
+                }
+                auto i = _streams.find(id);
+                if (i != _streams.end()) {
+                    erase(i);
+                }
+                return true;
+            }
+            case frame_settings:
+                if (id != 0) {
+                    return fail(protocol_error);
+                }
+                if (flags & flag_ack) {
+                    if (len != 0) {
+                        return fail(frame_size_error);
+                    }
+                    settings_acked();
+                    return true;
+                }
+                if (len % 6 != 0) {
+                    return fail(frame_size_error);
+                }
+                _settings_seen = true;
+                if (!apply_settings(p, len)) {
+                    return false;
+                }
+                frame(frame_settings, flag_ack, 0, nullptr, 0);
+                return true;
+            case frame_push_promise:
+                return fail(protocol_error);
+            case frame_ping:
+                if (len != 8) {
+                    return fail(frame_size_error);
+                }
+                if (id != 0) {
+                    return fail(protocol_error);
+                }
+                if (!(flags & flag_ack)) {
+                    frame(frame_ping, flag_ack, 0, (const char *)p, 8);
+                }
+                return true;
+            case frame_goaway:
+                if (id != 0) {
+                    return fail(protocol_error);
+                }
+                /* the client opens nothing new, what is open gets answered */
+                return true;
+            case frame_window_update:
+                return on_window_update(id, p, len);
+            default:
+                /* unknown frame types are ignored */
+                return true;
+        }
+    }
+
+    bool on_headers(uint8_t flags, uint32_t id, const uint8_t * p, uint32_t len)
+    {
+        if (id == 0 || (id & 1) == 0) {
+            return fail(protocol_error);
+        }
+        size_t off = 0;
+        size_t pad = 0;
+        if (flags & flag_padded) {
+            if (len < 1) {
+                return fail(protocol_error);
+            }
+            pad = p[0];
+            off = 1;
+        }
+        if (flags & flag_priority) {
+            off += 5;
+        }
+        if (off + pad > len) {
+            return fail(protocol_error);
+        }
+        _block.assign((const char *)p + off, len - off - pad);
+        _block_stream = id;
+        _block_end_stream = (flags & flag_end_stream) != 0;
+        if (flags & flag_end_headers) {
+            return on_header_block();
+        }
+        _continuing = id;
+        return true;
+    }
+
+    bool on_header_block()
+    {
+        _fields.clear();
+        bool too_large;
+        if (!_decoder.decode((const uint8_t *)_block.data(), _block.size(), _fields, _opts.max_header_list_size, too_large)) {
+            return fail(compression_error);
+        }
+        auto id = _block_stream;
+        auto i = _streams.find(id);
+        if (i != _streams.end()) {
+            /* trailers, only allowed to end the request */
+            if (i->second.remote_closed || !_block_end_stream) {
+                reset(i, protocol_error);
+                return true;
+            }
+            return end_request(i);
+        }
+        if (id <= _last_stream) {
+            /* a stream we already reset, its frames may still be under way */
+            return true;
+        }
+        _last_stream = id;
+        if (_going_away) {
+            return true;
+        }
+        if (_streams.size() >= _opts.max_concurrent_streams) {
+            rst(id, refused_stream);
+            return true;
+        }
+        std::string_view method;
+        std::string_view path;
+        std::string_view authority;
+        bool scheme = false;
+        bool regular = false;
+        for (auto & f : _fields) {
+            if (f.first.empty() || f.first[0] != ':') {
+                regular = true;
+                continue;
+            }
+            if (regular) {
+                /* pseudo headers come first */
+                method = std::string_view();
+                break;
+            }
+            if (f.first == ":method") {
+                method = f.second;
+            } else if (f.first == ":path") {
+                path = f.second;
+            } else if (f.first == ":authority") {
+                authority = f.second;
+            } else if (f.first == ":scheme") {
+                scheme = true;
+            } else {
+                method = std::string_view();
+                break;
+            }
+        }
+        if (method.empty() || path.empty() || !scheme) {
+            rst(id, protocol_error);
+            return true;
+        }
+        auto & s = open_stream(id);
+        s.req = http_request(std::string(path), std::string(method));
+        s.head = method == "HEAD";
+        auto & headers = s.req.headers;
+        std::string cookie;
+        for (auto & f : _fields) {
+            if (f.first[0] == ':') {
+                continue;
+            }
+            if (f.first == "cookie") {
+                /* split into several fields for compression, one header again for the handlers */
+                if (!cookie.empty()) {
+                    cookie.append("; ", 2);
+                }
+                cookie.append(f.second);
+                continue;
+            }
+            headers.add(f.first, f.second);
+        }
+        if (!cookie.empty()) {
+            headers.set(known_header::cookie, cookie);
+        }
+        if (!authority.empty() && !headers.has(known_header::host)) {
+            headers.set(known_header::host, authority);
+        }
+        i = _streams.find(id);
+        if (too_large) {
+            i->second.remote_closed = _block_end_stream;
+            answer_early(i, 431);
+            return true;
+        }
+        if (_block_end_stream) {
+            return end_request(i);
+        }
+        return true;
+    }
+
+    bool on_data(uint8_t flags, uint32_t id, const uint8_t * p, uint32_t len)
+    {
+        if (id == 0 || id > _last_stream) {
+            return fail(protocol_error);
+        }
+        /* padding counts against the windows too */
+        _recv_window -= len;
+        if (_recv_window < 0) {
+            return fail(flow_control_error);
+        }
+        if (_recv_window <= (int64_t)_opts.connection_window_size / 2) {
+            window_update(0, (uint32_t)(_opts.connection_window_size - _recv_window));
+            _recv_window = _opts.connection_window_size;
+        }
+        size_t off = 0;
+        size_t pad = 0;
+        if (flags & flag_padded) {
+            if (len < 1) {
+                return fail(protocol_error);
+            }
+            pad = p[0];
+            off = 1;
+        }
+        if (off + pad > len) {
+            return fail(protocol_error);
+        }
+        auto i = _streams.find(id);
+        if (i == _streams.end()) {
+            /* reset or answered early */
+            return true;
+        }
+        auto & s = i->second;
+        if (s.remote_closed) {
+            reset(i, stream_closed);
+            return true;
+        }
+        s.recv_window -= len;
+        int64_t slack = _settings_acked ? 0 : std::max<int64_t>(0, (int64_t)default_window - _opts.initial_window_size);
+        if (s.recv_window < -slack) {
+            reset(i, flow_control_error);
+            return true;
+        }
+        if (s.req.body.size() + len - off - pad > _opts.max_body_size) {
+            answer_early(i, 413);
+            return true;
+        }
+        s.req.body.append((const char *)p + off, len - off - pad);
+        if (flags & flag_end_stream) {
+            return end_request(i);
+        }
+        if (s.recv_window <= (int64_t)_opts.initial_window_size / 2) {
+            window_update(id, (uint32_t)(_opts.initial_window_size - s.recv_window));
+            s.recv_window = _opts.initial_window_size;
+        }
+        return true;
+    }
+
+    bool on_window_update(uint32_t id, const uint8_t * p, uint32_t len)
+    {
+        if (len != 4) {
+            return fail(frame_size_error);
+        }
+        uint32_t increment = read32(p) & 0x7fffffff;
+        if (id == 0) {
+            if (increment == 0) {
+                return fail(protocol_error);
+            }
+            _send_window += increment;
+            if (_send_window > max_window) {
+                return fail(flow_control_error);
+            }
+            flush_all();
+            return true;
+        }
+        if (id > _last_stream) {
+            return fail(protocol_error);
+        }
+        auto i = _streams.find(id);
+        if (i == _streams.end()) {
+            return true;
+        }
+        if (increment == 0) {
+            reset(i, protocol_error);
+            return true;
+        }
+        i->second.send_window += increment;
+        if (i->second.send_window > max_window) {
+            reset(i, flow_control_error);
+            return true;
+        }
+        flush(i);
+        return true;
+    }
+
+    bool apply_settings(const uint8_t * p, size_t len)
+    {
+        for (size_t off = 0; off + 6 <= len; off += 6) {
+            uint16_t id = (p[off] << 8) | p[off + 1];
+            uint32_t value = read32(p + off + 2);
+            switch (id) {
+                case 1:
+                    _encoder.set_max_table_size(value);
+                    break;
+                case 2:
+                    if (value > 1) {
+                        return fail(protocol_error);
+                    }
+                    break;
+                case 4: {
+                    if (value > max_window) {
+                        return fail(flow_control_error);
+                    }
+                    int64_t delta = (int64_t)value - _peer_initial_window;
+                    _peer_initial_window = value;
+                    for (auto & s : _streams) {
+                        s.second.send_window += delta;
+                        if (s.second.send_window > max_window) {
+                            return fail(flow_control_error);
+                        }
+                    }
+                    break;
+                }
+                case 5:
+                    if (value < 16384 || value > 16777215) {
+                        return fail(protocol_error);
+                    }
+                    _peer_max_frame = value;
+                    break;
+                default:
+                    /* SETTINGS_MAX_CONCURRENT_STREAMS only limits pushes, we don't push */
+                    break;
+            }
+        }
+        flush_all();
+        return true;
+    }
+
+    void settings_acked()
+    {
+        if (_settings_acked) {
+            return;
+        }
+        _settings_acked = true;
+        if (_opts.initial_window_size < default_window) {
+            /* the streams opened before were granted the default window */
+            for (auto & s : _streams) {
+                s.second.recv_window -= default_window - _opts.initial_window_size;
+            }
+        }
+    }
+
+    /* the whole request is in, hand it over */
+    bool end_request(std::map<uint32_t, stream>::iterator i)
+    {
+        i->second.remote_closed = true;
+        /* the callback may answer, and so erase the stream, right away */
+        http_request req = std::move(i->second.req);
+        _on_request(i->first, req);
+        return true;
+    }
+
+    void answer_early(std::map<uint32_t, stream>::iterator i, int status_code)
+    {
+        auto body = status_reason(status_code);
+        write_headers(i, status_code, nullptr, strlen(body));
+        i = _streams.find(i->first);
+        if (i != _streams.end()) {
+            queue_data(i, body, strlen(body), true);
+        }
+    }
+
+    static bool connection_specific(const http_headers::entry & h)
+    {
+        switch (h.id) {
+            case known_header::connection:
+            case known_header::content_length:
+            case known_header::transfer_encoding:
+            case known_header::upgrade:
+                return true;
+            default:
+                return http_headers::iequals(h.first, "keep-alive") || http_headers::iequals(h.first, "proxy-connection");
+        }
+    }
+
+    /* values that change from response to response would only churn the dynamic table */
+    static bool indexable(const http_headers::entry & h)
+    {
+        switch (h.id) {
+            case known_header::date:
+            case known_header::etag:
+            case known_header::content_range:
+            case known_header::last_modified:
+            case known_header::location:
+            case known_header::set_cookie:
+                return false;
+            default:
+                return !http_headers::iequals(h.first, "age") && !http_headers::iequals(h.first, "expires");
+        }
+    }
+
+    /* length < 0 leaves the length open, 0 ends the stream with the headers */
+    void write_headers(std::map<uint32_t, stream>::iterator i, int status_code, const http_headers * headers, int64_t length)
+    {
+        auto & s = i->second;
+        thread_local std::string block;
+        thread_local std::string name;
+        block.clear();
+        _encoder.encode(block, ":status", std::to_string(status_code));
+        if (headers != nullptr) {
+            for (auto & h : *headers) {
+                if (connection_specific(h)) {
+                    continue;
+                }
+                name.assign(h.first);
+                for (auto & ch : name) {
+                    ch = (char)tolower((unsigned char)ch);
+                }
+                _encoder.encode(block, name, h.second, indexable(h));
+            }
+        }
+        if (length >= 0 && !(status_code < 200 || status_code == 204 || status_code == 304)) {
+            _encoder.encode(block, "content-length", std::to_string(length), false);
+        }
+        s.headers_sent = true;
+        s.length_left = length;
+        bool end = length == 0 || (s.head && length > 0);
+        size_t off = 0;
+        uint8_t type = frame_headers;
+        do {
+            size_t n = std::min<size_t>(block.size() - off, _peer_max_frame);
+            uint8_t flags = off + n == block.size() ? flag_end_headers : 0;
+            if (type == frame_headers && end) {
+                flags |= flag_end_stream;
+            }
+            frame(type, flags, i->first, block.data() + off, n);
+            off += n;
+            type = frame_continuation;
+        } while (off < block.size());
+        if (end) {
+            s.ended = true;
+            close_local(i);
+        }
+    }
+
+    void queue_data(std::map<uint32_t, stream>::iterator i, const char * p, size_t n, bool end)
+    {
+        auto & s = i->second;
+        if (s.length_left >= 0) {
+            n = (size_t)std::min<int64_t>((int64_t)n, s.length_left);
+            s.length_left -= n;
+            end = end || s.length_left == 0;
+        }
+        if (!s.head) {
+            s.pending.append(p, n);
+            _pending_bytes += n;
+        }
+        s.ended = s.ended || end;
+        flush(i);
+    }
+
+    /* DATA as far as the windows allow, may erase the stream once it ended */
+    void flush(std::map<uint32_t, stream>::iterator i)
+    {
+        auto & s = i->second;
+        while (true) {
+            size_t left = s.pending.size() - s.pending_off;
+            if (left == 0) {
+                if (s.ended) {
+                    frame(frame_data, flag_end_stream, i->first, nullptr, 0);
+                    close_local(i);
+                }
+                return;
+            }
+            int64_t window = std::min<int64_t>({ _send_window, s.send_window, (int64_t)_peer_max_frame, room() });
+            if (window <= 0) {
+                return;
+            }
+            size_t n = (size_t)std::min<int64_t>((int64_t)left, window);
+            bool last = s.ended && n == left;
+            frame(frame_data, last ? flag_end_stream : 0, i->first, s.pending.data() + s.pending_off, n);
+            _send_window -= n;
+            s.send_window -= n;
+            s.pending_off += n;
+            _pending_bytes -= n;
+            if (s.pending_off == s.pending.size()) {
+                s.pending.clear();
+                s.pending_off = 0;
+            }
+            if (last) {
+                close_local(i);
+                return;
+            }
+        }
+    }
+
+    /* what the transport may still take under max_buffered */
+    int64_t room() const
+    {
+        if (_buffered == nullptr) {
+            return max_window;
+        }
+        size_t buffered = _buffered() + _out.size();
+        return buffered < _opts.max_buffered ? (int64_t)(_opts.max_buffered - buffered) : 0;
+    }
+
+    void flush_all()
+    {
+        for (auto i = _streams.begin(); i != _streams.end() && _send_window > 0 && room() > 0;) {
+            auto next = std::next(i);
+            if (i->second.headers_sent && (i->second.pending.size() > i->second.pending_off)) {
+                flush(i);
+            }
+            i = next;
+        }
+    }
+
+    /* our END_STREAM is out */
+    void close_local(std::map<uint32_t, stream>::iterator i)
+    {
+        if (!i->second.remote_closed) {
+            /* answered before the request ended, the rest of it is not wanted */
+            rst(i->first, no_error);
+        }
+        erase(i);
+    }
+};
+
+}}
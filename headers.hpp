@@ -0,0 +1,402 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <map>
+#include <cstdint>
+#include <cctype>
+
+namespace boo { namespace network {
+
+/* headers the server and client look at themselves, resolved once when set */
+enum class known_header : uint8_t {
+    none,
+    accept,
+    accept_encoding,
+    authorization,
+    cache_control,
+    connection,
+    content_encoding,
+    content_length,
+    content_range,
+    content_type,
+    cookie,
+    date,
+    etag,
+    host,
+    if_modified_since,
+    if_none_match,
+    if_range,
+    last_modified,
+    location,
+    range,
+    retry_after,
+    server,
+    set_cookie,
+    transfer_encoding,
+    upgrade,
+    user_agent,
+    vary,
+    count
+};
+
+/*
+ * Header list with case-insensitive names. The first inline_capacity entries
+ * live inside the object, more spill into a vector. Each entry keeps the
+ * hash of its lower-cased name and its known_header slot, so lookups compare
+ * an integer before touching the strings.
+ *
+ * Iteration yields entries with first/second like std::map did, in insertion
+ * order.
+ */
+class http_headers {
+public:
+    static const size_t inline_capacity = 16;
+
+    struct entry {
+        std::string first;
+        std::string second;
+        uint32_t hash = 0;
+        known_header id = known_header::none;
+    };
+
+    template<class E, class H>
+    class basic_iterator {
+        H * _h;
+        size_t _i;
+    public:
+        basic_iterator(H * h, size_t i): _h(h), _i(i) {}
+        E & operator*() const { return _h->at(_i); }
+        E * operator->() const { return &_h->at(_i); }
+        basic_iterator & operator++() { ++_i; return *this; }
+        bool operator==(const basic_iterator & o) const { return _i == o._i; }
+        bool operator!=(const basic_iterator & o) const { return _i != o._i; }
+        size_t index() const { return _i; }
+    };
+
+    typedef basic_iterator<entry, http_headers> iterator;
+    typedef basic_iterator<const entry, const http_headers> const_iterator;
+
+private:
+    entry _inline[inline_capacity];
+    std::vector<entry> _more;
+    size_t _size = 0;
+
+public:
+    http_headers() {}
+
+    http_headers(const std::map<std::string, std::string> & m)
+    {
+        for (auto & h : m) {
+            add(h.first, h.second);
+        }
+    }
+
+    http_headers(std::initializer_list<std::pair<std::string, std::string>> l)
+    {
+        for (auto & h : l) {
+            set(h.first, h.second);
+        }
+    }
+
+    static uint32_t hash(std::string_view name)
+    {
+        /* FNV-1a over the lower-cased name */
+        uint32_t h = 2166136261u;
+        for (unsigned char c : name) {
+            h ^= (uint32_t)tolower(c);
+            h *= 16777619u;
+        }
+        return h;
+    }
+
+    static bool iequals(std::string_view a, std::string_view b)
+    {
+        if (a.size() != b.size()) {
+            return false;
+        }
+        for (size_t i = 0; i < a.size(); ++i) {
+            if (tolower((unsigned char)a[i]) != tolower((unsigned char)b[i])) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    static std::string_view name_of(known_header id)
+    {
+        return known_names()[(size_t)id];
+    }
+
+    static known_header lookup(std::string_view name, uint32_t h)
+    {
+        auto & hashes = known_hashes();
+        auto & names = known_names();
+        for (size_t i = 1; i < (size_t)known_header::count; ++i) {
+            if (hashes[i] == h && iequals(names[i], name)) {
+                return (known_header)i;
+            }
+        }
+        return known_header::none;
+    }
+
+    size_t size() const
+    {
+        return _size;
+    }
+
+    bool empty() const
+    {
+        return _size == 0;
+    }
+
+    void clear()
+    {
+        for (size_t i = 0; i < _size && i < inline_capacity; ++i) {
+            _inline[i] = entry();
+        }
+        _more.clear();
+        _size = 0;
+    }
+
+    entry & at(size_t i)
+    {
+        return i < inline_capacity ? _inline[i] : _more[i - inline_capacity];
+    }
+
+    const entry & at(size_t i) const
+    {
+        return i < inline_capacity ? _inline[i] : _more[i - inline_capacity];
+    }
+
+    iterator begin() { return iterator(this, 0); }
+    iterator end() { return iterator(this, _size); }
+    const_iterator begin() const { return const_iterator(this, 0); }
+    const_iterator end() const { return const_iterator(this, _size); }
+
+    iterator find(std::string_view name)
+    {
+        return iterator(this, index_of(name, hash(name)));
+    }
+
+    const_iterator find(std::string_view name) const
+    {
+        return const_iterator(this, index_of(name, hash(name)));
+    }
+
+    iterator find(known_header id)
+    {
+        return iterator(this, index_of(id));
+    }
+
+    const_iterator find(known_header id) const
+    {
+        return const_iterator(this, index_of(id));
+    }
+
+    size_t count(std::string_view name) const
+    {
+        return index_of(name, hash(name)) < _size ? 1 : 0;
+    }
+
+    bool has(known_header id) const
+    {
+        return index_of(id) < _size;
+    }
+
+    /* value of the first header with that name, empty when missing */
+    std::string_view get(std::string_view name) const
+    {
+        auto i = index_of(name, hash(name));
+        return i < _size ? std::string_view(at(i).second) : std::string_view();
+    }
+
+    std::string_view get(known_header id) const
+    {
+        auto i = index_of(id);
+        return i < _size ? std::string_view(at(i).second) : std::string_view();
+    }
+
+    /* inserts an empty value when missing, like std::map */
+    std::string & operator[](std::string_view name)
+    {
+        auto h = hash(name);
+        auto i = index_of(name, h);
+        if (i < _size) {
+            return at(i).second;
+        }
+        return push(name, std::string_view(), h).second;
+    }
+
+    /* replaces the first header of that name or appends one */
+    void set(std::string_view name, std::string_view value)
+    {
+        auto h = hash(name);
+        auto i = index_of(name, h);
+        if (i < _size) {
+            at(i).second.assign(value.data(), value.size());
+            return;
+        }
+        push(name, value, h);
+    }
+
+    void set(known_header id, std::string_view value)
+    {
+        auto i = index_of(id);
+        if (i < _size) {
+            at(i).second.assign(value.data(), value.size());
+            return;
+        }
+        auto name = name_of(id);
+        push(name, value, known_hashes()[(size_t)id]);
+    }
+
+    /* appends even if the name exists, e.g. for Set-Cookie */
+    void add(std::string_view name, std::string_view value)
+    {
+        push(name, value, hash(name));
+    }
+
+    size_t erase(std::string_view name)
+    {
+        auto h = hash(name);
+        size_t n = 0;
+        for (size_t i = index_of(name, h); i < _size; i = index_of(name, h)) {
+            remove(i);
+            n++;
+        }
+        return n;
+    }
+
+    void erase(iterator it)
+    {
+        if (it.index() < _size) {
+            remove(it.index());
+        }
+    }
+
+    /* "Name: value" lines joined by CRLF, without a trailing one (the form mg_send_head takes) */
+    void append_to(std::string & out) const
+    {
+        for (size_t i = 0; i < _size; ++i) {
+            auto & e = at(i);
+            if (i > 0) {
+                out.append("\r\n", 2);
+            }
+            out.append(e.first);
+            out.append(": ", 2);
+            out.append(e.second);
+        }
+    }
+
+    /* bytes append_to() would add */
+    size_t serialized_size() const
+    {
+        size_t n = 0;
+        for (size_t i = 0; i < _size; ++i) {
+            n += at(i).first.size() + at(i).second.size() + 4;
+        }
+        return n;
+    }
+
+private:
+    size_t index_of(std::string_view name, uint32_t h) const
+    {
+        for (size_t i = 0; i < _size; ++i) {
+            auto & e = at(i);
+            if (e.hash == h && iequals(e.first, name)) {
+                return i;
+            }
+        }
+        return _size;
+    }
+
+    size_t index_of(known_header id) const
+    {
+        for (size_t i = 0; i < _size; ++i) {
+            if (at(i).id == id) {
+                return i;
+            }
+        }
+        return _size;
+    }
+
+    entry & push(std::string_view name, std::string_view value, uint32_t h)
+    {
+        entry * e;
+        if (_size < inline_capacity) {
+            e = &_inline[_size];
+        } else {
+            _more.emplace_back();
+            e = &_more.back();
+        }
+        _size++;
+        e->first.assign(name.data(), name.size());
+        e->second.assign(value.data(), value.size());
+        e->hash = h;
+        e->id = lookup(name, h);
+        return *e;
+    }
+
+    void remove(size_t i)
+    {
+        for (; i + 1 < _size; ++i) {
+            at(i) = std::move(at(i + 1));
+        }
+        if (_size > inline_capacity) {
+            _more.pop_back();
+        } else {
+            _inline[_size - 1] = entry();
+        }
+        _size--;
+    }
+
+    static const std::vector<std::string_view> & known_names()
+    {
+        static const std::vector<std::string_view> names = {
+            "",
+            "Accept",
+            "Accept-Encoding",
+            "Authorization",
+            "Cache-Control",
+            "Connection",
+            "Content-Encoding",
+            "Content-Length",
+            "Content-Range",
+            "Content-Type",
+            "Cookie",
+            "Date",
+            "ETag",
+            "Host",
+            "If-Modified-Since",
+            "If-None-Match",
+            "If-Range",
+            "Last-Modified",
+            "Location",
+            "Range",
+            "Retry-After",
+            "Server",
+            "Set-Cookie",
+            "Transfer-Encoding",
+            "Upgrade",
+            "User-Agent",
+            "Vary",
+        };
+        return names;
+    }
+
+    static const std::vector<uint32_t> & known_hashes()
+    {
+        static const std::vector<uint32_t> hashes = []() {
+            std::vector<uint32_t> v;
+            for (auto n : known_names()) {
+                v.push_back(hash(n));
+            }
+            return v;
+        }();
+        return hashes;
+    }
+};
+
+}}
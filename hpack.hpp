@@ -0,0 +1,516 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <deque>
+#include <utility>
+#include <cstdint>
+#include <cstddef>
+
+namespace boo { namespace network {
+
+/*
+ * HPACK (RFC 7541) primitives shared by hpack_decoder and hpack_encoder:
+ * prefixed integers, the static table and the Huffman code.
+ */
+class hpack {
+public:
+    typedef std::pair<std::string, std::string> field;
+
+    static const size_t static_size = 61;
+    /* per entry overhead counted against the dynamic table size */
+    static const size_t entry_overhead = 32;
+
+    static const field & static_entry(size_t index)
+    {
+        static const field table[static_size + 1] = {
+            { "", "" },
+            { ":authority", "" },
+            { ":method", "GET" },
+            { ":method", "POST" },
+            { ":path", "/" },
+            { ":path", "/index.html" },
+            { ":scheme", "http" },
+            { ":scheme", "https" },
+            { ":status", "200" },
+            { ":status", "204" },
+            { ":status", "206" },
+            { ":status", "304" },
+            { ":status", "400" },
+            { ":status", "404" },
+            { ":status", "500" },
+            { "accept-charset", "" },
+            { "accept-encoding", "gzip, deflate" },
+            { "accept-language", "" },
+            { "accept-ranges", "" },
+            { "accept", "" },
+            { "access-control-allow-origin", "" },
+            { "age", "" },
+            { "allow", "" },
+            { "authorization", "" },
+            { "cache-control", "" },
+            { "content-disposition", "" },
+            { "content-encoding", "" },
+            { "content-language", "" },
+            { "content-length", "" },
+            { "content-location", "" },
+            { "content-range", "" },
+            { "content-type", "" },
+            { "cookie", "" },
+            { "date", "" },
+            { "etag", "" },
+            { "expect", "" },
+            { "expires", "" },
+            { "from", "" },
+            { "host", "" },
+            { "if-match", "" },
+            { "if-modified-since", "" },
+            { "if-none-match", "" },
+            { "if-range", "" },
+            { "if-unmodified-since", "" },
+            { "last-modified", "" },
+            { "link", "" },
+            { "location", "" },
+            { "max-forwards", "" },
+            { "proxy-authenticate", "" },
+            { "proxy-authorization", "" },
+            { "range", "" },
+            { "referer", "" },
+            { "refresh", "" },
+            { "retry-after", "" },
+            { "server", "" },
+            { "set-cookie", "" },
+            { "strict-transport-security", "" },
+            { "transfer-encoding", "" },
+            { "user-agent", "" },
+            { "vary", "" },
+            { "via", "" },
+            { "www-authenticate", "" },
+        };
+        return table[index];
+    }
+
+    static void encode_int(std::string & out, uint8_t first, int prefix_bits, uint64_t value)
+    {
+        uint64_t max = (1u << prefix_bits) - 1;
+        if (value < max) {
+            out.push_back((char)(first | value));
+            return;
+        }
+        out.push_back((char)(first | max));
+        value -= max;
+        while (value >= 128) {
+            out.push_back((char)(0x80 | (value & 0x7f)));
+            value >>= 7;
+        }
+        out.push_back((char)value);
+    }
+
+    /* false on truncated input or a value that does not fit 32 bits */
+    static bool decode_int(const uint8_t *& p, const uint8_t * end, int prefix_bits, uint64_t & value)
+    {
+        if (p == end) {
+            return false;
+        }
+        uint64_t max = (1u << prefix_bits) - 1;
+        value = *p++ & max;
+        if (value < max) {
+            return true;
+        }
+        for (int shift = 0; p != end; shift += 7) {
+            if (shift > 28) {
+                return false;
+            }
+            uint8_t b = *p++;
+            value += (uint64_t)(b & 0x7f) << shift;
+            if ((b & 0x80) == 0) {
+                return value <= 0xffffffffu;
+            }
+        }
+        return false;
+    }
+
+    /* string literal, Huffman coded when that is shorter */
+    static void encode_string(std::string & out, std::string_view s)
+    {
+        size_t bits = 0;
+        for (unsigned char c : s) {
+            bits += code_lengths()[c];
+        }
+        size_t huffman_len = (bits + 7) / 8;
+        if (huffman_len >= s.size()) {
+            encode_int(out, 0x00, 7, s.size());
+            out.append(s.data(), s.size());
+            return;
+        }
+        encode_int(out, 0x80, 7, huffman_len);
+        uint64_t acc = 0;
+        int n = 0;
+        for (unsigned char c : s) {
+            acc = (acc << code_lengths()[c]) | codes()[c];
+            n += code_lengths()[c];
+            while (n >= 8) {
+                n -= 8;
+                out.push_back((char)(acc >> n));
+            }
+        }
+        if (n > 0) {
+            /* padded with the most significant bits of EOS, all ones */
+            out.push_back((char)((acc << (8 - n)) | (0xff >> n)));
+        }
+    }
+
+    static bool decode_string(const uint8_t *& p, const uint8_t * end, std::string & out)
+    {
+        if (p == end) {
+            return false;
+        }
+        bool huffman = (*p & 0x80) != 0;
+        uint64_t len;
+        if (!decode_int(p, end, 7, len) || len > (uint64_t)(end - p)) {
+            return false;
+        }
+        out.clear();
+        bool ok = huffman ? huffman_decode(p, (size_t)len, out) : (out.assign((const char *)p, (size_t)len), true);
+        p += len;
+        return ok;
+    }
+
+    static bool huffman_decode(const uint8_t * p, size_t len, std::string & out)
+    {
+        auto & tree = decode_tree();
+        int node = 0;
+        /* bits read since the last symbol, and whether they were all ones */
+        int pending = 0;
+        bool ones = true;
+        for (size_t i = 0; i < len; ++i) {
+            for (int b = 7; b >= 0; --b) {
+                int bit = (p[i] >> b) & 1;
+                node = tree[node].child[bit];
+                pending++;
+                ones = ones && bit == 1;
+                if (node < 0) {
+                    return false;
+                }
+                if (tree[node].sym >= 0) {
+                    if (tree[node].sym == 256) {
+                        return false;
+                    }
+                    out.push_back((char)tree[node].sym);
+                    node = 0;
+                    pending = 0;
+                    ones = true;
+                }
+            }
+        }
+        return pending < 8 && ones;
+    }
+
+private:
+    struct tree_node {
+        int child[2] = { -1, -1 };
+        int sym = -1;
+    };
+
+    static const uint32_t * codes()
+    {
+        static const uint32_t table[257] = {
+        0x1ff8, 0x7fffd8, 0xfffffe2, 0xfffffe3, 0xfffffe4, 0xfffffe5, 0xfffffe6, 0xfffffe7,
+        0xfffffe8, 0xffffea, 0x3ffffffc, 0xfffffe9, 0xfffffea, 0x3ffffffd, 0xfffffeb, 0xfffffec,
+        0xfffffed, 0xfffffee, 0xfffffef, 0xffffff0, 0xffffff1, 0xffffff2, 0x3ffffffe, 0xffffff3,
+        0xffffff4, 0xffffff5, 0xffffff6, 0xffffff7, 0xffffff8, 0xffffff9, 0xffffffa, 0xffffffb,
+        0x14, 0x3f8, 0x3f9, 0xffa, 0x1ff9, 0x15, 0xf8, 0x7fa,
+        0x3fa, 0x3fb, 0xf9, 0x7fb, 0xfa, 0x16, 0x17, 0x18,
+        0x0, 0x1, 0x2, 0x19, 0x1a, 0x1b, 0x1c, 0x1d,
+        0x1e, 0x1f, 0x5c, 0xfb, 0x7ffc, 0x20, 0xffb, 0x3fc,
+        0x1ffa, 0x21, 0x5d, 0x5e, 0x5f, 0x60, 0x61, 0x62,
+        0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a,
+        0x6b, 0x6c, 0x6d, 0x6e, 0x6f, 0x70, 0x71, 0x72,
+        0xfc, 0x73, 0xfd, 0x1ffb, 0x7fff0, 0x1ffc, 0x3ffc, 0x22,
+        0x7ffd, 0x3, 0x23, 0x4, 0x24, 0x5, 0x25, 0x26,
+        0x27, 0x6, 0x74, 0x75, 0x28, 0x29, 0x2a, 0x7,
+        0x2b, 0x76, 0x2c, 0x8, 0x9, 0x2d, 0x77, 0x78,
+        0x79, 0x7a, 0x7b, 0x7ffe, 0x7fc, 0x3ffd, 0x1ffd, 0xffffffc,
+        0xfffe6, 0x3fffd2, 0xfffe7, 0xfffe8, 0x3fffd3, 0x3fffd4, 0x3fffd5, 0x7fffd9,
+        0x3fffd6, 0x7fffda, 0x7fffdb, 0x7fffdc, 0x7fffdd, 0x7fffde, 0xffffeb, 0x7fffdf,
+        0xffffec, 0xffffed, 0x3fffd7, 0x7fffe0, 0xffffee, 0x7fffe1, 0x7fffe2, 0x7fffe3,
+        0x7fffe4, 0x1fffdc, 0x3fffd8, 0x7fffe5, 0x3fffd9, 0x7fffe6, 0x7fffe7, 0xffffef,
+        0x3fffda, 0x1fffdd, 0xfffe9, 0x3fffdb, 0x3fffdc, 0x7fffe8, 0x7fffe9, 0x1fffde,
+        0x7fffea, 0x3fffdd, 0x3fffde, 0xfffff0, 0x1fffdf, 0x3fffdf, 0x7fffeb, 0x7fffec,
+        0x1fffe0, 0x1fffe1, 0x3fffe0, 0x1fffe2, 0x7fffed, 0x3fffe1, 0x7fffee, 0x7fffef,
+        0xfffea, 0x3fffe2, 0x3fffe3, 0x3fffe4, 0x7ffff0, 0x3fffe5, 0x3fffe6, 0x7ffff1,
+        0x3ffffe0, 0x3ffffe1, 0xfffeb, 0x7fff1, 0x3fffe7, 0x7ffff2, 0x3fffe8, 0x1ffffec,
+        0x3ffffe2, 0x3ffffe3, 0x3ffffe4, 0x7ffffde, 0x7ffffdf, 0x3ffffe5, 0xfffff1, 0x1ffffed,
+        0x7fff2, 0x1fffe3, 0x3ffffe6, 0x7ffffe0, 0x7ffffe1, 0x3ffffe7, 0x7ffffe2, 0xfffff2,
+        0x1fffe4, 0x1fffe5, 0x3ffffe8, 0x3ffffe9, 0xffffffd, 0x7ffffe3, 0x7ffffe4, 0x7ffffe5,
+        0xfffec, 0xfffff3, 0xfffed, 0x1fffe6, 0x3fffe9, 0x1fffe7, 0x1fffe8, 0x7ffff3,
+        0x3fffea, 0x3fffeb, 0x1ffffee, 0x1ffffef, 0xfffff4, 0xfffff5, 0x3ffffea, 0x7ffff4,
+        0x3ffffeb, 0x7ffffe6, 0x3ffffec, 0x3ffffed, 0x7ffffe7, 0x7ffffe8, 0x7ffffe9, 0x7ffffea,
+        0x7ffffeb, 0xffffffe, 0x7ffffec, 0x7ffffed, 0x7ffffee, 0x7ffffef, 0x7fffff0, 0x3ffffee,
+            0x3fffffff,
+        };
+        return table;
+    }
+
+    static const uint8_t * code_lengths()
+    {
+        static const uint8_t table[257] = {
+        13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+        28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+        6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+        5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+        13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+        7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+        15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+        6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+        20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+        24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+        22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+        21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+        26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+        19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+        20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+        26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+            30,
+        };
+        return table;
+    }
+
+    static const std::vector<tree_node> & decode_tree()
+    {
+        static const std::vector<tree_node> tree = []() {
+            std::vector<tree_node> t(1);
+            for (int sym = 0; sym <= 256; ++sym) {
+                int node = 0;
+                for (int b = code_lengths()[sym] - 1; b >= 0; --b) {
+                    int bit = (codes()[sym] >> b) & 1;
+                    if (t[node].child[bit] < 0) {
+                        t[node].child[bit] = (int)t.size();
+                        t.emplace_back();
+                    }
+                    node = t[node].child[bit];
+                }
+                t[node].sym = sym;
+            }
+            return t;
+        }();
+        return tree;
+    }
+};
+
+/* the dynamic table, newest entry first */
+class hpack_table {
+    std::deque<hpack::field> _entries;
+    size_t _size = 0;
+    size_t _max_size;
+
+public:
+    explicit hpack_table(size_t max_size = 4096): _max_size(max_size) {}
+
+    size_t size() const
+    {
+        return _size;
+    }
+
+    size_t max_size() const
+    {
+        return _max_size;
+    }
+
+    size_t count() const
+    {
+        return _entries.size();
+    }
+
+    /* 0 based, 0 is the newest */
+    const hpack::field & at(size_t i) const
+    {
+        return _entries[i];
+    }
+
+    void set_max_size(size_t max_size)
+    {
+        _max_size = max_size;
+        evict(0);
+    }
+
+    void add(std::string_view name, std::string_view value)
+    {
+        size_t size = name.size() + value.size() + hpack::entry_overhead;
+        if (size > _max_size) {
+            /* an entry larger than the table empties it */
+            _entries.clear();
+            _size = 0;
+            return;
+        }
+        evict(size);
+        _entries.emplace_front(std::string(name), std::string(value));
+        _size += size;
+    }
+
+private:
+    void evict(size_t room)
+    {
+        while (!_entries.empty() && _size + room > _max_size) {
+            auto & e = _entries.back();
+            _size -= e.first.size() + e.second.size() + hpack::entry_overhead;
+            _entries.pop_back();
+        }
+    }
+};
+
+class hpack_decoder {
+    hpack_table _table;
+    /* the limit we announced in SETTINGS_HEADER_TABLE_SIZE */
+    size_t _max_table_size;
+
+public:
+    explicit hpack_decoder(size_t max_table_size = 4096): _table(max_table_size), _max_table_size(max_table_size) {}
+
+    /*
+     * Decodes a complete header block into out. Returns false on a
+     * compression error, which is fatal for the connection, or once the
+     * decoded list exceeds max_list_size (counted like SETTINGS_MAX_HEADER_LIST_SIZE).
+     */
+    bool decode(const uint8_t * p, size_t len, std::vector<hpack::field> & out, size_t max_list_size, bool & too_large)
+    {
+        const uint8_t * end = p + len;
+        size_t list_size = 0;
+        too_large = false;
+        bool fields_seen = false;
+        while (p != end) {
+            uint8_t b = *p;
+            uint64_t index;
+            if (b & 0x80) {
+                if (!hpack::decode_int(p, end, 7, index) || index == 0) {
+                    return false;
+                }
+                auto e = lookup(index);
+                if (e == nullptr) {
+                    return false;
+                }
+                out.push_back(*e);
+            } else if ((b & 0xe0) == 0x20) {
+                /* size updates may only open a block */
+                if (fields_seen || !hpack::decode_int(p, end, 5, index) || index > _max_table_size) {
+                    return false;
+                }
+                _table.set_max_size((size_t)index);
+                continue;
+            } else {
+                bool indexing = (b & 0xc0) == 0x40;
+                if (!hpack::decode_int(p, end, indexing ? 6 : 4, index)) {
+                    return false;
+                }
+                out.emplace_back();
+                auto & f = out.back();
+                if (index == 0) {
+                    if (!hpack::decode_string(p, end, f.first)) {
+                        return false;
+                    }
+                } else {
+                    auto e = lookup(index);
+                    if (e == nullptr) {
+                        return false;
+                    }
+                    f.first = e->first;
+                }
+                if (!hpack::decode_string(p, end, f.second)) {
+                    return false;
+                }
+                if (indexing) {
+                    _table.add(f.first, f.second);
+                }
+            }
+            fields_seen = true;
+            auto & f = out.back();
+            list_size += f.first.size() + f.second.size() + hpack::entry_overhead;
+            if (list_size > max_list_size) {
+                /* keep decoding, the table has to stay in sync with the peer */
+                too_large = true;
+                out.pop_back();
+            }
+        }
+        return true;
+    }
+
+private:
+    const hpack::field * lookup(uint64_t index) const
+    {
+        if (index <= hpack::static_size) {
+            return &hpack::static_entry((size_t)index);
+        }
+        index -= hpack::static_size + 1;
+        return index < _table.count() ? &_table.at((size_t)index) : nullptr;
+    }
+};
+
+/*
+ * Response side. Fields the caller marks as indexable go into the dynamic
+ * table so that repeated headers cost a byte or two on later responses.
+ */
+class hpack_encoder {
+    hpack_table _table;
+    /* the peer lowered SETTINGS_HEADER_TABLE_SIZE, the next block must say so */
+    bool _size_update = false;
+
+public:
+    explicit hpack_encoder(size_t max_table_size = 4096): _table(max_table_size) {}
+
+    /* the peer's SETTINGS_HEADER_TABLE_SIZE, we never use more than 4096 */
+    void set_max_table_size(size_t max_size)
+    {
+        max_size = max_size < 4096 ? max_size : 4096;
+        if (max_size != _table.max_size()) {
+            _table.set_max_size(max_size);
+            _size_update = true;
+        }
+    }
+
+    /* name must be lower case */
+    void encode(std::string & out, std::string_view name, std::string_view value, bool index = true)
+    {
+        if (_size_update) {
+            _size_update = false;
+            hpack::encode_int(out, 0x20, 5, _table.max_size());
+        }
+        size_t name_index = 0;
+        for (size_t i = 1; i <= hpack::static_size; ++i) {
+            auto & e = hpack::static_entry(i);
+            if (e.first == name) {
+                if (e.second == value) {
+                    return hpack::encode_int(out, 0x80, 7, i);
+                }
+                if (name_index == 0) {
+                    name_index = i;
+                }
+            }
+        }
+        for (size_t i = 0; i < _table.count(); ++i) {
+            auto & e = _table.at(i);
+            if (e.first == name) {
+                if (e.second == value) {
+                    return hpack::encode_int(out, 0x80, 7, hpack::static_size + 1 + i);
+                }
+                if (name_index == 0) {
+                    name_index = hpack::static_size + 1 + i;
+                }
+            }
+        }
+        if (index) {
+            hpack::encode_int(out, 0x40, 6, name_index);
+        } else {
+            hpack::encode_int(out, 0x00, 4, name_index);
+        }
+        if (name_index == 0) {
+            hpack::encode_string(out, name);
+        }
+        hpack::encode_string(out, value);
+        if (index) {
+            _table.add(name, value);
+        }
+    }
+};
+
+}}
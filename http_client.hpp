@@ -2,6 +2,7 @@
 
 #include "3rd/mongoose.h"
 #include "http_message.hpp"
+#include "epoll_iface.hpp"
 #include <string>
 #include <map>
 #include <functional>
@@ -24,9 +25,11 @@ class http_client
     bool _connecting = false;
     bool _stopped = true;
     bool _mbr_valid = false;
+    bool _use_epoll = false;
     std::mutex _send_lock;
     std::mutex _lock;
     std::mutex _handle_lock;
+    std::mutex _connect_lock;
 
     std::list<std::pair<http_request, std::function<void(const http_response &)>>> _requests;
 
@@ -45,6 +48,11 @@ public:
         }
     }
 
+    void use_epoll(bool use = true)
+    {
+        _use_epoll = use;
+    }
+
     bool connect(const std::string & base, size_t poll_interval = 10)
     {
         _base = base;
@@ -61,7 +69,7 @@ public:
             return true;
         }
         if (!_mbr_valid) {
-            mg_mgr_init(&_mgr, NULL);
+            epoll_iface::mgr_init(&_mgr, NULL, _use_epoll);
             _mbr_valid = true;
         }
         _nc = mg_connect(&_mgr, _base.c_str(), http_client::mongoose_http_ev_handler);
@@ -132,8 +140,12 @@ public:
     bool send(const http_request & req, std::function<void(const http_response & )> handler)
     {
         if (!_connected) {
-            disconnect();
-            connect();
+            /* a sender that lost the race must not drop the connection just made */
+            std::lock_guard<std::mutex> locker(_connect_lock);
+            if (!_connected) {
+                disconnect();
+                connect();
+            }
         }
         if (_connected) {
             std::lock_guard<std::mutex> locker(_lock);
@@ -226,10 +238,14 @@ private:
     void do_send(const http_request & req)
     {
         std::string msg = req.method + " " + req.target.str() + " HTTP/1.1\r\n";
-        for (auto i = req.headers.begin(); i != req.headers.end(); ++i) {
-            msg += i->first + ":" + i->second + "\r\n";
+        msg.reserve(msg.size() + req.headers.serialized_size() + _base.size() + req.body.size() + 64);
+        if (!req.headers.empty()) {
+            req.headers.append_to(msg);
+            msg += "\r\n";
+        }
+        if (!req.headers.has(known_header::host)) {
+            msg += "Host:" + _base + "\r\n";
         }
-        msg += "Host:" + _base + "\r\n";
         msg += "Content-Length: " + std::to_string(req.body.length()) + "\r\n";
         msg += "\r\n";
         msg += req.body + "\r\n";
@@ -2,17 +2,25 @@
 
 #include "3rd/mongoose.h"
 #include "target.hpp"
+#include "headers.hpp"
 #include <string>
+#include <string_view>
 #include <map>
+#include <cctype>
 
 using m_http_message = struct http_message;
 
 namespace boo {namespace network {
 
+inline std::string_view to_string_view(const struct mg_str & s)
+{
+    return std::string_view(s.p, s.len);
+}
+
 class http_request {
 public:
     std::string body;
-    std::map<std::string, std::string> headers;
+    http_headers headers;
     target_t target;
     std::string method;
 
@@ -29,19 +37,142 @@ public:
         http_request req(target, method);
         req.body = std::string(hm->body.p, hm->body.len);
         for (int i = 0; hm->header_names[i].len > 0; ++i) {
-            std::string header_name(hm->header_names[i].p, hm->header_names[i].len);
-            std::string header_val(hm->header_values[i].p, hm->header_values[i].len);
-            req.headers[header_name] = header_val;
+            req.headers.set(to_string_view(hm->header_names[i]), to_string_view(hm->header_values[i]));
         }
         return req;
     }
 };
 
+/*
+ * Non owning request: string_views into the mongoose receive buffer, or into
+ * an http_request for requests that outlived their event. Only valid while
+ * the event (or the owning request) is alive, use to_owned() to keep it.
+ */
+class http_request_view {
+    m_http_message * _hm = nullptr;
+    const http_request * _req = nullptr;
+
+public:
+    std::string_view method;
+    /* without the query string */
+    std::string_view path;
+    /* raw, not url decoded, empty for a view over an http_request */
+    std::string_view query;
+    std::string_view body;
+
+    http_request_view() {}
+
+    explicit http_request_view(m_http_message * hm): _hm(hm)
+    {
+        method = to_string_view(hm->method);
+        path = to_string_view(hm->uri);
+        query = to_string_view(hm->query_string);
+        body = to_string_view(hm->body);
+    }
+
+    explicit http_request_view(const http_request & req): _req(&req)
+    {
+        method = req.method;
+        path = req.target.path();
+        body = req.body;
+    }
+
+    /* case insensitive, empty when missing */
+    std::string_view header(std::string_view name) const
+    {
+        if (_hm != nullptr) {
+            for (int i = 0; i < MG_MAX_HTTP_HEADERS && _hm->header_names[i].len > 0; ++i) {
+                if (http_headers::iequals(to_string_view(_hm->header_names[i]), name)) {
+                    return to_string_view(_hm->header_values[i]);
+                }
+            }
+            return std::string_view();
+        }
+        if (_req != nullptr) {
+            return _req->headers.get(name);
+        }
+        return std::string_view();
+    }
+
+    /* raw value of the first key=value pair named key, empty when missing */
+    std::string_view query_param(std::string_view key) const
+    {
+        if (_req != nullptr) {
+            auto & qs = _req->target.queries();
+            auto i = qs.find(std::string(key));
+            return i == qs.end() ? std::string_view() : std::string_view(i->second);
+        }
+        std::string_view rest = query;
+        while (!rest.empty()) {
+            auto amp = rest.find('&');
+            auto pair = rest.substr(0, amp);
+            rest = amp == std::string_view::npos ? std::string_view() : rest.substr(amp + 1);
+            auto eq = pair.find('=');
+            if (pair.substr(0, eq) == key) {
+                return eq == std::string_view::npos ? std::string_view() : pair.substr(eq + 1);
+            }
+        }
+        return std::string_view();
+    }
+
+    http_request to_owned() const
+    {
+        if (_req != nullptr) {
+            return *_req;
+        }
+        if (_hm != nullptr) {
+            return http_request::from_hm(_hm);
+        }
+        return http_request();
+    }
+};
+
+/* reason phrase for a status line, "" for codes it does not know */
+inline const char * status_reason(int status_code)
+{
+    switch (status_code) {
+    case 100: return "Continue";
+    case 101: return "Switching Protocols";
+    case 200: return "OK";
+    case 201: return "Created";
+    case 202: return "Accepted";
+    case 204: return "No Content";
+    case 206: return "Partial Content";
+    case 301: return "Moved Permanently";
+    case 302: return "Found";
+    case 303: return "See Other";
+    case 304: return "Not Modified";
+    case 307: return "Temporary Redirect";
+    case 308: return "Permanent Redirect";
+    case 400: return "Bad Request";
+    case 401: return "Unauthorized";
+    case 403: return "Forbidden";
+    case 404: return "Not Found";
+    case 405: return "Method Not Allowed";
+    case 408: return "Request Timeout";
+    case 409: return "Conflict";
+    case 411: return "Length Required";
+    case 412: return "Precondition Failed";
+    case 413: return "Payload Too Large";
+    case 415: return "Unsupported Media Type";
+    case 416: return "Range Not Satisfiable";
+    case 418: return "I'm a teapot";
+    case 422: return "Unprocessable Entity";
+    case 429: return "Too Many Requests";
+    case 500: return "Internal Server Error";
+    case 501: return "Not Implemented";
+    case 502: return "Bad Gateway";
+    case 503: return "Service Unavailable";
+    case 504: return "Gateway Timeout";
+    default: return "";
+    }
+}
+
 class http_response {
 public:
     int status_code;
     std::string body;
-    std::map<std::string, std::string> headers;
+    http_headers headers;
 
     http_response(int status_code) : status_code(status_code) {}
     http_response() {}
@@ -51,9 +182,7 @@ public:
         http_response res(hm->resp_code);
         res.body = std::string(hm->body.p, hm->body.len);
         for (int i = 0; hm->header_names[i].len > 0; ++i) {
-            std::string header_name(hm->header_names[i].p, hm->header_names[i].len);
-            std::string header_val(hm->header_values[i].p, hm->header_values[i].len);
-            res.headers[header_name] = header_val;
+            res.headers.set(to_string_view(hm->header_names[i]), to_string_view(hm->header_values[i]));
         }
 
         return res;
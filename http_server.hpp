@@ -4,6 +4,20 @@
 #include "3rd/json.hpp"
 #include "3rd/mongoose.h"
 #include "http_message.hpp"
+#include "epoll_iface.hpp"
+#include "mpsc_queue.hpp"
+#include "worker_pool.hpp"
+#include "task.hpp"
+#include "timer_wheel.hpp"
+#include "http_client.hpp"
+#include "static_files.hpp"
+#include "asset_cache.hpp"
+#include "response_cache.hpp"
+#include "h2_session.hpp"
+#include "body_decoder.hpp"
+#include "route_metrics.hpp"
+#include "prometheus_text.hpp"
+#include "trace_ring.hpp"
 #include <iostream>
 #include <sstream>
 #include <string>
@@ -11,6 +25,23 @@
 #include <functional>
 #include <map>
 #include <list>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+#include <deque>
+#include <unordered_map>
+#include <chrono>
+#include <condition_variable>
+#include <random>
+#ifndef _WIN32
+#include <sys/uio.h>
+#include <netinet/tcp.h>
+#endif
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
 
 using m_http_message = struct http_message;
 
@@ -23,14 +54,117 @@ enum conn_type {
     conn_type_http
 };
 
+enum send_status {
+    send_ok,
+    /* queued, but the connection is above its high watermark */
+    send_congested,
+    /* the reactor's outbound queue is full, nothing was queued */
+    send_dropped
+};
+
+/* what happens to frames pushed to a ws connection above its high watermark */
+enum ws_overflow_policy {
+    /* hold them in a backlog of at most max_backlog frames, dropping the oldest */
+    ws_drop_oldest,
+    /* like ws_drop_oldest, but a frame replaces a held one with the same "id" */
+    ws_coalesce_latest,
+    /* close the connection */
+    ws_disconnect
+};
+
+struct ws_backpressure_opts {
+    /* outbound bytes are send_mbuf plus held backlog */
+    size_t high_watermark = 1024 * 1024;
+    size_t low_watermark = 256 * 1024;
+    size_t max_backlog = 1024;
+    ws_overflow_policy policy = ws_drop_oldest;
+};
+
+/* 0 disables a limit */
+struct admission_opts {
+    /* open connections over all reactors, further ones are answered 503 on their first request */
+    size_t max_conns = 0;
+    /* bytes already waiting in a connection's send_mbuf, e.g. a pipelining client that does not read */
+    size_t max_conn_outbound = 0;
+    /* messages waiting in a reactor's outbound queue */
+    size_t max_send_queue = 0;
+    /* tasks waiting for a worker, only checked for async routes */
+    size_t max_worker_backlog = 0;
+    /* seconds, sent as Retry-After */
+    int retry_after = 1;
+};
+
+/* milliseconds, 0 disables a timeout */
+struct timeout_opts {
+    /* no traffic either way while nothing is in flight or queued */
+    size_t idle = 0;
+    /* from accept or the first byte of a request until the request is complete, its headers on stream routes */
+    size_t header_read = 0;
+    /* bytes waiting in send_mbuf without any of them being written */
+    size_t write_stall = 0;
+};
+
+/* see http_server::enable_stream_http_api */
+struct body_stream_opts {
+    /* body bytes read but not yet taken by the handler, reading pauses above it */
+    size_t window = 256 * 1024;
+    /* bodies announced larger are answered 413 before being read, 0 disables the limit */
+    uint64_t max_body_size = 0;
+};
+
+/* what a response producer did, see http_context::stream */
+enum stream_status {
+    /* it is called again once the connection has room */
+    stream_more,
+    /* nothing to add for now, it is called again after http_context::resume_stream */
+    stream_wait,
+    /* out holds the end of the body */
+    stream_done
+};
+
+/* see http_server::set_stream_opts */
+struct stream_opts {
+    /* bytes of a streamed response queued on the connection, the producer is not called above it */
+    size_t high_watermark = 256 * 1024;
+    /* and is called again once they drained below this */
+    size_t low_watermark = 64 * 1024;
+};
+
+/* see http_server::enable_tracing */
+struct trace_opts {
+    /* every reactor traces one request in sample_one_in, 1 traces them all */
+    uint32_t sample_one_in = 100;
+    /* records each reactor keeps, older ones are overwritten */
+    size_t ring_size = 4096;
+    /* service.name of the OpenTelemetry export */
+    std::string service_name = "boo";
+};
+
+enum trace_format { trace_chrome_json, trace_otlp_json };
+
+/* memory written to the socket in place, see http_context::send_iov */
+struct iov_buf {
+    const void * data;
+    size_t len;
+};
+
 class http_server {
 
     struct msg_t {
-        mg_connection * nc;
+        uint64_t conn_id = 0;
         std::string str;
+        /* "id" of the message, only filled in for ws_coalesce_latest */
+        std::string key;
+
+        msg_t() {}
+        msg_t(uint64_t id, std::string && s, std::string && k): conn_id(id), str(std::move(s)), key(std::move(k)) {}
+        msg_t(msg_t &&) = default;
+        msg_t & operator=(msg_t &&) = default;
+        msg_t(const msg_t &) = delete;
+        msg_t & operator=(const msg_t &) = delete;
     };
-    std::vector<msg_t> _for_send;
-    std::mutex _m;
+    struct reactor;
+    struct conn_t;
     std::function<void(conn_type t, const std::string & method, const string & path, const std::string & content)> _on_api;
     std::function<void(const std::string & msg)> _on_ws_sent;
 public:
@@ -45,33 +179,232 @@ public:
         _on_ws_sent = onsent;
     }
 
-    void push_to_send(mg_connection * nc, const std::string & str)
+    /*
+     * nc is dereferenced, so it must be open: call this on its reactor
+     * thread. Other threads hold a ws_conn, which stays safe to send on
+     * after the connection closed.
+     */
+    send_status push_to_send(mg_connection * nc, std::string && str, std::string && key = std::string())
     {
-        _m.lock();
-        _for_send.push_back(msg_t{nc, str});
-        _m.unlock();
+        auto c = conn_of(nc);
+        return c->r->push_to_send(c->id, *c->congested, std::move(str), std::move(key));
     }
 
-    void send()
+    send_status push_to_send(mg_connection * nc, const std::string & str)
     {
-        _m.lock();
-        for (auto i = _for_send.begin(); i != _for_send.end(); ++i) {
-            mg_send_websocket_frame(i->nc, WEBSOCKET_OP_TEXT, i->str.c_str(), i->str.length());
-        }
-        _for_send.clear();
-        _m.unlock();
+        return push_to_send(nc, std::string(str));
     }
 
-class http_context {
+    void send(mg_connection * nc)
+    {
+        reactor_of(nc)->flush();
+    }
+
+/*
+ * A context lives on the reactor's stack for the duration of the handler.
+ * detach() turns it into a heap context that outlives the event: it owns a
+ * copy of the request, has no http_message, and every send is posted back to
+ * the owning reactor, so it may be used from any thread. Sends on a detached
+ * context whose connection has gone away are dropped.
+ */
+class http_context : public std::enable_shared_from_this<http_context> {
+public:
+    /* sees the first fixed-length response sent through the context */
+    typedef std::function<void(int status_code, const http_headers * headers, const std::string & response)> capture_t;
+    /* a piece of a streamed request body, see read_body */
+    typedef std::function<void(const char * data, size_t len)> body_data_t;
+    /* complete is false when the body ended early, the client went away or broke the framing */
+    typedef std::function<void(http_context * ctx, bool complete)> body_end_t;
+    /* appends the next bytes of a streamed response to out, see stream */
+    typedef std::function<stream_status(std::string & out, size_t max)> producer_t;
+private:
     struct mg_connection * _nc;
     m_http_message * _hm;
     http_request * _req;
     http_server * _server = nullptr;
     bool _is_websocket_handshake_done = false;
+    reactor * _reactor = nullptr;
+    uint64_t _conn_id = 0;
+    std::unique_ptr<http_request> _owned_req;
+    /* route slot taken by admission control, released with the last copy of the context */
+    std::shared_ptr<void> _admission;
+    capture_t _capture;
+    /* position of the request among those pipelined on the connection */
+    uint64_t _seq = 0;
+    /* the HTTP/2 stream answered through this context, 0 for HTTP/1 */
+    uint32_t _stream = 0;
 public:
-    http_context(struct mg_connection * nc, http_request * r, m_http_message * hm): _nc(nc), _req(r), _hm(hm)
+    http_context(struct mg_connection * nc, http_request * r, m_http_message * hm): _nc(nc), _hm(hm), _req(r)
+    {
+        if (nc != nullptr) {
+            _seq = conn_of(nc)->dispatch_seq;
+        }
+    }
+
+    ~http_context()
+    {
+        if (is_async()) {
+            /* a response the handler never completed must not hold up the ones behind it */
+            auto id = _conn_id;
+            auto r = _reactor;
+            auto seq = _seq;
+            auto stream = _stream;
+            r->post([r, id, seq, stream]() {
+                auto i = r->conns.find(id);
+                if (i != r->conns.end()) {
+                    i->second->in_flight--;
+                    if (stream != 0) {
+                        i->second->h2->abandon(stream);
+                        return;
+                    }
+                    if (!i->second->timings.empty()) {
+                        r->stamp(i->second, seq, trace_handler_returned);
+                    }
+                    r->finish_response(i->second, seq);
+                    r->settle_iov(i->second);
+                }
+            });
+        }
+    }
+
+    std::shared_ptr<http_context> detach()
+    {
+        if (is_async()) {
+            return shared_from_this();
+        }
+        auto ctx = std::make_shared<http_context>(_nc, nullptr, nullptr);
+        ctx->_server = _server;
+        ctx->_owned_req.reset(new http_request(view().to_owned()));
+        ctx->_req = ctx->_owned_req.get();
+        ctx->_reactor = reactor_of(_nc);
+        ctx->_conn_id = conn_of(_nc)->id;
+        ctx->_admission = _admission;
+        ctx->_capture = std::move(_capture);
+        ctx->_seq = _seq;
+        ctx->_stream = _stream;
+        conn_of(_nc)->in_flight++;
+        conn_of(_nc)->answer_later = true;
+        return ctx;
+    }
+
+    bool is_async() const
+    {
+        return _reactor != nullptr;
+    }
+
+    /*
+     * run fn with the connection on its reactor, right away for a non detached
+     * context. What fn sends is kept behind the responses to earlier pipelined
+     * requests. On an HTTP/2 stream fn must not write to the connection.
+     */
+    void with_conn(std::function<void(mg_connection *)> fn)
+    {
+        write(std::move(fn), false);
+    }
+
+    /* run fn on the owning reactor thread */
+    void post(std::function<void()> fn)
+    {
+        (is_async() ? _reactor : reactor_of(_nc))->post(std::move(fn));
+    }
+
+    /*
+     * Run fn on the owning reactor thread once ms have passed. The id is only
+     * returned on the reactor thread, elsewhere the timer is posted and 0
+     * comes back.
+     */
+    timer_wheel::timer_id set_timer(std::chrono::milliseconds ms, std::function<void()> fn)
+    {
+        return (is_async() ? _reactor : reactor_of(_nc))->set_timer(ms, std::move(fn));
+    }
+
+    /* reactor thread only */
+    bool cancel_timer(timer_wheel::timer_id id)
+    {
+        return (is_async() ? _reactor : reactor_of(_nc))->timers.cancel(id);
+    }
+
+#ifdef BOO_NETWORK_HAS_COROUTINE
+    struct sleep_awaiter {
+        http_context * ctx;
+        std::chrono::milliseconds ms;
+
+        bool await_ready()
+        {
+            return ms.count() <= 0;
+        }
+
+        void await_suspend(std::coroutine_handle<> h)
+        {
+            ctx->set_timer(ms, [h]() {
+                h.resume();
+            });
+        }
+
+        void await_resume() {}
+    };
+
+    /* co_await ctx.sleep_for(ms) suspends the handler without blocking the reactor */
+    sleep_awaiter sleep_for(std::chrono::milliseconds ms)
+    {
+        return sleep_awaiter{ this, ms };
+    }
+
+    struct fetch_awaiter {
+        http_context * ctx;
+        http_client * client;
+        http_request req;
+        http_response res;
+        bool queued;
+
+        fetch_awaiter(http_context * c, http_client * cl, const http_request & r): ctx(c), client(cl), req(r), queued(false) {}
+
+        bool await_ready()
+        {
+            return false;
+        }
+
+        /* http_client connects with blocking waits, so the send is made on the worker pool */
+        void await_suspend(std::coroutine_handle<> h)
+        {
+            auto self = this;
+            auto keep = ctx->detach();
+            keep->server()->workers()->post([self, keep, h]() {
+                bool sent = self->client->send(self->req, [self, keep, h](const http_response & r) {
+                    self->res = r;
+                    self->queued = true;
+                    keep->post([h]() {
+                        h.resume();
+                    });
+                });
+                if (!sent) {
+                    keep->post([h]() {
+                        h.resume();
+                    });
+                }
+            });
+        }
+
+        http_response await_resume()
+        {
+            if (!queued) {
+                throw "http client not connected";
+            }
+            return std::move(res);
+        }
+    };
+
+    /*
+     * co_await ctx.fetch(client, req) sends req through client and resumes the
+     * handler on this context's reactor with the response. An http_client
+     * has one request on the wire at a time, the fetches sharing a client
+     * wait for each other; give concurrent upstream calls their own clients.
+     */
+    fetch_awaiter fetch(http_client & client, const http_request & req)
     {
+        return fetch_awaiter(this, &client, req);
     }
+#endif
 
     void set_server(http_server * s)
     {
@@ -91,14 +424,51 @@ public:
         return _hm;
     }
 
+    /* the request is copied out of the receive buffer on first use */
     http_request * req() {
+        if (_req == nullptr && _hm != nullptr) {
+            _owned_req.reset(new http_request(http_request::from_hm(_hm)));
+            _req = _owned_req.get();
+        }
         return _req;
     }
 
+    /* allocation free access to the request, only valid during the handler call unless detached */
+    http_request_view view() const
+    {
+        if (_hm != nullptr) {
+            return http_request_view(_hm);
+        }
+        if (_req != nullptr) {
+            return http_request_view(*_req);
+        }
+        return http_request_view();
+    }
+
     void close()
     {
     }
 
+    void set_admission(std::shared_ptr<void> slot)
+    {
+        _admission = std::move(slot);
+    }
+
+    void set_capture(capture_t capture)
+    {
+        _capture = std::move(capture);
+    }
+
+    void set_stream(uint32_t stream)
+    {
+        _stream = stream;
+    }
+
+    uint32_t stream() const
+    {
+        return _stream;
+    }
+
     void set_websocket_handshake_done(bool is)
     {
         _is_websocket_handshake_done = is;
@@ -111,29 +481,46 @@ public:
 
     void send(const char * buf, int size)
     {
+        if (_stream != 0) {
+            return h2_data(buf, size, false);
+        }
+        if (!in_turn()) {
+            std::string data(buf, size);
+            return with_conn([data](mg_connection * nc) {
+                mg_send(nc, data.c_str(), data.length());
+            });
+        }
         mg_send(_nc, buf, size);
     }
 
     void send(const http_response & res)
     {
-        std::map<std::string, std::string> headers = res.headers;
-        send(res.status_code, res.body, &headers);
+        send(res.status_code, res.body, &res.headers);
+    }
+
+    void send(int status_code, char * body, const http_headers * headers = nullptr)
+    {
+        send(status_code, std::string(body), headers);
     }
 
-    void send(int status_code, char * body, std::map<std::string, std::string> * headers = nullptr)
+    void send(int status_code, char * body, std::map<std::string, std::string> * headers)
     {
         send(status_code, std::string(body), headers);
     }
 
-    void send(int status_code, const json & body, std::map<std::string, std::string> * headers = nullptr)
+    /* a literal nullptr for headers would fit both pointer overloads */
+    void send(int status_code, char * body, std::nullptr_t)
+    {
+        send(status_code, std::string(body), (const http_headers *)nullptr);
+    }
+
+    void send(int status_code, const json & body, const http_headers * headers = nullptr)
     {
-        std::map<std::string, std::string> hs;
+        http_headers hs;
         if (headers != nullptr) {
-            for (auto i = headers->begin(); i != headers->end(); ++i) {
-                hs[i->first] = i->second;
-            }
+            hs = *headers;
         }
-        hs["Content-Type"] = "Application/json";
+        hs.set(known_header::content_type, "Application/json");
 
         std::stringstream out;
         out << body;
@@ -141,202 +528,3387 @@ public:
         send(status_code, out.str(), &hs);
     }
 
-    void send_header(int status_code, std::map<std::string, std::string> * headers = nullptr)
+    void send(int status_code, const json & body, std::map<std::string, std::string> * headers)
+    {
+        http_headers hs;
+        if (headers != nullptr) {
+            hs = http_headers(*headers);
+        }
+        send(status_code, body, &hs);
+    }
+
+    void send(int status_code, const json & body, std::nullptr_t)
+    {
+        send(status_code, body, (const http_headers *)nullptr);
+    }
+
+    void send_header(int status_code, const http_headers * headers = nullptr)
+    {
+        return send_header(status_code, -1, headers);
+    }
+
+    void send_header(int status_code, std::map<std::string, std::string> * headers)
     {
         return send_header(status_code, -1, headers);
     }
 
-    void send_header(int status_code, int size, std::map<std::string, std::string> * headers = nullptr)
+    void send_header(int status_code, std::nullptr_t)
+    {
+        return send_header(status_code, -1, (const http_headers *)nullptr);
+    }
+
+    void send_header(int status_code, int size, const http_headers * headers = nullptr)
     {
         if (_nc == nullptr) {
             throw "has no connection";
         }
+        if (_stream != 0) {
+            return h2_head(status_code, size, headers);
+        }
         std::string header;
         if (headers != nullptr) {
-            unsigned int idx = 0;
-            for (auto i = headers->begin(); i != headers->end(); ++i) {
-                header += i->first + ": " + i->second;
-                if (idx++ < headers->size() - 1) {
-                    header += "\r\n";
-                }
-            }
+            header.reserve(headers->serialized_size());
+            headers->append_to(header);
+        }
+        if (!in_turn()) {
+            return with_conn([status_code, size, header](mg_connection * nc) {
+                mg_send_head(nc, status_code, size, header.c_str());
+            });
         }
         mg_send_head(_nc, status_code, size, header.c_str());
     }
 
+    void send_header(int status_code, int size, std::map<std::string, std::string> * headers)
+    {
+        if (headers == nullptr) {
+            return send_header(status_code, size, (const http_headers *)nullptr);
+        }
+        http_headers hs(*headers);
+        send_header(status_code, size, &hs);
+    }
+
+    void send_header(int status_code, int size, std::nullptr_t)
+    {
+        send_header(status_code, size, (const http_headers *)nullptr);
+    }
+
     void send_chunk(const char * buf, int len)
     {
+        if (_stream != 0) {
+            return h2_data(buf, len, len == 0);
+        }
+        if (!in_turn()) {
+            std::string data(buf, len);
+            return with_conn([data](mg_connection * nc) {
+                mg_send_http_chunk(nc, data.c_str(), data.length());
+            });
+        }
         mg_send_http_chunk(_nc, buf, len);
     }
 
     void send_chunk_end()
     {
+        if (_stream != 0) {
+            return h2_data("", 0, true);
+        }
+        if (!in_turn()) {
+            return write([](mg_connection * nc) {
+                mg_send_http_chunk(nc, "", 0);
+            }, true);
+        }
         mg_send_http_chunk(_nc, "", 0);
+        finished();
     }
 
-    void send(int status_code, const std::string & body, std::map<std::string, std::string> * headers = nullptr)
+    /*
+     * Status line, headers, Content-Length and body in one buffer. Framing
+     * headers from the caller are dropped, the length is always the body's.
+     */
+    static void format_response(std::string & out, int status_code, const http_headers * headers, const char * body, size_t len)
     {
-        send_header(status_code, headers);
-        send_chunk(body.c_str(), body.length());
-        send_chunk_end();
+        out.reserve(out.size() + 64 + (headers != nullptr ? headers->serialized_size() : 0) + len);
+        if (format_head(out, status_code, headers, len)) {
+            out.append(body, len);
+        }
     }
-};
-
-class send_next_t {
-public:
-    virtual ~send_next_t(){}
-    virtual void send(struct mg_connection * _nc) = 0;
-    virtual bool send_complete() = 0;
-    virtual void send_ok(struct mg_connection * _nc) = 0;
-    virtual void close() = 0;
-};
-
-
-class ws_conn {
-    struct mg_connection * _nc;
-    http_server * _server;
-    bool _valid_req = true;
-public:
-    json req;
-    ws_conn(struct mg_connection * conn, http_server * s): _nc(conn), _server(s) {}
 
-    bool is_valid() {
-        return _valid_req;
+    /* the header block of format_response, len < 0 for a chunked body; returns false when the status allows no body */
+    static bool format_head(std::string & out, int status_code, const http_headers * headers, int64_t len)
+    {
+        auto reason = status_reason(status_code);
+        out.append("HTTP/1.1 ", 9);
+        out.append(std::to_string(status_code));
+        out.push_back(' ');
+        out.append(reason);
+        out.append("\r\n", 2);
+        if (headers != nullptr) {
+            for (auto & h : *headers) {
+                if (h.id == known_header::content_length || h.id == known_header::transfer_encoding) {
+                    continue;
+                }
+                out.append(h.first);
+                out.append(": ", 2);
+                out.append(h.second);
+                out.append("\r\n", 2);
+            }
+        }
+        /* no body is allowed for 1xx, 204 and 304 */
+        bool has_body = status_code >= 200 && status_code != 204 && status_code != 304;
+        if (has_body && len < 0) {
+            out.append("Transfer-Encoding: chunked\r\n", 28);
+        } else if (has_body) {
+            out.append("Content-Length: ", 16);
+            out.append(std::to_string(len));
+            out.append("\r\n", 2);
+        }
+        out.append("\r\n", 2);
+        return has_body;
     }
 
-    void send(const json & data)
+    void send(int status_code, const std::string & body, const http_headers * headers = nullptr)
     {
-        stringstream out;
-        out << data;
-        if (_server->_on_ws_sent != nullptr) {
-            _server->_on_ws_sent(out.str());
+        if (_nc == nullptr) {
+            throw "has no connection";
         }
-        _server->push_to_send(_nc, out.str());
+        if (_stream != 0) {
+            return h2_respond(status_code, headers, body.data(), body.length(), nullptr);
+        }
+        std::string msg;
+        format_response(msg, status_code, headers, body.data(), body.length());
+        if (_capture != nullptr) {
+            auto capture = std::move(_capture);
+            _capture = nullptr;
+            capture(status_code, headers, msg);
+        }
+        if (!in_turn()) {
+            return write([msg = std::move(msg)](mg_connection * nc) {
+                mg_send(nc, msg.data(), (int)msg.length());
+            }, true);
+        }
+        mg_send(_nc, msg.data(), (int)msg.length());
+        finished();
     }
 
-    bool eq(const ws_conn & ws) const
+    void send(int status_code, const std::string & body, std::map<std::string, std::string> * headers)
     {
-        return _nc == ws._nc;
+        if (headers == nullptr) {
+            return send(status_code, body, (const http_headers *)nullptr);
+        }
+        http_headers hs(*headers);
+        send(status_code, body, &hs);
     }
 
-    bool eq(const ws_conn * ws) const
+    void send(int status_code, const std::string & body, std::nullptr_t)
     {
-        return _nc == ws->_nc;
+        send(status_code, body, (const http_headers *)nullptr);
     }
-};
-
-private:
-    mg_mgr _mgr;
-    routing::router<function<void(ws_conn *, const json &)>> * _ws_router = nullptr;
-    routing::router<function<void(http_context *, routing::params *)>> * _http_router = nullptr;
-
-    struct mg_connection * _nc = nullptr;
-    std::function<void(const ws_conn &)> _on_ws_close = nullptr;
-    std::function<void(http_server * s, mg_connection * conn)> _on_http_close = nullptr;
-
-    bool _stop = false;
-    bool _stoped = false;
-    bool _ws_enabled = false;
-    bool _webroot_enabled = false;
-    bool _http_api_enabled = false;
-    bool _listening = false;
-
-    std::map<struct mg_connection *, send_next_t *> _send_next;
-
-    struct mg_serve_http_opts * _webroot_opts;
-
-    static int is_websocket(const struct mg_connection *nc) {
-        return nc->flags & MG_F_IS_WEBSOCKET;
-    };
 
-    void on_ws_close(const ws_conn & ws) {
-        if (_on_ws_close != nullptr) {
-            _on_ws_close(ws);
+    /*
+     * Writes head and then bufs with writev, after whatever was sent on the
+     * connection before. head is copied, bufs are not: they must stay valid
+     * until done runs on the reactor thread, with false when the connection
+     * closed first. HTTP/1 only.
+     */
+    void send_iov(std::string head, std::vector<iov_buf> bufs, std::function<void(bool)> done = nullptr)
+    {
+        if (_stream != 0) {
+            throw "raw send_iov on an http2 stream";
         }
-    };
+        queue_iov(std::move(head), std::move(bufs), std::move(done), false);
+    }
 
-    void on_http_close(mg_connection * nc) {
-        if (_send_next.find(nc) != _send_next.end()) {
-            _send_next[nc]->close();
-            delete _send_next[nc];
-            _send_next.erase(nc);
+    /* a Content-Length response whose body is written straight from the caller's buffers */
+    void send_iov(int status_code, std::vector<iov_buf> body, std::function<void(bool)> done = nullptr, const http_headers * headers = nullptr)
+    {
+        if (_stream != 0) {
+            /* HTTP/2 frames the body, it is copied into DATA frames on the reactor */
+            return h2_respond(status_code, headers, "", 0, std::make_shared<h2_iov>(h2_iov{ std::move(body), std::move(done) }));
         }
-        if (_on_http_close != nullptr) {
-            _on_http_close(this, nc);
+        size_t len = 0;
+        for (auto & b : body) {
+            len += b.len;
+        }
+        std::string head;
+        if (!format_head(head, status_code, headers, len)) {
+            body.clear();
         }
+        queue_iov(std::move(head), std::move(body), std::move(done), true);
     }
 
-public:
-    http_server()
+    /*
+     * Accepts the body of a request routed by the stream router, see
+     * http_server::enable_stream_http_api. on_data runs on the worker pool
+     * for each piece as it arrives, one call at a time and in order, then
+     * on_end gets the detached context to answer with. Reading pauses while
+     * on_data lags behind. A handler that answers without calling it refuses
+     * the body, and the connection is closed after the response. Only valid
+     * during the route handler.
+     */
+    void read_body(body_data_t on_data, body_end_t on_end)
     {
+        if (_stream != 0) {
+            /* the HTTP/2 session has buffered the body already */
+            auto ctx = detach();
+            _server->workers()->post([ctx, on_data, on_end]() {
+                auto & body = ctx->req()->body;
+                if (!body.empty()) {
+                    on_data(body.data(), body.size());
+                }
+                on_end(ctx.get(), true);
+            });
+            return;
+        }
+        auto u = is_async() ? nullptr : conn_of(_nc)->upload;
+        if (u == nullptr || u->seq != _seq || u->ctx != nullptr) {
+            throw "read_body outside a stream route handler";
+        }
+        u->on_data = std::move(on_data);
+        u->on_end = std::move(on_end);
+        u->ctx = detach();
     }
 
-    void reg_send_next(struct mg_connection * nc, send_next_t * send_next)
+    /*
+     * Streams the response body from produce, which the reactor calls while
+     * the connection has room for it, see http_server::set_stream_opts. max
+     * is how much more fits. A producer that has nothing yet returns
+     * stream_wait and is called again after resume_stream(). length < 0
+     * sends the body chunked. done learns whether the whole body was written
+     * or the connection went away first. HTTP/1 only.
+     */
+    void stream(int status_code, const http_headers * headers, producer_t produce, int64_t length = -1,
+        std::function<void(bool)> done = nullptr)
     {
-        if (_send_next.find(nc) != _send_next.end()) {
-            delete _send_next[nc];
+        if (_nc == nullptr) {
+            throw "has no connection";
         }
-        _send_next[nc] = send_next;
-    }
-
-    void stop() {
-        _stop = true;
-        while(_stoped) {}
+        if (_stream != 0) {
+            throw "stream on an http2 connection";
+        }
+        std::string head;
+        if (!format_head(head, status_code, headers, length)) {
+            return queue_iov(std::move(head), {}, std::move(done), true);
+        }
+        auto s = std::make_shared<stream_t>();
+        s->seq = _seq;
+        s->produce = std::move(produce);
+        s->done = std::move(done);
+        s->chunked = length < 0;
+        if (!is_async()) {
+            auto c = conn_of(_nc);
+            c->answer_later = true;
+            return c->r->start_stream(c, std::move(s), std::move(head));
+        }
+        auto id = _conn_id;
+        auto r = _reactor;
+        r->post([r, id, s, head = std::move(head)]() mutable {
+            auto i = r->conns.find(id);
+            if (i == r->conns.end()) {
+                if (s->done != nullptr) {
+                    s->done(false);
+                }
+                return;
+            }
+            r->start_stream(i->second, std::move(s), std::move(head));
+            r->settle_iov(i->second);
+        });
     }
 
-    void enable_ws(routing::router<function<void(ws_conn *, const json &)>> * router)
+    /* a producer that returned stream_wait is called again, from any thread */
+    void resume_stream()
     {
-        _ws_router = router;
-        _ws_enabled = true;
+        if (_nc == nullptr) {
+            throw "has no connection";
+        }
+        auto r = is_async() ? _reactor : reactor_of(_nc);
+        auto id = is_async() ? _conn_id : conn_of(_nc)->id;
+        auto seq = _seq;
+        r->post([r, id, seq]() {
+            auto i = r->conns.find(id);
+            if (i != r->conns.end()) {
+                r->resume_stream(i->second, seq);
+                r->settle_iov(i->second);
+            }
+        });
     }
 
-    void enable_webroot(struct mg_serve_http_opts * opts)
+private:
+    struct h2_iov {
+        std::vector<iov_buf> bufs;
+        std::function<void(bool)> done;
+    };
+
+    /* runs fn with the connection's session on its reactor, or not at all once the connection is gone */
+    void h2_write(std::function<void(h2_session &)> fn)
     {
-        _webroot_opts = opts;
-        _webroot_enabled = true;
+        if (!is_async()) {
+            return fn(*conn_of(_nc)->h2);
+        }
+        auto id = _conn_id;
+        auto r = _reactor;
+        r->post([r, id, fn = std::move(fn)]() {
+            auto i = r->conns.find(id);
+            if (i != r->conns.end()) {
+                fn(*i->second->h2);
+                r->settle_iov(i->second);
+            }
+        });
     }
 
-    void enable_http_api(routing::router<function<void(http_context *, routing::params *)>> * router)
+    void h2_head(int status_code, int size, const http_headers * headers)
     {
-        _http_router = router;
-        _http_api_enabled = true;
+        auto id = _stream;
+        if (!is_async()) {
+            conn_of(_nc)->h2->send_headers(id, status_code, headers, size);
+            return;
+        }
+        auto hs = headers != nullptr ? std::make_shared<http_headers>(*headers) : nullptr;
+        h2_write([id, status_code, size, hs](h2_session & h2) {
+            h2.send_headers(id, status_code, hs.get(), size);
+        });
     }
 
-    void handle_http_api(struct mg_connection * nc, struct http_message * hm, bool is_websocket = false)
+    void h2_data(const char * buf, size_t len, bool end)
     {
-        if (!_http_api_enabled) {
-            if (_webroot_enabled) {
-                handle_webroot(nc, hm);
+        auto id = _stream;
+        if (!is_async()) {
+            conn_of(_nc)->h2->send_data(id, buf, len, end);
+            return;
+        }
+        h2_write([id, data = std::string(buf, len), end](h2_session & h2) {
+            h2.send_data(id, data.data(), data.size(), end);
+        });
+    }
+
+    /* body, or iov when it comes from send_iov */
+    void h2_respond(int status_code, const http_headers * headers, const char * body, size_t len, std::shared_ptr<h2_iov> iov)
+    {
+        auto id = _stream;
+        if (!is_async() && iov == nullptr) {
+            conn_of(_nc)->h2->respond(id, status_code, headers, body, len);
+            return;
+        }
+        auto hs = headers != nullptr ? std::make_shared<http_headers>(*headers) : nullptr;
+        auto fn = [id, status_code, hs, data = std::string(body, len), iov](h2_session & h2) mutable {
+            if (iov != nullptr) {
+                for (auto & b : iov->bufs) {
+                    data.append((const char *)b.data, b.len);
+                }
+            }
+            h2.respond(id, status_code, hs.get(), std::move(data));
+            if (iov != nullptr && iov->done != nullptr) {
+                iov->done(true);
+                iov->done = nullptr;
+            }
+        };
+        if (!is_async()) {
+            return fn(*conn_of(_nc)->h2);
+        }
+        auto cid = _conn_id;
+        auto r = _reactor;
+        r->post([r, cid, fn = std::move(fn), iov]() mutable {
+            auto i = r->conns.find(cid);
+            if (i != r->conns.end()) {
+                fn(*i->second->h2);
+                r->settle_iov(i->second);
+            } else if (iov != nullptr && iov->done != nullptr) {
+                iov->done(false);
+            }
+        });
+    }
+
+    /* writes may go straight to the connection: not detached, and no earlier response is pending */
+    bool in_turn() const
+    {
+        return !is_async() && _seq <= conn_of(_nc)->resp_seq;
+    }
+
+    /* the response is complete, the next pipelined one may go out */
+    void finished()
+    {
+        auto c = conn_of(_nc);
+        c->r->finish_response(c, _seq);
+    }
+
+    /* with_conn, last completes the response once fn ran */
+    void write(std::function<void(mg_connection *)> fn, bool last)
+    {
+        if (!is_async()) {
+            auto c = conn_of(_nc);
+            c->r->write_for(c, _seq, fn);
+            if (last) {
+                c->r->finish_response(c, _seq);
+            }
+            return;
+        }
+        auto id = _conn_id;
+        auto r = _reactor;
+        auto seq = _seq;
+        r->post([r, id, seq, fn = std::move(fn), last]() {
+            auto i = r->conns.find(id);
+            if (i != r->conns.end()) {
+                r->write_for(i->second, seq, fn);
+                if (last) {
+                    r->finish_response(i->second, seq);
+                }
+                r->settle_iov(i->second);
+            }
+        });
+    }
+
+    void queue_iov(std::string && head, std::vector<iov_buf> && bufs, std::function<void(bool)> && done, bool last)
+    {
+        if (_nc == nullptr) {
+            throw "has no connection";
+        }
+        iov_out o;
+        o.head = std::move(head);
+        o.bufs = std::move(bufs);
+        o.done = std::move(done);
+        if (!is_async()) {
+            auto c = conn_of(_nc);
+            c->r->respond(c, _seq, std::move(o));
+            if (last) {
+                c->r->finish_response(c, _seq);
+            }
+            return;
+        }
+        auto id = _conn_id;
+        auto r = _reactor;
+        auto seq = _seq;
+        r->post([r, id, seq, o = std::make_shared<iov_out>(std::move(o)), last]() {
+            auto i = r->conns.find(id);
+            if (i == r->conns.end()) {
+                if (o->done != nullptr) {
+                    o->done(false);
+                }
+                return;
+            }
+            r->respond(i->second, seq, std::move(*o));
+            if (last) {
+                r->finish_response(i->second, seq);
+            }
+        });
+    }
+};
+
+class send_next_t {
+public:
+    virtual ~send_next_t(){}
+    virtual void send(struct mg_connection * _nc) = 0;
+    virtual bool send_complete() = 0;
+    virtual void send_ok(struct mg_connection * _nc) = 0;
+    virtual void close() = 0;
+};
+
+
+class ws_conn {
+    /* only compared, the connection may be gone */
+    struct mg_connection * _nc;
+    http_server * _server;
+    reactor * _reactor;
+    uint64_t _conn_id;
+    /* shared with the connection, outlives it */
+    std::shared_ptr<std::atomic<bool>> _congested;
+    bool _valid_req = true;
+public:
+    json req;
+    /* on the connection's reactor thread */
+    ws_conn(struct mg_connection * conn, http_server * s): _nc(conn), _server(s), _reactor(reactor_of(conn)),
+        _conn_id(conn_of(conn)->id), _congested(conn_of(conn)->congested) {}
+
+    /* whether the connection is still open, only meaningful on its reactor thread */
+    bool is_alive() const
+    {
+        return _reactor->conns.find(_conn_id) != _reactor->conns.end();
+    }
+
+    void post(std::function<void()> fn)
+    {
+        _reactor->post(std::move(fn));
+    }
+
+    timer_wheel::timer_id set_timer(std::chrono::milliseconds ms, std::function<void()> fn)
+    {
+        return _reactor->set_timer(ms, std::move(fn));
+    }
+
+    /* reactor thread only */
+    bool cancel_timer(timer_wheel::timer_id id)
+    {
+        return _reactor->timers.cancel(id);
+    }
+
+#ifdef BOO_NETWORK_HAS_COROUTINE
+    struct sleep_awaiter {
+        ws_conn * conn;
+        std::chrono::milliseconds ms;
+
+        bool await_ready()
+        {
+            return ms.count() <= 0;
+        }
+
+        void await_suspend(std::coroutine_handle<> h)
+        {
+            conn->set_timer(ms, [h]() {
+                h.resume();
+            });
+        }
+
+        void await_resume() {}
+    };
+
+    sleep_awaiter sleep_for(std::chrono::milliseconds ms)
+    {
+        return sleep_awaiter{ this, ms };
+    }
+#endif
+
+    bool is_valid() {
+        return _valid_req;
+    }
+
+    send_status send(const json & data)
+    {
+        if (std::this_thread::get_id() == _reactor->thread_id && !is_alive()) {
+            return send_dropped;
+        }
+        auto str = data.dump();
+        if (_server->_on_ws_sent != nullptr) {
+            _server->_on_ws_sent(str);
+        }
+        std::string key;
+        if (_server->_ws_backpressure.policy == ws_coalesce_latest) {
+            auto id = data.find("id");
+            if (id != data.end() && id->is_string()) {
+                key = id->get<std::string>();
+            }
+        }
+        return _reactor->push_to_send(_conn_id, *_congested, std::move(str), std::move(key));
+    }
+
+    /* above the high watermark and not yet back under the low one */
+    bool congested() const
+    {
+        return _congested->load(std::memory_order_relaxed);
+    }
+
+    bool eq(const ws_conn & ws) const
+    {
+        return _nc == ws._nc;
+    }
+
+    bool eq(const ws_conn * ws) const
+    {
+        return _nc == ws->_nc;
+    }
+};
+
+private:
+    /* a send_iov response or a static file: head, then bufs, then file_len bytes of file */
+    struct iov_out {
+        std::string head;
+        size_t head_sent = 0;
+        std::vector<iov_buf> bufs;
+        size_t next = 0;
+        unique_fd file;
+        int64_t file_off = 0;
+        size_t file_len = 0;
+        std::function<void(bool)> done;
+
+        size_t remaining() const
+        {
+            size_t n = head.size() - head_sent + file_len;
+            for (size_t i = next; i < bufs.size(); ++i) {
+                n += bufs[i].len;
+            }
+            return n;
+        }
+
+        /* only the file part is left */
+        bool at_file() const
+        {
+            return head_sent == head.size() && next == bufs.size() && file_len > 0;
+        }
+    };
+
+    /* output of a pipelined request that is not the one being answered yet */
+    struct held_response {
+        std::deque<iov_out> out;
+        bool finished = false;
+        bool close = false;
+    };
+
+    /* a request body streamed to its handler, see http_server::enable_stream_http_api */
+    struct upload_t {
+        uint64_t seq = 0;
+        body_decoder body;
+        /* set by http_context::read_body, without them the body is refused */
+        std::shared_ptr<http_context> ctx;
+        http_context::body_data_t on_data;
+        http_context::body_end_t on_end;
+        /* decoded, not yet handed to on_data */
+        std::string pending;
+        /* a worker runs on_data or on_end, which only the worker touches meanwhile */
+        bool busy = false;
+        /* on_end has been handed over */
+        bool ended = false;
+        /* bytes after the body that came with the headers, parsed once the upload is over */
+        std::string rest;
+        /* what the connection had before the upload took it over */
+        mg_event_handler_t proto = nullptr;
+        size_t recv_limit = 0;
+
+        /* waiting for the client rather than for the handler */
+        bool reading() const
+        {
+            return ctx != nullptr && !busy && !body.done();
+        }
+    };
+
+    /* a streamed response, see http_context::stream and http_server::reg_send_next */
+    struct stream_t {
+        uint64_t seq = 0;
+        http_context::producer_t produce;
+        std::function<void(bool)> done;
+        /* a send_next_t stream instead of a producer */
+        std::unique_ptr<send_next_t> sn;
+        bool chunked = false;
+        /* the producer returned stream_wait */
+        bool waiting = false;
+    };
+
+    /*
+     * A request counted in route metrics once its response has been written,
+     * see http_server::enable_route_metrics. begin and end are offsets in
+     * what was sent on the connection, known once it is the response's turn
+     * and once it is complete.
+     */
+    struct timing_t {
+        uint64_t seq;
+        route_stats * route = nullptr;
+        uint64_t start_us;
+        uint64_t bytes_in;
+        uint64_t begin = UINT64_MAX;
+        uint64_t end = UINT64_MAX;
+        /* -1 once the status line went out before it was looked at */
+        int status = 0;
+        /* only for a sampled request, see http_server::enable_tracing */
+        std::unique_ptr<trace_record> trace;
+    };
+
+    /* a reactor's part of a /metrics scrape */
+    struct reactor_gauges {
+        size_t http_conns = 0;
+        size_t ws_conns = 0;
+        /* messages waiting in for_send */
+        size_t send_queue = 0;
+        /* streamed responses not over yet */
+        size_t streams = 0;
+        size_t send_mbuf = 0;
+        size_t recv_mbuf = 0;
+    };
+
+    /* per connection state, hung on mg_connection::user_data */
+    struct conn_t {
+        reactor * r;
+        uint64_t id;
+        mg_connection * nc;
+        /* ws_conn copies keep it, producers may read it after the connection closed */
+        std::shared_ptr<std::atomic<bool>> congested = std::make_shared<std::atomic<bool>>(false);
+        std::deque<msg_t> backlog;
+        size_t backlog_bytes = 0;
+        /* detached http_contexts that may still answer on this connection */
+        size_t in_flight = 0;
+        bool accepted = false;
+        bool over_limit = false;
+        /* timestamps in ms of the reactor clock, see timeout_opts */
+        uint64_t last_active = 0;
+        uint64_t reading_since = 0;
+        uint64_t stall_since = 0;
+        timer_wheel::timer_id timeout = 0;
+        /* see reactor::write_iov */
+        std::deque<iov_out> iov;
+        size_t iov_bytes = 0;
+        /* leading bytes of send_mbuf that go out before iov */
+        size_t iov_staged = 0;
+        bool close_after_iov = false;
+        /*
+         * Pipelined requests are numbered as they are dispatched, responses go
+         * out in that order: resp_seq is the request being answered, output
+         * for later ones waits in held. See reactor::write_for.
+         */
+        uint64_t next_seq = 0;
+        uint64_t dispatch_seq = 0;
+        uint64_t resp_seq = 0;
+        /* the request being dispatched is answered later, by a detached context or a stream */
+        bool answer_later = false;
+        /* a held response closes the connection */
+        bool close_held = false;
+        std::map<uint64_t, held_response> held;
+        size_t held_bytes = 0;
+        /* set once the connection speaks HTTP/2, see http_server::enable_h2c */
+        std::unique_ptr<h2_session> h2;
+        /* the request body being streamed, the connection gets raw events meanwhile */
+        std::shared_ptr<upload_t> upload;
+        /* streamed responses in request order, only the front one writes */
+        std::deque<std::shared_ptr<stream_t>> streams;
+        /* requests in order whose response is not written yet, only with route metrics */
+        std::deque<timing_t> timings;
+        /* bytes written to the socket */
+        uint64_t bytes_out = 0;
+        /* reactor clock in us at the last MG_EV_RECV, only with route metrics */
+        uint64_t recv_us = 0;
+        /* with tracing: whether the request being read is sampled (1) or not (-1), 0 before its first byte */
+        int trace_next = 0;
+        uint64_t accept_ns = 0;
+        uint64_t first_byte_ns = 0;
+        uint64_t headers_ns = 0;
+
+        conn_t(reactor * r, uint64_t id, mg_connection * nc): r(r), id(id), nc(nc) {}
+
+        size_t outbound() const
+        {
+            return nc->send_mbuf.len + backlog_bytes + iov_bytes + held_bytes + (h2 != nullptr ? h2->pending_bytes() : 0);
+        }
+
+        /* what the response being answered has queued, held responses wait for it and don't count */
+        size_t unsent() const
+        {
+            return nc->send_mbuf.len + iov_bytes;
+        }
+    };
+
+    /*
+     * Every reactor owns its mg_mgr, listening socket and outbound queue.
+     * A connection is only ever touched by the reactor that accepted it.
+     */
+    struct reactor {
+        http_server * server;
+        size_t index;
+        mg_mgr mgr;
+        std::thread thread;
+        std::atomic<std::thread::id> thread_id;
+        routing::router<function<void(ws_conn *, const json &)>> * ws_router = nullptr;
+        routing::router<function<void(http_context *, routing::params *)>> * http_router = nullptr;
+
+        mpsc_queue<msg_t> for_send;
+        std::unordered_map<uint64_t, conn_t *> conns;
+        uint64_t next_conn_id = 0;
+
+        std::vector<std::function<void()>> tasks;
+        std::vector<std::function<void()>> running_tasks;
+        std::mutex tasks_m;
+        timer_wheel timers{ now_ms() };
+
+        /* wake[0] is polled by mgr, other threads write a byte to wake[1] */
+        sock_t wake[2] = { INVALID_SOCKET, INVALID_SOCKET };
+        std::atomic<bool> wakeup_pending{false};
+
+        mg_connection * listener = nullptr;
+        /* connections whose upload is over, see http_server::end_upload */
+        std::vector<uint64_t> uploads_over;
+        route_metrics metrics;
+        /* requests no route took */
+        route_stats * unrouted = nullptr;
+        /* sampled requests once written, see http_server::enable_tracing */
+        trace_ring traces;
+        uint32_t trace_tick = 0;
+        /* time of a run() iteration, waiting included, only with the metrics endpoint */
+        latency_histogram poll_time;
+        std::atomic<uint64_t> poll_sum_us{0};
+        bool draining = false;
+        bool drained = false;
+
+        reactor(http_server * s, size_t i, size_t queue_size): server(s), index(i), for_send(queue_size) {}
+
+        ~reactor()
+        {
+            if (wake[1] != INVALID_SOCKET) {
+                closesocket(wake[1]);
+            }
+        }
+
+        conn_t * add_conn(mg_connection * nc)
+        {
+            auto c = new conn_t(this, ++next_conn_id, nc);
+            conns[c->id] = c;
+            nc->user_data = c;
+            return c;
+        }
+
+        void remove_conn(mg_connection * nc)
+        {
+            auto c = conn_of(nc);
+            if (nc == listener) {
+                listener = nullptr;
+            }
+            if (c->timeout != 0) {
+                timers.cancel(c->timeout);
+            }
+            for (auto & o : c->iov) {
+                if (o.done != nullptr) {
+                    o.done(false);
+                }
+            }
+            for (auto & h : c->held) {
+                for (auto & o : h.second.out) {
+                    if (o.done != nullptr) {
+                        o.done(false);
+                    }
+                }
+            }
+            conns.erase(c->id);
+            nc->user_data = nullptr;
+            delete c;
+        }
+
+        /* any thread, a message for a closed connection is dropped by send() */
+        send_status push_to_send(uint64_t conn_id, const std::atomic<bool> & congested_flag, std::string && str, std::string && key)
+        {
+            bool congested = congested_flag.load(std::memory_order_relaxed);
+            if (!for_send.push(msg_t(conn_id, std::move(str), std::move(key)))) {
+                return send_dropped;
+            }
+            if (std::this_thread::get_id() != thread_id) {
+                wakeup();
+            }
+            return congested ? send_congested : send_ok;
+        }
+
+        /* run fn on the reactor thread */
+        void post(std::function<void()> fn)
+        {
+            {
+                std::lock_guard<std::mutex> locker(tasks_m);
+                tasks.push_back(std::move(fn));
+            }
+            if (std::this_thread::get_id() != thread_id) {
+                wakeup();
+            }
+        }
+
+        static uint64_t now_ms()
+        {
+            return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+        }
+
+        static uint64_t now_us()
+        {
+            return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+        }
+
+        static uint64_t now_ns()
+        {
+            return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+        }
+
+        timer_wheel::timer_id set_timer(std::chrono::milliseconds ms, std::function<void()> fn)
+        {
+            if (std::this_thread::get_id() != thread_id) {
+                post([this, ms, fn]() {
+                    set_timer(ms, fn);
+                });
+                return 0;
+            }
+            return timers.add(ms.count(), std::move(fn));
+        }
+
+        void run_timers()
+        {
+            timers.advance(now_ms());
+        }
+
+        int poll_timeout(size_t interval)
+        {
+            if (draining && !drained) {
+                /* connections flagged for closing are only reaped by the next poll */
+                interval = std::min<size_t>(interval, 10);
+            }
+            return (int)timers.next_timeout(interval);
+        }
+
+        /* one wheel timer per connection, activity only moves timestamps */
+        void arm_timeout(conn_t * c, uint64_t deadline, uint64_t now)
+        {
+            auto id = c->id;
+            c->timeout = timers.add(deadline > now ? deadline - now : 1, [this, id]() {
+                auto i = conns.find(id);
+                if (i != conns.end()) {
+                    check_timeout(i->second);
+                }
+            });
+        }
+
+        void check_timeout(conn_t * c)
+        {
+            auto & t = server->_timeouts;
+            auto nc = c->nc;
+            uint64_t now = now_ms();
+            c->timeout = 0;
+            if (nc->send_mbuf.len == 0 && c->iov.empty()) {
+                c->stall_since = 0;
+            } else if (c->stall_since == 0) {
+                c->stall_since = now;
+            }
+            /* an upload waiting for its client is a read like any other, idle applies */
+            size_t in_flight = c->in_flight - (c->upload != nullptr && c->upload->reading() ? 1 : 0);
+            bool busy = in_flight > 0 || nc->send_mbuf.len > 0 || !c->iov.empty() || !c->held.empty() ||
+                !c->streams.empty() || (c->h2 != nullptr && c->h2->open_streams() > 0);
+            uint64_t deadline = UINT64_MAX;
+            uint64_t recheck = UINT64_MAX;
+            if (t.idle > 0) {
+                recheck = std::min<uint64_t>(recheck, t.idle);
+                if (!busy) {
+                    deadline = std::min<uint64_t>(deadline, c->last_active + t.idle);
+                }
+            }
+            if (t.header_read > 0) {
+                recheck = std::min<uint64_t>(recheck, t.header_read);
+                if (c->reading_since > 0 && !is_websocket(nc)) {
+                    deadline = std::min<uint64_t>(deadline, c->reading_since + t.header_read);
+                }
+            }
+            if (t.write_stall > 0) {
+                recheck = std::min<uint64_t>(recheck, t.write_stall);
+                if (c->stall_since > 0) {
+                    deadline = std::min<uint64_t>(deadline, c->stall_since + t.write_stall);
+                }
+            }
+            if (recheck == UINT64_MAX) {
+                return;
+            }
+            if (deadline <= now) {
+                nc->flags |= MG_F_CLOSE_IMMEDIATELY;
+                /* flagged connections are reaped at the end of a poll, don't wait out the interval */
+                wakeup();
+                return;
+            }
+            arm_timeout(c, std::min(deadline, now + recheck), now);
+        }
+
+        void run_tasks()
+        {
+            {
+                std::lock_guard<std::mutex> locker(tasks_m);
+                if (tasks.empty()) {
+                    return;
+                }
+                running_tasks.swap(tasks);
+            }
+            for (auto & fn : running_tasks) {
+                fn();
+            }
+            running_tasks.clear();
+        }
+
+        void flush()
+        {
+            wakeup_pending.store(false);
+            run_tasks();
+            send();
+        }
+
+        void send()
+        {
+            msg_t msg;
+            while (for_send.pop(msg)) {
+                auto i = conns.find(msg.conn_id);
+                if (i == conns.end()) {
+                    continue;
+                }
+                deliver(i->second, std::move(msg));
+            }
+        }
+
+        void deliver(conn_t * c, msg_t && msg)
+        {
+            auto & opts = server->_ws_backpressure;
+            if (!c->congested->load(std::memory_order_relaxed)) {
+                mg_send_websocket_frame(c->nc, WEBSOCKET_OP_TEXT, msg.str.c_str(), msg.str.length());
+                if (c->outbound() >= opts.high_watermark) {
+                    set_congested(c, true);
+                }
+                return;
+            }
+            if (opts.policy == ws_disconnect) {
+                c->nc->flags |= MG_F_CLOSE_IMMEDIATELY;
+                return;
+            }
+            if (opts.policy == ws_coalesce_latest && !msg.key.empty()) {
+                for (auto & held : c->backlog) {
+                    if (held.key == msg.key) {
+                        c->backlog_bytes = c->backlog_bytes - held.str.length() + msg.str.length();
+                        held.str = std::move(msg.str);
+                        return;
+                    }
+                }
+            }
+            c->backlog_bytes += msg.str.length();
+            c->backlog.push_back(std::move(msg));
+            while (c->backlog.size() > opts.max_backlog) {
+                c->backlog_bytes -= c->backlog.front().str.length();
+                c->backlog.pop_front();
+            }
+        }
+
+        /* called once the socket drained some of send_mbuf */
+        void flush_backlog(conn_t * c)
+        {
+            auto & opts = server->_ws_backpressure;
+            if (!c->congested->load(std::memory_order_relaxed) || c->nc->send_mbuf.len > opts.low_watermark) {
+                return;
+            }
+            while (!c->backlog.empty() && c->nc->send_mbuf.len < opts.high_watermark) {
+                auto & msg = c->backlog.front();
+                mg_send_websocket_frame(c->nc, WEBSOCKET_OP_TEXT, msg.str.c_str(), msg.str.length());
+                c->backlog_bytes -= msg.str.length();
+                c->backlog.pop_front();
+            }
+            if (c->outbound() <= opts.low_watermark) {
+                set_congested(c, false);
+            }
+        }
+
+        void queue_iov(conn_t * c, std::string && head, std::vector<iov_buf> && bufs, std::function<void(bool)> && done)
+        {
+            iov_out o;
+            o.head = std::move(head);
+            o.bufs = std::move(bufs);
+            o.done = std::move(done);
+            queue_iov(c, std::move(o));
+        }
+
+        void queue_iov(conn_t * c, iov_out && o)
+        {
+            if (c->iov.empty()) {
+                c->iov_staged = c->nc->send_mbuf.len;
+            } else {
+                /* bytes mg_send'ed since the last settle go before o */
+                settle_iov(c);
+            }
+            c->iov_bytes += o.remaining();
+            c->iov.push_back(std::move(o));
+            write_iov(c);
+        }
+
+        /*
+         * Anything mg_send'ed while iov responses are queued would overtake
+         * them, so it is moved behind them. Closing waits for them as well.
+         */
+        void settle_iov(conn_t * c)
+        {
+            auto nc = c->nc;
+            if (!c->timings.empty()) {
+                /* before anything queued since the last call can be written */
+                track(c);
+            }
+            if (c->iov.empty()) {
+                return;
+            }
+            if (nc->send_mbuf.len > c->iov_staged) {
+                c->iov.emplace_back();
+                auto & o = c->iov.back();
+                o.head.assign(nc->send_mbuf.buf + c->iov_staged, nc->send_mbuf.len - c->iov_staged);
+                c->iov_bytes += o.head.size();
+                nc->send_mbuf.len = c->iov_staged;
+            }
+            if (nc->flags & MG_F_SEND_AND_CLOSE) {
+                nc->flags &= ~MG_F_SEND_AND_CLOSE;
+                c->close_after_iov = true;
+            }
+        }
+
+        /* queue_iov for the response to request seq, held back until it is that request's turn */
+        void respond(conn_t * c, uint64_t seq, iov_out && o)
+        {
+            if (seq <= c->resp_seq) {
+                return queue_iov(c, std::move(o));
+            }
+            c->held_bytes += o.remaining();
+            c->held[seq].out.push_back(std::move(o));
+        }
+
+        /*
+         * Runs fn, which may mg_send on the connection, on behalf of request
+         * seq. When an earlier request is still being answered, what fn
+         * appends to send_mbuf, and a close it asks for, are taken back and
+         * held until seq's turn.
+         */
+        void write_for(conn_t * c, uint64_t seq, const std::function<void(mg_connection *)> & fn)
+        {
+            auto nc = c->nc;
+            if (seq <= c->resp_seq) {
+                return fn(nc);
+            }
+            size_t mark = nc->send_mbuf.len;
+            bool closing = (nc->flags & MG_F_SEND_AND_CLOSE) != 0;
+            fn(nc);
+            if (nc->send_mbuf.len > mark) {
+                iov_out o;
+                o.head.assign(nc->send_mbuf.buf + mark, nc->send_mbuf.len - mark);
+                nc->send_mbuf.len = mark;
+                c->held_bytes += o.head.size();
+                c->held[seq].out.push_back(std::move(o));
+            }
+            if (!closing && (nc->flags & MG_F_SEND_AND_CLOSE)) {
+                nc->flags &= ~MG_F_SEND_AND_CLOSE;
+                c->held[seq].close = true;
+                c->close_held = true;
+            }
+        }
+
+        /* the response to request seq is complete, later ones may go out; repeated calls are harmless */
+        void finish_response(conn_t * c, uint64_t seq)
+        {
+            if (seq < c->resp_seq || streaming(c, seq)) {
+                return;
+            }
+            if (seq > c->resp_seq) {
+                c->held[seq].finished = true;
+                return;
+            }
+            if (!c->timings.empty()) {
+                turn(c);
+            }
+            if (refused_upload(c, seq)) {
+                return close_after_response(c);
+            }
+            c->resp_seq++;
+            while (!c->held.empty() && c->held.begin()->first == c->resp_seq) {
+                auto h = std::move(c->held.begin()->second);
+                c->held.erase(c->held.begin());
+                for (auto & o : h.out) {
+                    c->held_bytes -= o.remaining();
+                    queue_iov(c, std::move(o));
+                }
+                if (h.close) {
+                    /* nothing after it goes out, remove_conn releases the rest */
+                    return close_after_response(c);
+                }
+                if (!h.finished) {
+                    break;
+                }
+                if (!c->timings.empty()) {
+                    turn(c);
+                }
+                if (refused_upload(c, c->resp_seq)) {
+                    return close_after_response(c);
+                }
+                c->resp_seq++;
+            }
+            if (!c->streams.empty()) {
+                pump_streams(c);
+            }
+        }
+
+        /* the stream router's handler answered seq without reading its body, see http_server::begin_upload */
+        bool refused_upload(conn_t * c, uint64_t seq) const
+        {
+            return c->upload != nullptr && c->upload->ctx == nullptr && c->upload->seq == seq;
+        }
+
+        /* what is queued goes out, nothing after it */
+        void close_after_response(conn_t * c)
+        {
+            c->nc->flags |= MG_F_SEND_AND_CLOSE;
+            settle_iov(c);
+        }
+
+        /* the response to seq is streamed and not over yet, only the stream finishes it */
+        bool streaming(conn_t * c, uint64_t seq) const
+        {
+            for (auto & s : c->streams) {
+                if (s->seq == seq) {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        void start_stream(conn_t * c, std::shared_ptr<stream_t> && s, std::string && head)
+        {
+            iov_out o;
+            o.head = std::move(head);
+            respond(c, s->seq, std::move(o));
+            auto i = c->streams.end();
+            while (i != c->streams.begin() && (*std::prev(i))->seq > s->seq) {
+                --i;
+            }
+            /* not while the handler of a later request runs, write_for would take the front stream's output */
+            bool front = i == c->streams.begin();
+            c->streams.insert(i, std::move(s));
+            if (front) {
+                pump_streams(c);
+            }
+        }
+
+        void resume_stream(conn_t * c, uint64_t seq)
+        {
+            for (auto & s : c->streams) {
+                if (s->seq == seq && s->waiting) {
+                    s->waiting = false;
+                    return pump_streams(c);
+                }
+            }
+        }
+
+        /*
+         * Runs the front stream once its request is being answered. Producers
+         * are called when the connection's unsent bytes are below the low
+         * watermark, and then as long as they stay below the high one; what
+         * they append is gathered into blocks of up to block_bytes, each
+         * queued with queue_iov. A send_next_t stream is polled as before,
+         * but only sends below the low watermark.
+         */
+        void pump_streams(conn_t * c)
+        {
+            static const size_t block_bytes = 64 * 1024;
+            /* room for the chunk size, written in place once the block is complete */
+            static const size_t size_digits = 8;
+            auto & opts = server->_stream_opts;
+            if (c->streams.empty()) {
+                return;
+            }
+            auto s = c->streams.front();
+            if (s->seq > c->resp_seq || s->waiting || c->unsent() >= opts.low_watermark) {
+                return;
+            }
+            if (s->sn != nullptr) {
+                if (!s->sn->send_complete()) {
+                    return s->sn->send(c->nc);
+                }
+                s->sn->send_ok(c->nc);
+                s->sn->close();
+                return end_stream(c, s->seq);
+            }
+            auto st = stream_more;
+            while (st == stream_more && c->unsent() < opts.high_watermark) {
+                size_t room = opts.high_watermark - c->unsent();
+                size_t max = std::min(room, block_bytes);
+                iov_out o;
+                if (s->chunked) {
+                    o.head.assign(size_digits, '0');
+                    o.head.append("\r\n", 2);
+                }
+                size_t start = o.head.size();
+                while (st == stream_more && o.head.size() - start < max) {
+                    size_t before = o.head.size();
+                    st = s->produce(o.head, max - (before - start));
+                    if (st == stream_more && o.head.size() == before) {
+                        break;
+                    }
+                }
+                size_t n = o.head.size() - start;
+                if (s->chunked) {
+                    if (n > 0) {
+                        for (size_t i = 0, v = n; i < size_digits; ++i, v >>= 4) {
+                            o.head[size_digits - 1 - i] = "0123456789abcdef"[v & 0xf];
+                        }
+                        o.head.append("\r\n", 2);
+                    } else {
+                        o.head.clear();
+                    }
+                    if (st == stream_done) {
+                        o.head.append("0\r\n\r\n", 5);
+                    }
+                }
+                if (st == stream_done) {
+                    o.done = std::move(s->done);
+                }
+                if (!o.head.empty() || o.done != nullptr) {
+                    queue_iov(c, std::move(o));
+                }
+                if (n == 0 && st == stream_more) {
+                    /* nothing came, try again on the next event */
+                    return;
+                }
+                if (c->nc->flags & MG_F_CLOSE_IMMEDIATELY) {
+                    return;
+                }
+            }
+            if (st == stream_wait) {
+                s->waiting = true;
+            } else if (st == stream_done) {
+                end_stream(c, s->seq);
+            }
+        }
+
+        void end_stream(conn_t * c, uint64_t seq)
+        {
+            c->streams.pop_front();
+            finish_response(c, seq);
+        }
+
+        /* everything sent or queued on the connection, the offset the next response starts at */
+        static uint64_t queued(conn_t * c)
+        {
+            return c->bytes_out + c->unsent();
+        }
+
+        void begin_timing(conn_t * c, uint64_t seq, uint64_t bytes_in)
+        {
+            c->timings.emplace_back();
+            auto & t = c->timings.back();
+            t.seq = seq;
+            /* the requests a recv completes share its time */
+            t.start_us = c->recv_us;
+            t.bytes_in = bytes_in;
+            if (seq == c->resp_seq) {
+                t.begin = queued(c);
+            }
+        }
+
+        timing_t * timing_of(conn_t * c, uint64_t seq)
+        {
+            if (c->timings.empty() || seq < c->timings.front().seq) {
+                return nullptr;
+            }
+            size_t i = seq - c->timings.front().seq;
+            return i < c->timings.size() ? &c->timings[i] : nullptr;
+        }
+
+        /* decides whether the request whose first byte just came in is traced */
+        void sample_next(conn_t * c)
+        {
+            if (++trace_tick < server->_trace->sample_one_in) {
+                c->trace_next = -1;
+                return;
+            }
+            trace_tick = 0;
+            c->trace_next = 1;
+            c->first_byte_ns = now_ns();
+        }
+
+        /*
+         * The request that begin_timing was just called for is traced when
+         * sampled. Bytes of the next request read along with it count as
+         * arriving now.
+         */
+        void begin_trace(conn_t * c, mg_str method, mg_str uri, bool more)
+        {
+            if (c->trace_next == 1) {
+                auto & t = c->timings.back();
+                t.trace.reset(new trace_record());
+                auto & tr = *t.trace;
+                tr.reactor = index;
+                tr.conn = c->id;
+                tr.seq = t.seq;
+                tr.method.assign(method.p, method.len);
+                tr.path.assign(uri.p, uri.len);
+                if (t.seq == 0) {
+                    tr.at[trace_accept] = c->accept_ns;
+                }
+                tr.at[trace_first_byte] = c->first_byte_ns;
+                tr.at[trace_headers] = c->headers_ns != 0 ? c->headers_ns : now_ns();
+            }
+            c->trace_next = 0;
+            c->first_byte_ns = c->headers_ns = 0;
+            if (more) {
+                sample_next(c);
+            }
+        }
+
+        void stamp(conn_t * c, uint64_t seq, trace_point p)
+        {
+            auto t = timing_of(c, seq);
+            if (t != nullptr && t->trace != nullptr) {
+                t->trace->at[p] = now_ns();
+            }
+        }
+
+        /* the response being answered is complete, the next one starts where it ends */
+        void turn(conn_t * c)
+        {
+            auto at = queued(c);
+            auto t = timing_of(c, c->resp_seq);
+            if (t != nullptr) {
+                sniff(c, *t);
+                t->end = at;
+            }
+            t = timing_of(c, c->resp_seq + 1);
+            if (t != nullptr) {
+                t->begin = at;
+            }
+        }
+
+        /* takes the status of the responses that started and records those written in full */
+        void track(conn_t * c)
+        {
+            for (auto & t : c->timings) {
+                if (t.begin == UINT64_MAX) {
+                    break;
+                }
+                if (t.status == 0) {
+                    sniff(c, t);
+                }
+                if (t.trace != nullptr && t.trace->at[trace_first_write] == 0 && c->bytes_out > t.begin) {
+                    t.trace->at[trace_first_write] = now_ns();
+                }
+            }
+            uint64_t now = 0;
+            while (!c->timings.empty() && c->bytes_out >= c->timings.front().end) {
+                auto & t = c->timings.front();
+                auto route = t.route;
+                if (route == nullptr) {
+                    if (unrouted == nullptr) {
+                        unrouted = metrics.add(&unrouted, "unrouted");
+                    }
+                    route = unrouted;
+                }
+                if (now == 0) {
+                    now = now_us();
+                }
+                route->record(t.status, t.bytes_in, t.end - t.begin, now > t.start_us ? now - t.start_us : 0);
+                if (t.trace != nullptr) {
+                    end_trace(t, route);
+                }
+                c->timings.pop_front();
+            }
+        }
+
+        void end_trace(timing_t & t, route_stats * route)
+        {
+            auto & tr = *t.trace;
+            tr.at[trace_last_write] = now_ns();
+            if (tr.at[trace_first_write] == 0) {
+                tr.at[trace_first_write] = tr.at[trace_last_write];
+            }
+            tr.status = t.status;
+            tr.bytes_in = t.bytes_in;
+            tr.bytes_out = t.end - t.begin;
+            tr.route.assign(route->route);
+            traces.push(tr);
+        }
+
+        /* the byte at offset pos of what is sent on the connection, -1 when it is out already, in a file or not queued yet */
+        int peek(conn_t * c, uint64_t pos)
+        {
+            if (pos < c->bytes_out) {
+                return -1;
+            }
+            size_t k = (size_t)(pos - c->bytes_out);
+            auto & mb = c->nc->send_mbuf;
+            /* send_mbuf up to iov_staged goes first, then iov, then the rest of send_mbuf */
+            size_t staged = c->iov.empty() ? mb.len : std::min(c->iov_staged, mb.len);
+            if (k < staged) {
+                return (unsigned char)mb.buf[k];
+            }
+            k -= staged;
+            for (auto & o : c->iov) {
+                size_t n = o.head.size() - o.head_sent;
+                if (k < n) {
+                    return (unsigned char)o.head[o.head_sent + k];
+                }
+                k -= n;
+                for (size_t i = o.next; i < o.bufs.size(); ++i) {
+                    if (k < o.bufs[i].len) {
+                        return ((const unsigned char *)o.bufs[i].data)[k];
+                    }
+                    k -= o.bufs[i].len;
+                }
+                if (k < o.file_len) {
+                    return -1;
+                }
+                k -= o.file_len;
+            }
+            return staged + k < mb.len ? (unsigned char)mb.buf[staged + k] : -1;
+        }
+
+        /* reads the status from the start of the response, skipping interim 1xx ones */
+        void sniff(conn_t * c, timing_t & t)
+        {
+            static const size_t max_interim = 1024;
+            while (t.status == 0 && t.begin != UINT64_MAX) {
+                if (t.begin < c->bytes_out) {
+                    t.status = -1;
+                    return;
+                }
+                char line[12];
+                for (size_t i = 0; i < sizeof(line); ++i) {
+                    int ch = peek(c, t.begin + i);
+                    if (ch < 0) {
+                        return;
+                    }
+                    line[i] = (char)ch;
+                }
+                if (memcmp(line, "HTTP/", 5) != 0 || line[9] < '1' || line[9] > '5') {
+                    t.status = -1;
+                    return;
+                }
+                int status = (line[9] - '0') * 100 + (line[10] - '0') * 10 + (line[11] - '0');
+                if (status >= 200) {
+                    t.status = status;
+                    return;
+                }
+                /* 100 Continue and the like, the final status follows the empty line */
+                uint32_t last4 = 0;
+                size_t i = sizeof(line);
+                for (; i < max_interim; ++i) {
+                    int ch = peek(c, t.begin + i);
+                    if (ch < 0) {
+                        return;
+                    }
+                    last4 = (last4 << 8) | (uint32_t)ch;
+                    if (last4 == 0x0d0a0d0a) {
+                        break;
+                    }
+                }
+                if (i == max_interim) {
+                    t.status = -1;
+                    return;
+                }
+                t.begin += i + 1;
+            }
+        }
+
+        /*
+         * Writes the queued iov responses with writev, and file parts with
+         * sendfile, until the socket would block. Under epoll the connection
+         * then keeps write interest and is resumed from MG_EV_POLL. The select
+         * interface only watches sockets with bytes in send_mbuf, so there a
+         * slice of at most stage_bytes is copied into send_mbuf and the rest
+         * resumes from MG_EV_SEND.
+         */
+        void write_iov(conn_t * c)
+        {
+            static const size_t stage_bytes = 16 * 1024;
+            auto nc = c->nc;
+            std::vector<std::function<void(bool)>> finished;
+            settle_iov(c);
+#ifdef _WIN32
+            take_iov(c, c->iov_bytes, &nc->send_mbuf, finished);
+#else
+            while (!c->iov.empty() && nc->send_mbuf.len == 0 && !(nc->flags & MG_F_CLOSE_IMMEDIATELY)) {
+                ssize_t w;
+#ifdef __linux__
+                if (c->iov.front().at_file()) {
+                    auto & o = c->iov.front();
+                    off_t off = (off_t)o.file_off;
+                    w = sendfile(nc->sock, o.file.get(), &off, o.file_len);
+                    if (w == 0) {
+                        /* the file shrank, the promised length can't be kept */
+                        nc->flags |= MG_F_CLOSE_IMMEDIATELY;
+                        break;
+                    }
+                } else
+#endif
+                {
+                    w = write_iov_bufs(c);
+                }
+                if (w < 0 && errno == EINTR) {
+                    continue;
+                }
+                if (w < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                    if (epoll_iface::manages(nc)) {
+                        nc->flags |= epoll_iface::want_write_flag;
+                        epoll_iface::write_blocked(nc);
+                    } else {
+                        take_iov(c, std::min(c->iov_bytes, stage_bytes), &nc->send_mbuf, finished);
+                        c->iov_staged = nc->send_mbuf.len;
+                    }
+                    break;
+                }
+                if (w < 0) {
+                    nc->flags |= MG_F_CLOSE_IMMEDIATELY;
+                    break;
+                }
+                if (w > 0) {
+                    nc->last_io_time = (time_t)mg_time();
+                    c->last_active = now_ms();
+                }
+                take_iov(c, (size_t)w, nullptr, finished);
+            }
+#endif
+            if (c->iov.empty()) {
+                nc->flags &= ~epoll_iface::want_write_flag;
+                if (c->close_after_iov) {
+                    c->close_after_iov = false;
+                    nc->flags |= MG_F_SEND_AND_CLOSE;
+                }
+            }
+            for (auto & done : finished) {
+                done(true);
+            }
+        }
+
+#ifndef _WIN32
+        /* one writev over the memory parts up to the next file part */
+        ssize_t write_iov_bufs(conn_t * c)
+        {
+            static const int max_iov = 64;
+            struct iovec v[max_iov];
+            int n = 0;
+            for (auto & o : c->iov) {
+                if (o.head_sent < o.head.size()) {
+                    v[n].iov_base = &o.head[o.head_sent];
+                    v[n++].iov_len = o.head.size() - o.head_sent;
+                }
+                for (size_t i = o.next; i < o.bufs.size() && n < max_iov; ++i) {
+                    if (o.bufs[i].len > 0) {
+                        v[n].iov_base = (void *)o.bufs[i].data;
+                        v[n++].iov_len = o.bufs[i].len;
+                    }
+                }
+                if (n >= max_iov - 1 || o.file_len > 0) {
+                    break;
+                }
+            }
+            return n > 0 ? writev(c->nc->sock, v, n) : 0;
+        }
+#endif
+
+        /* drop n written bytes from the front of iov, copying them to stage when given */
+        void take_iov(conn_t * c, size_t n, mbuf * stage, std::vector<std::function<void(bool)>> & finished)
+        {
+            c->iov_bytes -= n;
+            if (stage == nullptr) {
+                c->bytes_out += n;
+            }
+            while (!c->iov.empty()) {
+                auto & o = c->iov.front();
+                size_t k = std::min(n, o.head.size() - o.head_sent);
+                if (stage != nullptr && k > 0) {
+                    mbuf_append(stage, o.head.data() + o.head_sent, k);
+                }
+                o.head_sent += k;
+                n -= k;
+                while (o.next < o.bufs.size()) {
+                    auto & b = o.bufs[o.next];
+                    k = std::min(n, b.len);
+                    if (stage != nullptr && k > 0) {
+                        mbuf_append(stage, b.data, k);
+                    }
+                    b.data = (const char *)b.data + k;
+                    b.len -= k;
+                    n -= k;
+                    if (b.len > 0) {
+                        break;
+                    }
+                    o.next++;
+                }
+                k = o.next == o.bufs.size() ? std::min(n, o.file_len) : 0;
+#ifndef _WIN32
+                if (stage != nullptr && k > 0) {
+                    auto at = stage->len;
+                    mbuf_resize(stage, at + k);
+                    auto r = pread(o.file.get(), stage->buf + at, k, (off_t)o.file_off);
+                    stage->len = at + (r > 0 ? (size_t)r : 0);
+                    if (r != (ssize_t)k) {
+                        c->nc->flags |= MG_F_CLOSE_IMMEDIATELY;
+                    }
+                }
+#endif
+                o.file_off += k;
+                o.file_len -= k;
+                n -= k;
+                if (o.head_sent < o.head.size() || o.next < o.bufs.size() || o.file_len > 0) {
+                    return;
+                }
+                if (o.done != nullptr) {
+                    finished.push_back(std::move(o.done));
+                }
+                c->iov.pop_front();
+            }
+        }
+
+        void set_congested(conn_t * c, bool congested)
+        {
+            c->congested->store(congested, std::memory_order_relaxed);
+            if (server->_on_ws_congestion != nullptr) {
+                server->_on_ws_congestion(ws_conn(c->nc, server), congested);
+            }
+        }
+
+        /*
+         * Interrupts mg_mgr_poll from another thread. A burst of calls costs a
+         * single write until the reactor has flushed again.
+         */
+        void wakeup()
+        {
+            if (wake[1] == INVALID_SOCKET || wakeup_pending.exchange(true)) {
+                return;
+            }
+            char c = 0;
+            ::send(wake[1], &c, 1, 0);
+        }
+
+        bool init_wakeup()
+        {
+#ifdef _WIN32
+            if (!mg_socketpair(wake, SOCK_STREAM)) {
+                return false;
+            }
+            unsigned long on = 1;
+            ioctlsocket(wake[1], FIONBIO, &on);
+#else
+            int sp[2];
+            if (socketpair(AF_UNIX, SOCK_STREAM, 0, sp) != 0) {
+                return false;
+            }
+            fcntl(sp[1], F_SETFL, fcntl(sp[1], F_GETFL, 0) | O_NONBLOCK);
+            fcntl(sp[1], F_SETFD, FD_CLOEXEC);
+            wake[0] = sp[0];
+            wake[1] = sp[1];
+#endif
+            auto nc = mg_add_sock(&mgr, wake[0], reactor::wakeup_ev_handler);
+            if (nc == nullptr) {
+                return false;
+            }
+            nc->user_data = this;
+            return true;
+        }
+
+        static void wakeup_ev_handler(struct mg_connection * nc, int ev, void *)
+        {
+            if (ev != MG_EV_RECV) {
+                return;
+            }
+            mbuf_remove(&nc->recv_mbuf, nc->recv_mbuf.len);
+            ((reactor *)nc->user_data)->flush();
+        }
+
+        /* stop accepting and say goodbye to the websockets */
+        void start_drain()
+        {
+            if (draining) {
+                return;
+            }
+            draining = true;
+            if (listener != nullptr) {
+                listener->flags |= MG_F_CLOSE_IMMEDIATELY;
+            }
+            for (auto & i : conns) {
+                auto nc = i.second->nc;
+                if (is_websocket(nc)) {
+                    /* 1001 going away */
+                    mg_send_websocket_frame(nc, WEBSOCKET_OP_CLOSE, "\x03\xe9", 2);
+                    nc->flags |= MG_F_SEND_AND_CLOSE;
+                }
+            }
+        }
+
+        /*
+         * Close every http connection that has nothing left to answer, HTTP/2
+         * ones are told to open no more streams first. Returns true once all
+         * connections of this reactor are gone.
+         */
+        bool drain_step()
+        {
+            for (auto & i : conns) {
+                auto c = i.second;
+                if (c->h2 != nullptr) {
+                    c->h2->go_away();
+                    if (c->h2->open_streams() > 0) {
+                        continue;
+                    }
+                }
+                if (is_websocket(c->nc) || c->in_flight > 0 || c->nc->recv_mbuf.len > 0 || !c->iov.empty() || !c->held.empty()) {
+                    continue;
+                }
+                if (!c->streams.empty()) {
+                    continue;
+                }
+                c->nc->flags |= MG_F_SEND_AND_CLOSE;
+            }
+            return conns.empty();
+        }
+
+        void end_uploads()
+        {
+            while (!uploads_over.empty()) {
+                auto id = uploads_over.back();
+                uploads_over.pop_back();
+                auto i = conns.find(id);
+                if (i != conns.end() && i->second->upload != nullptr && i->second->upload->ended && !i->second->upload->busy) {
+                    server->end_upload(i->second);
+                }
+            }
+        }
+
+        /* what the connections of this reactor hold right now, see http_server::enable_metrics */
+        void gauges(reactor_gauges & g)
+        {
+            for (auto & i : conns) {
+                auto c = i.second;
+                if (is_websocket(c->nc)) {
+                    g.ws_conns++;
+                } else {
+                    g.http_conns++;
+                }
+                g.streams += c->streams.size();
+                g.send_mbuf += c->nc->send_mbuf.len;
+                g.recv_mbuf += c->nc->recv_mbuf.len;
+            }
+            g.send_queue = for_send.size();
+        }
+
+        void run(size_t interval)
+        {
+            thread_id = std::this_thread::get_id();
+            bool timed = !server->_metrics_path.empty();
+            uint64_t last = timed ? now_us() : 0;
+            while (!server->_stop) {
+                mg_mgr_poll(&mgr, poll_timeout(interval));
+                run_timers();
+                flush();
+                end_uploads();
+                if (draining && !drained && drain_step()) {
+                    drained = true;
+                    server->on_reactor_drained();
+                }
+                if (timed) {
+                    auto now = now_us();
+                    poll_time.record(now - last);
+                    poll_sum_us.store(poll_sum_us.load(std::memory_order_relaxed) + (now - last), std::memory_order_relaxed);
+                    last = now;
+                }
+            }
+            mg_mgr_free(&mgr);
+        }
+    };
+
+    std::vector<std::unique_ptr<reactor>> _reactors;
+    routing::router<function<void(ws_conn *, const json &)>> * _ws_router = nullptr;
+    routing::router<function<void(http_context *, routing::params *)>> * _http_router = nullptr;
+    routing::router<function<void(http_context *, routing::params *)>> * _async_http_router = nullptr;
+    routing::router<function<void(http_context *, routing::params *)>> * _stream_http_router = nullptr;
+    body_stream_opts _body_stream;
+#ifdef BOO_NETWORK_HAS_COROUTINE
+    routing::router<function<task<void>(http_context &, routing::params &)>> * _coro_http_router = nullptr;
+    routing::router<function<task<void>(ws_conn &, const json &)>> * _coro_ws_router = nullptr;
+#endif
+    std::unique_ptr<worker_pool> _workers;
+
+    struct mg_connection * _nc = nullptr;
+    std::function<void(const ws_conn &)> _on_ws_close = nullptr;
+    std::function<void(http_server * s, mg_connection * conn)> _on_http_close = nullptr;
+    std::function<void(const ws_conn &, bool congested)> _on_ws_congestion = nullptr;
+    ws_backpressure_opts _ws_backpressure;
+    stream_opts _stream_opts;
+
+    struct route_limit {
+        size_t max_in_flight;
+        std::atomic<size_t> in_flight{0};
+
+        route_limit(size_t max): max_in_flight(max) {}
+    };
+
+    admission_opts _admission;
+    timeout_opts _timeouts;
+    std::string _shed_response;
+    routing::router<std::shared_ptr<route_limit>> _route_limits;
+    bool _route_limits_enabled = false;
+    routing::router<std::shared_ptr<route_cache_opts>> _cached_routes;
+    bool _route_cache_enabled = false;
+    bool _route_metrics_enabled = false;
+    response_cache _response_cache;
+
+    /* see enable_metrics, the buffers are reused by every scrape under _metrics_m */
+    std::string _metrics_path;
+    std::string _metrics_route;
+    std::mutex _metrics_m;
+    std::string _metrics_buf;
+    std::vector<route_snapshot> _metrics_routes;
+    std::vector<uint64_t> _metrics_counts;
+
+    /*
+     * A handler invocation for a coalesced key. The capture owns it, requests
+     * with the same key park their detached context on it meanwhile.
+     */
+    struct flight {
+        http_server * server;
+        std::string key;
+        std::vector<std::shared_ptr<http_context>> waiters;
+        bool finished = false;
+
+        flight(http_server * s, const std::string & k): server(s), key(k) {}
+
+        ~flight()
+        {
+            /* the handler never sent a fixed-length response */
+            if (!finished) {
+                finish(nullptr);
+            }
+        }
+
+        void finish(response_cache::response_ptr response)
+        {
+            finished = true;
+            std::vector<std::shared_ptr<http_context>> parked;
+            {
+                std::lock_guard<std::mutex> locker(server->_flights_m);
+                server->_flights.erase(key);
+                parked.swap(waiters);
+            }
+            for (auto & w : parked) {
+                if (response != nullptr) {
+                    w->send_iov(std::string(), { iov_buf{ response->data(), response->size() } }, [response](bool) {});
+                } else {
+                    w->send(503, std::string(status_reason(503)));
+                }
+            }
+        }
+    };
+
+    std::mutex _flights_m;
+    std::unordered_map<std::string, flight *> _flights;
+    std::atomic<size_t> _conns{0};
+    std::atomic<uint64_t> _shed{0};
+
+    std::atomic<bool> _stop{false};
+    /* guarded by _state_m */
+    bool _polling = false;
+    size_t _drained = 0;
+    std::mutex _state_m;
+    std::condition_variable _state_cv;
+    bool _ws_enabled = false;
+    bool _webroot_enabled = false;
+    bool _http_api_enabled = false;
+    bool _listening = false;
+    bool _use_epoll = false;
+    size_t _send_queue_size = 16384;
+
+    struct mg_serve_http_opts * _webroot_opts;
+    std::unique_ptr<asset_cache> _assets;
+    std::unique_ptr<h2_opts> _h2;
+    std::unique_ptr<trace_opts> _trace;
+    /* mixed into the OpenTelemetry trace ids */
+    uint64_t _trace_seed = 0;
+
+    static conn_t * conn_of(const struct mg_connection * nc)
+    {
+        return (conn_t *)nc->user_data;
+    }
+
+    static reactor * reactor_of(const struct mg_connection * nc)
+    {
+        return conn_of(nc)->r;
+    }
+
+    static int is_websocket(const struct mg_connection *nc) {
+        return nc->flags & MG_F_IS_WEBSOCKET;
+    };
+
+    void on_ws_close(const ws_conn & ws) {
+        if (_on_ws_close != nullptr) {
+            _on_ws_close(ws);
+        }
+    };
+
+    void on_accept(conn_t * c)
+    {
+        c->accepted = true;
+        if (_timeouts.idle > 0 || _timeouts.header_read > 0 || _timeouts.write_stall > 0) {
+            c->last_active = c->reading_since = reactor::now_ms();
+            c->r->check_timeout(c);
+        }
+        if (_trace != nullptr) {
+            c->accept_ns = reactor::now_ns();
+        }
+        auto n = ++_conns;
+        if (_admission.max_conns > 0 && n > _admission.max_conns) {
+            c->over_limit = true;
+        }
+    }
+
+    void shed(struct mg_connection * nc)
+    {
+        _shed++;
+        if (_shed_response.empty()) {
+            set_admission(_admission);
+        }
+        mg_send(nc, _shed_response.data(), (int)_shed_response.length());
+        nc->flags |= MG_F_SEND_AND_CLOSE;
+    }
+
+    /*
+     * Returns false when the request has been shed. slot is set when the
+     * route has an in-flight limit and must be held while the request is
+     * being handled.
+     */
+    bool admit(struct mg_connection * nc, struct http_message * hm, std::shared_ptr<void> & slot)
+    {
+        if (!admissible(conn_of(nc), to_string_view(hm->method), to_string_view(hm->uri), slot)) {
+            shed(nc);
+            return false;
+        }
+        return true;
+    }
+
+    /* the checks of admit(), without answering */
+    bool admissible(conn_t * c, std::string_view method, std::string_view path, std::shared_ptr<void> & slot)
+    {
+        if (c->over_limit) {
+            return false;
+        }
+        if (_admission.max_conn_outbound > 0 && c->outbound() > _admission.max_conn_outbound) {
+            return false;
+        }
+        if (_admission.max_send_queue > 0 && c->r->for_send.size() > _admission.max_send_queue) {
+            return false;
+        }
+        if (_admission.max_worker_backlog > 0 && _workers != nullptr && _async_http_router != nullptr
+            && _workers->pending() > _admission.max_worker_backlog) {
+            return false;
+        }
+        if (!_route_limits_enabled) {
+            return true;
+        }
+        routing::params p;
+        auto found = _route_limits.find(method, path, &p);
+        if (found == nullptr) {
+            return true;
+        }
+        auto limit = *found;
+        if (++limit->in_flight > limit->max_in_flight) {
+            limit->in_flight--;
+            return false;
+        }
+        slot = std::shared_ptr<void>(limit.get(), [limit](void *) {
+            limit->in_flight--;
+        });
+        return true;
+    }
+
+    /* keeps the timestamps checked by reactor::check_timeout current */
+    void touch(conn_t * c, int ev)
+    {
+        switch (ev) {
+            case MG_EV_RECV:
+                c->last_active = reactor::now_ms();
+                /* HTTP/2 streams are answered as they complete, there is no request being read */
+                if (c->reading_since == 0 && c->h2 == nullptr && c->upload == nullptr) {
+                    c->reading_since = c->last_active;
+                }
+                break;
+            case MG_EV_SEND:
+                c->last_active = reactor::now_ms();
+                c->stall_since = c->nc->send_mbuf.len > 0 ? c->last_active : 0;
+                break;
+            case MG_EV_HTTP_REQUEST:
+            case MG_EV_WEBSOCKET_HANDSHAKE_REQUEST:
+                c->reading_since = 0;
+                break;
+        }
+    }
+
+    void on_reactor_drained()
+    {
+        {
+            std::lock_guard<std::mutex> locker(_state_m);
+            _drained++;
+        }
+        _state_cv.notify_all();
+    }
+
+    bool on_reactor_thread() const
+    {
+        auto id = std::this_thread::get_id();
+        for (auto & r : _reactors) {
+            if (r->thread_id == id) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void on_http_close(mg_connection * nc) {
+        auto & streams = conn_of(nc)->streams;
+        while (!streams.empty()) {
+            auto s = std::move(streams.front());
+            streams.pop_front();
+            if (s->sn != nullptr) {
+                s->sn->close();
+            } else if (s->done != nullptr) {
+                s->done(false);
+            }
+        }
+        if (_on_http_close != nullptr) {
+            _on_http_close(this, nc);
+        }
+    }
+
+public:
+    http_server()
+    {
+    }
+
+    /*
+     * sn streams the response to the request being dispatched on nc. Streams
+     * of pipelined requests run one after the other, in request order; a
+     * second one for the same request replaces the first.
+     */
+    void reg_send_next(struct mg_connection * nc, send_next_t * sn)
+    {
+        auto c = conn_of(nc);
+        if (c->h2 != nullptr) {
+            delete sn;
+            throw "send_next stream on an http2 connection";
+        }
+        auto & streams = c->streams;
+        if (!streams.empty() && streams.back()->seq == c->dispatch_seq) {
+            streams.back()->sn.reset(sn);
+        } else {
+            auto s = std::make_shared<stream_t>();
+            s->seq = c->dispatch_seq;
+            s->sn.reset(sn);
+            streams.push_back(std::move(s));
+        }
+        c->answer_later = true;
+    }
+
+    /* must be called before listen(), ignored where epoll is not available */
+    void use_epoll(bool use = true)
+    {
+        _use_epoll = use;
+    }
+
+    /* capacity of each reactor's outbound websocket queue, must be called before listen() */
+    void set_send_queue_size(size_t size)
+    {
+        _send_queue_size = size;
+    }
+
+    /*
+     * Load shedding limits, checked before a request is routed. Requests over
+     * a limit are answered with a canned 503 and the connection is closed.
+     */
+    void set_admission(const admission_opts & opts)
+    {
+        _admission = opts;
+        _shed_response = "HTTP/1.1 503 Service Unavailable\r\n"
+            "Retry-After: " + std::to_string(opts.retry_after) + "\r\n"
+            "Content-Length: 0\r\n"
+            "Connection: close\r\n\r\n";
+    }
+
+    /*
+     * Caps the requests of a route being handled at once, counting async and
+     * coroutine handlers until their detached context is gone. path uses the
+     * router syntax, e.g. "/users/{id}". Not thread safe, call before listen().
+     */
+    void limit_route(routing::method m, const std::string & path, size_t max_in_flight)
+    {
+        if (_shed_response.empty()) {
+            set_admission(_admission);
+        }
+        _route_limits.on(m, path, std::make_shared<route_limit>(max_in_flight));
+        _route_limits_enabled = true;
+    }
+
+    /*
+     * Serves GET responses of a route from memory for opts.ttl, keyed by path,
+     * sorted query and the opts.vary headers; the handler is not called on a
+     * hit. Only 200s sent with a fixed length (send(status, body) and the
+     * json/http_response overloads) without Set-Cookie are stored. With
+     * opts.coalesce, requests arriving while the handler runs for their key
+     * get its response when it could have been stored, and a 503 otherwise.
+     * Requests with a Cookie or Authorization header not in opts.vary neither
+     * wait for nor lead a coalesced run. Not thread safe, call before
+     * listen().
+     */
+    void cache_route(const std::string & path, const route_cache_opts & opts = route_cache_opts())
+    {
+        _cached_routes.on(routing::get, path, std::make_shared<route_cache_opts>(opts));
+        _route_cache_enabled = true;
+    }
+
+    /* shared by all cached routes, least recently used entries go first, 16 MiB by default */
+    void set_response_cache_size(size_t max_bytes)
+    {
+        _response_cache.set_max_bytes(max_bytes);
+    }
+
+    response_cache & responses()
+    {
+        return _response_cache;
+    }
+
+    /*
+     * Cleartext HTTP/2 next to HTTP/1.1 on the same port: clients either
+     * open with the HTTP/2 preface (prior knowledge) or send an HTTP/1.1
+     * request with "Upgrade: h2c" and HTTP2-Settings. Streams go through
+     * the async, coroutine and plain routers like HTTP/1 requests, with an
+     * http_context answering on the stream; the response cache, the webroot
+     * and streamed responses are HTTP/1 only. Must be called before listen().
+     */
+    void enable_h2c(const h2_opts & opts = h2_opts())
+    {
+        _h2.reset(new h2_opts(opts));
+    }
+
+    /* per connection timeouts, must be called before listen() */
+    void set_timeouts(const timeout_opts & opts)
+    {
+        _timeouts = opts;
+    }
+
+    /* requests answered 503 by admission control so far */
+    uint64_t shed_count() const
+    {
+        return _shed;
+    }
+
+    /*
+     * Counts HTTP/1 requests by route pattern, e.g. "GET /users/{id}": how
+     * many, their status classes, bytes in and out, and a latency histogram
+     * from the request being parsed to the last byte of its response being
+     * written to the socket. Static files count as "webroot", everything no
+     * route took (404s, shed requests) as "unrouted". Every reactor keeps
+     * its own numbers, route_snapshots() adds them up. Must be called before
+     * listen().
+     */
+    void enable_route_metrics()
+    {
+        _route_metrics_enabled = true;
+    }
+
+    /* may be called from any thread */
+    std::vector<route_snapshot> route_snapshots()
+    {
+        std::vector<route_snapshot> out;
+        for (auto & r : _reactors) {
+            r->metrics.snapshot(out);
+        }
+        std::sort(out.begin(), out.end(), [](const route_snapshot & a, const route_snapshot & b) {
+            return a.route < b.route;
+        });
+        return out;
+    }
+
+    /*
+     * Answers GET path with the Prometheus text format: connections by kind,
+     * send queue depths, streams in flight, mbuf bytes and the run loop
+     * iteration time of every reactor, then the route metrics, which this
+     * turns on. Every reactor is asked for its numbers with a task and the
+     * page is rendered on the worker pool, so a scrape never holds a reactor
+     * up.
+     * The path is served before the routers and admission control, over
+     * HTTP/1 and HTTP/2. Must be called before listen().
+     */
+    void enable_metrics(const std::string & path = "/metrics")
+    {
+        workers();
+        _metrics_path = path;
+        _metrics_route = "GET " + path;
+        _route_metrics_enabled = true;
+        std::lock_guard<std::mutex> locker(_metrics_m);
+        _metrics_buf.reserve(64 * 1024);
+        _metrics_counts.assign(latency_histogram::bucket_count, 0);
+    }
+
+    /*
+     * Timestamps the life of sampled HTTP/1 requests: accept (on the first
+     * request of a connection), first byte read, headers complete, routed,
+     * handler returned, first and last byte written. A detached context
+     * counts as returned when its last copy goes away, and writes are seen
+     * when the reactor next looks at the connection. Each reactor keeps the
+     * last ring_size records for export_traces(). A request that is not
+     * sampled costs a counter. Turns on the route metrics. Must be called
+     * before listen().
+     */
+    void enable_tracing(const trace_opts & opts = trace_opts())
+    {
+        if (opts.sample_one_in == 0) {
+            throw "sample_one_in must be at least 1";
+        }
+        workers();
+        _trace.reset(new trace_opts(opts));
+        _trace_seed = ((uint64_t)std::random_device()() << 32) | std::random_device()();
+        _route_metrics_enabled = true;
+    }
+
+    /*
+     * The traced requests of every reactor, oldest first, as Chrome trace
+     * JSON or as an OTLP/JSON export request. done gets them on a worker
+     * pool thread once all reactors copied their ring; may be called from any
+     * thread, handlers included.
+     */
+    void export_traces(trace_format format, std::function<void(std::string && out)> done)
+    {
+        if (_trace == nullptr) {
+            throw "tracing is not enabled";
+        }
+        gather<std::vector<trace_record>>([](reactor * r, std::vector<trace_record> & part) {
+            r->traces.copy_to(part);
+        }, [this, format, done](std::vector<std::vector<trace_record>> & parts) {
+            std::vector<trace_record> all;
+            for (auto & part : parts) {
+                std::move(part.begin(), part.end(), std::back_inserter(all));
+            }
+            std::stable_sort(all.begin(), all.end(), [](const trace_record & a, const trace_record & b) {
+                return a.start() < b.start();
+            });
+            done(format == trace_chrome_json ? chrome_trace_json(all) : otlp_trace_json(all, _trace->service_name, _trace_seed));
+        });
+    }
+
+    size_t conns() const
+    {
+        return _conns;
+    }
+
+    /*
+     * Stops the reactors right away, open connections are dropped. Blocks
+     * until poll() returned unless called from a reactor thread.
+     */
+    void stop() {
+        _stop = true;
+        for (auto & r : _reactors) {
+            r->wakeup();
+        }
+        if (on_reactor_thread()) {
+            return;
+        }
+        std::unique_lock<std::mutex> locker(_state_m);
+        _state_cv.wait(locker, [this]() {
+            return !_polling;
+        });
+    }
+
+    /*
+     * Graceful stop: closes the listeners, sends a close frame to every
+     * websocket and lets in-flight requests and streamed responses finish
+     * before stopping the reactors. Whatever is still open at the deadline
+     * is dropped, in which case false is returned. Must not be called from a
+     * reactor thread.
+     */
+    bool drain(std::chrono::milliseconds timeout)
+    {
+        if (on_reactor_thread()) {
+            throw "drain() called from a reactor thread";
+        }
+        auto deadline = std::chrono::steady_clock::now() + timeout;
+        for (auto & r : _reactors) {
+            auto p = r.get();
+            p->post([p]() {
+                p->start_drain();
+            });
+        }
+        bool drained;
+        {
+            std::unique_lock<std::mutex> locker(_state_m);
+            drained = _state_cv.wait_until(locker, deadline, [this]() {
+                return !_polling || _drained == _reactors.size();
+            });
+        }
+        stop();
+        return drained;
+    }
+
+    void enable_ws(routing::router<function<void(ws_conn *, const json &)>> * router)
+    {
+        _ws_router = router;
+        _ws_enabled = true;
+        for (auto & r : _reactors) {
+            r->ws_router = router;
+        }
+    }
+
+    /*
+     * Keep small webroot files and their .gz/.br siblings in memory as ready
+     * responses, invalidated through inotify. Linux only, a no-op elsewhere.
+     */
+    void enable_asset_cache(const asset_cache_opts & opts = asset_cache_opts())
+    {
+#ifdef __linux__
+        _assets.reset(new asset_cache(opts));
+#endif
+    }
+
+    asset_cache * assets()
+    {
+        return _assets.get();
+    }
+
+    void enable_webroot(struct mg_serve_http_opts * opts)
+    {
+        _webroot_opts = opts;
+        _webroot_enabled = true;
+    }
+
+    void enable_http_api(routing::router<function<void(http_context *, routing::params *)>> * router)
+    {
+        _http_router = router;
+        _http_api_enabled = true;
+        for (auto & r : _reactors) {
+            r->http_router = router;
+        }
+    }
+
+    /* size of the pool running async http handlers, defaults to one thread per core */
+    void set_workers(size_t n)
+    {
+        _workers.reset(new worker_pool(n));
+    }
+
+    worker_pool * workers()
+    {
+        if (_workers == nullptr) {
+            set_workers(std::thread::hardware_concurrency());
+        }
+        return _workers.get();
+    }
+
+    /*
+     * Handlers of this router run on the worker pool with a detached
+     * http_context and may respond whenever they like. It is consulted before
+     * the router given to enable_http_api.
+     */
+    void enable_async_http_api(routing::router<function<void(http_context *, routing::params *)>> * router)
+    {
+        workers();
+        _async_http_router = router;
+        _http_api_enabled = true;
+    }
+
+    bool handle_async_http_api(struct mg_connection * nc, struct http_message * hm, std::shared_ptr<void> slot = nullptr,
+        http_context::capture_t capture = nullptr)
+    {
+        if (_async_http_router == nullptr) {
+            return false;
+        }
+        routing::params p;
+        auto callback = _async_http_router->find(to_string_view(hm->method), to_string_view(hm->uri), &p);
+        if (callback == nullptr) {
+            return false;
+        }
+        note_route(conn_of(nc), _async_http_router, callback);
+        http_context ctx(nc, nullptr, hm);
+        ctx.set_server(this);
+        ctx.set_admission(slot);
+        ctx.set_capture(std::move(capture));
+        auto actx = ctx.detach();
+        auto fn = *callback;
+        _workers->post([actx, p, fn]() mutable {
+            fn(actx.get(), &p);
+        });
+        return true;
+    }
+
+    /*
+     * Handlers of this router get the request once its headers are in,
+     * before the body is read, on the reactor thread. They refuse the body by
+     * answering right away, or take it piece by piece with ctx->read_body(),
+     * so that uploads of any size are read in constant memory instead of
+     * being buffered whole. Consulted before every other router. On HTTP/2
+     * the session buffers the body (h2_opts::max_body_size) and it arrives
+     * as a single piece.
+     */
+    void enable_stream_http_api(routing::router<function<void(http_context *, routing::params *)>> * router,
+        const body_stream_opts & opts = body_stream_opts())
+    {
+        workers();
+        _stream_http_router = router;
+        _body_stream = opts;
+        _http_api_enabled = true;
+    }
+
+#ifdef BOO_NETWORK_HAS_COROUTINE
+    /*
+     * Handlers of this router are coroutines started on the reactor with a
+     * detached http_context. They may co_await ctx.sleep_for() or
+     * ctx.fetch() and are resumed on the same reactor. Consulted after the
+     * async router and before the plain one.
+     */
+    void enable_coro_http_api(routing::router<function<task<void>(http_context &, routing::params &)>> * router)
+    {
+        workers();
+        _coro_http_router = router;
+        _http_api_enabled = true;
+    }
+
+    /* coroutine handlers for ws messages, consulted before the plain ws router */
+    void enable_coro_ws(routing::router<function<task<void>(ws_conn &, const json &)>> * router)
+    {
+        _coro_ws_router = router;
+        _ws_enabled = true;
+    }
+
+    bool handle_coro_http_api(struct mg_connection * nc, struct http_message * hm, std::shared_ptr<void> slot = nullptr,
+        http_context::capture_t capture = nullptr)
+    {
+        if (_coro_http_router == nullptr) {
+            return false;
+        }
+        routing::params p;
+        auto callback = _coro_http_router->find(to_string_view(hm->method), to_string_view(hm->uri), &p);
+        if (callback == nullptr) {
+            return false;
+        }
+        note_route(conn_of(nc), _coro_http_router, callback);
+        http_context ctx(nc, nullptr, hm);
+        ctx.set_server(this);
+        ctx.set_admission(slot);
+        ctx.set_capture(std::move(capture));
+        run_coro_http(ctx.detach(), std::move(p), *callback);
+        return true;
+    }
+
+    bool handle_coro_ws_api(ws_conn & conn, const std::string & path, const json & msg)
+    {
+        if (_coro_ws_router == nullptr) {
+            return false;
+        }
+        bool handled = false;
+        routing::params p;
+        _coro_ws_router->route(path, &p, [&](bool path_found, routing::params *, function<task<void>(ws_conn &, const json &)> callback) {
+            if (!path_found || callback == nullptr) {
+                return;
+            }
+            run_coro_ws(conn, msg, callback);
+            handled = true;
+        });
+        return handled;
+    }
+
+    /* the parameters are copied into the coroutine frame and live as long as the handler */
+    static detached_task run_coro_http(std::shared_ptr<http_context> ctx, routing::params p, function<task<void>(http_context &, routing::params &)> callback)
+    {
+        try {
+            co_await callback(*ctx, p);
+        } catch (...) {
+            if (ctx->stream() != 0) {
+                ctx->send(500, std::string("internal error"));
+            } else {
+                ctx->with_conn([](mg_connection * nc) {
+                    mg_http_send_error(nc, 500, "internal error");
+                });
+            }
+        }
+    }
+
+    static detached_task run_coro_ws(ws_conn conn, json msg, function<task<void>(ws_conn &, const json &)> callback)
+    {
+        try {
+            co_await callback(conn, msg);
+        } catch (...) {
+        }
+    }
+#endif
+
+    /*
+     * Mongoose hands over the requests a client pipelined one after the other
+     * within a single recv. Each gets the next number on the connection and
+     * is dispatched right away, while what it writes waits behind the
+     * responses still owed to earlier ones. Unless a detached context or a
+     * stream carries it on, the response is complete once the handler
+     * returns.
+     *
+     * Files mg_serve_http keeps streaming from MG_EV_SEND (directory indexes
+     * aside, only where sendfile is not used) are not ordered beyond their
+     * first slice; mongoose also stops parsing the pipeline until they end.
+     */
+    void dispatch_http(struct mg_connection * nc, struct http_message * hm)
+    {
+        auto c = conn_of(nc);
+        if ((nc->flags & (MG_F_SEND_AND_CLOSE | MG_F_CLOSE_IMMEDIATELY)) || c->close_after_iov || c->close_held) {
+            /* an earlier response closes the connection, nothing after it would be read */
+            return;
+        }
+        if (_h2 != nullptr && upgrade_h2(c, hm)) {
+            return;
+        }
+        auto seq = c->dispatch_seq = c->next_seq++;
+        if (_route_metrics_enabled) {
+            c->r->begin_timing(c, seq, hm->message.len);
+        }
+        if (_trace != nullptr) {
+            size_t end = hm->message.p - nc->recv_mbuf.buf + hm->message.len;
+            c->r->begin_trace(c, hm->method, hm->uri, end < nc->recv_mbuf.len);
+        }
+        c->answer_later = false;
+        c->r->write_for(c, seq, [this, hm](mg_connection * nc) {
+            handle_http_api(nc, hm);
+        });
+        if (_trace != nullptr) {
+            /* a detached context stamps it again when it goes away */
+            c->r->stamp(c, seq, trace_handler_returned);
+        }
+        if (!c->answer_later) {
+            c->r->finish_response(c, seq);
+        }
+        if (_stream_http_router != nullptr) {
+            /* a streamed request right behind must be taken before mongoose buffers its body */
+            size_t end = hm->message.p - nc->recv_mbuf.buf + hm->message.len;
+            begin_upload(c, end);
+        }
+    }
+
+    /*
+     * Takes over the request starting at offset at of the receive buffer when
+     * its headers are in and the stream router has it. Everything from at on
+     * leaves the buffer, and the connection gets raw events until the body
+     * has been handed to the handler, see recv_upload and end_upload. False
+     * leaves the request to mongoose.
+     */
+    bool begin_upload(conn_t * c, size_t at)
+    {
+        auto nc = c->nc;
+        auto & io = nc->recv_mbuf;
+        if (at >= io.len || c->upload != nullptr || c->h2 != nullptr || is_websocket(nc) ||
+            (nc->flags & (MG_F_SEND_AND_CLOSE | MG_F_CLOSE_IMMEDIATELY)) || c->close_after_iov || c->close_held) {
+            return false;
+        }
+        struct http_message hm;
+        int head = mg_parse_http(io.buf + at, (int)(io.len - at), &hm, 1);
+        if (head <= 0) {
+            return false;
+        }
+        routing::params p;
+        auto callback = _stream_http_router->find(to_string_view(hm.method), to_string_view(hm.uri), &p);
+        if (callback == nullptr || *callback == nullptr) {
+            return false;
+        }
+        auto u = std::make_shared<upload_t>();
+        int refuse = 0;
+        auto te = mg_get_http_header(&hm, "Transfer-Encoding");
+        if (te != nullptr) {
+            if (mg_vcasecmp(te, "chunked") == 0) {
+                u->body = body_decoder::chunked();
+            } else {
+                refuse = 501;
+            }
+        } else if (mg_get_http_header(&hm, "Content-Length") != nullptr) {
+            u->body = body_decoder::length(hm.body.len);
+            if (_body_stream.max_body_size > 0 && hm.body.len > _body_stream.max_body_size) {
+                refuse = 413;
+            }
+        }
+        auto expect = mg_get_http_header(&hm, "Expect");
+        bool expect_continue = expect != nullptr && mg_vcasecmp(expect, "100-continue") == 0;
+        hm.body.len = 0;
+        auto req = http_request::from_hm(&hm);
+        std::string rest(io.buf + at + head, io.len - at - head);
+        io.len = at;
+
+        u->seq = c->dispatch_seq = c->next_seq++;
+        if (_route_metrics_enabled) {
+            c->r->begin_timing(c, u->seq, head);
+            if (_trace != nullptr) {
+                c->r->begin_trace(c, hm.method, hm.uri, false);
+            }
+            note_route(c, _stream_http_router, callback);
+        }
+        u->proto = nc->proto_handler;
+        u->recv_limit = nc->recv_mbuf_limit;
+        c->upload = u;
+        c->reading_since = 0;
+        /* mongoose's parser stays out of the way until end_upload */
+        nc->proto_handler = nullptr;
+        c->answer_later = false;
+        c->r->write_for(c, u->seq, [&](mg_connection * nc) {
+            if (refuse != 0) {
+                std::string out;
+                http_headers hs{ { "Connection", "close" } };
+                auto reason = status_reason(refuse);
+                http_context::format_response(out, refuse, &hs, reason, strlen(reason));
+                mg_send(nc, out.data(), (int)out.size());
+                nc->flags |= MG_F_SEND_AND_CLOSE;
+                return;
             }
+            std::shared_ptr<void> slot;
+            if (!admissible(c, req.method, req.target.path(), slot)) {
+                return shed(nc);
+            }
+            if (_on_api != nullptr) {
+                _on_api(conn_type_http, req.method, req.target.str(), std::string());
+            }
+            http_context ctx(nc, &req, nullptr);
+            ctx.set_server(this);
+            ctx.set_admission(slot);
+            (*callback)(&ctx, &p);
+            if (u->ctx == nullptr) {
+                /* refused, the body is not read; a detached answer closes once it is finished */
+                if (!c->answer_later) {
+                    nc->flags |= MG_F_SEND_AND_CLOSE;
+                }
+            } else if (expect_continue && rest.empty() && !u->body.done()) {
+                static const char go_on[] = "HTTP/1.1 100 Continue\r\n\r\n";
+                mg_send(nc, go_on, sizeof(go_on) - 1);
+            }
+        });
+        if (!c->answer_later) {
+            c->r->finish_response(c, u->seq);
+        }
+        if (u->ctx != nullptr) {
+            size_t used = feed_upload(c, rest.data(), rest.size());
+            u->rest.assign(rest, used, std::string::npos);
+        }
+        return true;
+    }
+
+    /* body bytes arriving while an upload has the connection */
+    void recv_upload(conn_t * c)
+    {
+        auto & io = c->nc->recv_mbuf;
+        if (c->upload->ctx == nullptr) {
+            /* refused, the connection closes once the response is out */
+            io.len = 0;
+            return;
+        }
+        mbuf_remove(&io, feed_upload(c, io.buf, io.len));
+    }
+
+    /* decodes what belongs to the body, returns the bytes used */
+    size_t feed_upload(conn_t * c, const char * p, size_t n)
+    {
+        auto nc = c->nc;
+        auto u = c->upload;
+        size_t used = u->body.feed(p, n, u->pending);
+        if (!c->timings.empty()) {
+            auto t = c->r->timing_of(c, u->seq);
+            if (t != nullptr) {
+                t->bytes_in += used;
+            }
+        }
+        if (u->body.failed()) {
+            /* like mongoose does with a request it cannot parse */
+            nc->flags |= MG_F_CLOSE_IMMEDIATELY;
+            return n;
+        }
+        if (u->body.done() || u->pending.size() >= _body_stream.window) {
+            /* the next request is only parsed after end_upload */
+            nc->recv_mbuf_limit = 0;
+        }
+        pump_upload(c);
+        return used;
+    }
+
+    /* hands what is pending to on_data, or on_end once the body is complete; one at a time */
+    void pump_upload(conn_t * c)
+    {
+        auto u = c->upload;
+        bool last = u->body.done();
+        if (u->busy || u->ended || (u->pending.empty() && !last)) {
+            return;
+        }
+        auto piece = std::make_shared<std::string>();
+        piece->swap(u->pending);
+        u->busy = true;
+        u->ended = last;
+        if (!last) {
+            c->nc->recv_mbuf_limit = u->recv_limit;
+        }
+        auto r = c->r;
+        auto id = c->id;
+        _workers->post([this, r, id, u, piece, last]() {
+            if (!piece->empty()) {
+                u->on_data(piece->data(), piece->size());
+            }
+            if (last) {
+                u->on_end(u->ctx.get(), true);
+            }
+            r->post([this, r, id, u]() {
+                u->busy = false;
+                auto i = r->conns.find(id);
+                if (i == r->conns.end() || i->second->upload != u) {
+                    return abandon_upload(u);
+                }
+                if (u->ended) {
+                    r->uploads_over.push_back(id);
+                } else {
+                    pump_upload(i->second);
+                }
+                r->settle_iov(i->second);
+            });
+        });
+    }
+
+    /*
+     * The body has been handed over, mongoose parses whatever came after it.
+     * Runs between polls: inside a callback mongoose may be using the
+     * connection's proto_data, or the reactor running its tasks.
+     */
+    void end_upload(conn_t * c)
+    {
+        auto nc = c->nc;
+        auto u = c->upload;
+        c->upload.reset();
+        nc->proto_handler = u->proto;
+        nc->recv_mbuf_limit = u->recv_limit;
+        if (nc->proto_data != nullptr) {
+            /* its byte count went stale while it did not see the body */
+            nc->proto_data_destructor(nc->proto_data);
+            nc->proto_data = nullptr;
+        }
+        auto & io = nc->recv_mbuf;
+        if (!u->rest.empty()) {
+            mbuf_insert(&io, 0, u->rest.data(), u->rest.size());
+        }
+        if (io.len > 0 && !(nc->flags & MG_F_CLOSE_IMMEDIATELY)) {
+            int n = (int)io.len;
+            nc->proto_handler(nc, MG_EV_RECV, &n);
+        }
+    }
+
+    /* the connection went away before on_end was handed over */
+    void abandon_upload(std::shared_ptr<upload_t> u)
+    {
+        if (u->busy || u->ended || u->ctx == nullptr) {
             return;
         }
+        u->ended = true;
+        _workers->post([u]() {
+            u->on_end(u->ctx.get(), false);
+        });
+    }
+
+    /*
+     * Switches to HTTP/2 for "Upgrade: h2c", once every earlier request on
+     * the connection is answered; the request is then answered on stream 1.
+     * False leaves it to HTTP/1.1.
+     */
+    bool upgrade_h2(conn_t * c, struct http_message * hm)
+    {
+        auto nc = c->nc;
+        auto upgrade = mg_get_http_header(hm, "Upgrade");
+        auto settings = mg_get_http_header(hm, "HTTP2-Settings");
+        if (upgrade == nullptr || settings == nullptr || mg_vcasecmp(upgrade, "h2c") != 0) {
+            return false;
+        }
+        if (c->resp_seq != c->next_seq || !c->iov.empty() || !c->held.empty() || c->in_flight > 0) {
+            return false;
+        }
+        std::string payload;
+        if (!h2_session::decode_settings(to_string_view(*settings), payload)) {
+            return false;
+        }
         auto req = http_request::from_hm(hm);
+        req.headers.erase("Upgrade");
+        req.headers.erase("HTTP2-Settings");
+        req.headers.erase("Connection");
+        static const char switching[] = "HTTP/1.1 101 Switching Protocols\r\nConnection: Upgrade\r\nUpgrade: h2c\r\n\r\n";
+        mg_send(nc, switching, sizeof(switching) - 1);
+        start_h2(c);
+        bool ok = c->h2->upgrade(payload, req);
+        /* whatever followed the request is HTTP/2 already, mongoose must not parse it */
+        auto & io = nc->recv_mbuf;
+        size_t end = hm->message.p - io.buf + hm->message.len;
+        std::string rest(io.buf + end, io.len - end);
+        io.len = end;
+        if (!ok) {
+            /* the session wrote its GOAWAY, stream 1 is not answered */
+            nc->flags |= MG_F_SEND_AND_CLOSE;
+            return true;
+        }
+        handle_h2_request(c, 1, req);
+        if (!rest.empty() && !c->h2->feed(rest.data(), rest.size())) {
+            nc->flags |= MG_F_SEND_AND_CLOSE;
+        }
+        return true;
+    }
+
+    /*
+     * Frames are small and interleaved, they go out without waiting for
+     * ACKs. DATA payloads take the writev path, mongoose would write them
+     * from send_mbuf one segment per poll.
+     */
+    void start_h2(conn_t * c)
+    {
+        auto nc = c->nc;
+        c->h2.reset(new h2_session(*_h2, [c](const char * data, size_t len) {
+            if (len < 4096) {
+                mg_send(c->nc, data, (int)len);
+                return;
+            }
+            c->r->queue_iov(c, std::string(data, len), std::vector<iov_buf>(), nullptr);
+        }, [this, c](uint32_t stream, http_request & req) {
+            handle_h2_request(c, stream, req);
+        }, [c]() {
+            return c->nc->send_mbuf.len + c->iov_bytes;
+        }));
+        /* raw events from now on, mongoose's http parser is out of the way */
+        nc->proto_handler = nullptr;
+        c->reading_since = 0;
+        int on = 1;
+        setsockopt(nc->sock, IPPROTO_TCP, TCP_NODELAY, (const char *)&on, sizeof(on));
+        c->h2->start();
+    }
+
+    /* a connection opening with the HTTP/2 preface switches right away, later reads go to its session */
+    void recv_h2(conn_t * c)
+    {
+        auto nc = c->nc;
+        auto & io = nc->recv_mbuf;
+        if (c->h2 == nullptr) {
+            if (c->next_seq > 0 || is_websocket(nc) || io.len < 4 ||
+                memcmp(io.buf, h2_session::preface, std::min(io.len, h2_session::preface_len)) != 0) {
+                return;
+            }
+            start_h2(c);
+        }
+        bool ok = c->h2->feed(io.buf, io.len);
+        mbuf_remove(&io, io.len);
+        if (!ok) {
+            nc->flags |= MG_F_SEND_AND_CLOSE;
+        }
+    }
+
+    /*
+     * Routes a complete HTTP/2 request like dispatch_http does an HTTP/1
+     * one. A plain handler that neither answers nor detaches gets its stream
+     * reset.
+     */
+    void handle_h2_request(conn_t * c, uint32_t stream, http_request & req)
+    {
+        auto nc = c->nc;
+        auto & path = req.target.path();
+        if (!_metrics_path.empty() && path == _metrics_path && req.method == "GET") {
+            http_context ctx(nc, &req, nullptr);
+            ctx.set_server(this);
+            ctx.set_stream(stream);
+            return scrape(ctx.detach());
+        }
+        std::shared_ptr<void> slot;
+        if (!admissible(c, req.method, path, slot)) {
+            _shed++;
+            http_headers hs{ { "Retry-After", std::to_string(_admission.retry_after) } };
+            c->h2->respond(stream, 503, &hs, "", 0);
+            return;
+        }
         if (_on_api != nullptr) {
             _on_api(conn_type_http, req.method, req.target.str(), req.body);
         }
         routing::params p;
-        _http_router->route(routing::concat_method_path(req.method, req.target.path()), &p,
-            [&](bool path_found, routing::params * p,  function<void(http_context *, routing::params *)> callback) {
+        http_context ctx(nc, &req, nullptr);
+        ctx.set_server(this);
+        ctx.set_admission(slot);
+        ctx.set_stream(stream);
+        auto streamed = _stream_http_router == nullptr ? nullptr : _stream_http_router->find(req.method, path, &p);
+        auto async = streamed != nullptr || _async_http_router == nullptr ? nullptr : _async_http_router->find(req.method, path, &p);
+        if (async != nullptr) {
+            auto actx = ctx.detach();
+            auto fn = *async;
+            _workers->post([actx, p, fn]() mutable {
+                fn(actx.get(), &p);
+            });
+            return;
+        }
+#ifdef BOO_NETWORK_HAS_COROUTINE
+        auto coro = streamed != nullptr || _coro_http_router == nullptr ? nullptr : _coro_http_router->find(req.method, path, &p);
+        if (coro != nullptr) {
+            run_coro_http(ctx.detach(), std::move(p), *coro);
+            return;
+        }
+#endif
+        auto router = c->r->http_router;
+        auto callback = streamed != nullptr ? streamed : router == nullptr ? nullptr : router->find(req.method, path, &p);
+        if (callback == nullptr || *callback == nullptr) {
+            c->h2->respond(stream, 404, nullptr, "not found", 9);
+            return;
+        }
+        c->answer_later = false;
+        (*callback)(&ctx, &p);
+        if (!c->answer_later) {
+            c->h2->abandon(stream);
+        }
+    }
 
-            http_context ctx(nc, &req, hm);
+    void handle_http_api(struct mg_connection * nc, struct http_message * hm, bool is_websocket = false)
+    {
+        if (!is_websocket && !_metrics_path.empty() && mg_vcmp(&hm->uri, _metrics_path.c_str()) == 0 && mg_vcmp(&hm->method, "GET") == 0) {
+            note_route(conn_of(nc), _metrics_route.c_str());
+            http_context ctx(nc, nullptr, hm);
             ctx.set_server(this);
-            ctx.set_websocket_handshake_done(is_websocket);
-            if (path_found && callback != nullptr) {
-                callback(&ctx, p);
-                return;
+            return scrape(ctx.detach());
+        }
+        if (!_http_api_enabled) {
+            if (_webroot_enabled) {
+                handle_webroot(nc, hm);
             }
-            if (_webroot_enabled && req.method == "GET") {
+            return;
+        }
+        std::shared_ptr<void> slot;
+        if (!is_websocket && !admit(nc, hm, slot)) {
+            return;
+        }
+        if (_on_api != nullptr) {
+            auto req = http_request::from_hm(hm);
+            _on_api(conn_type_http, req.method, req.target.str(), req.body);
+        }
+        http_context::capture_t capture;
+        if (!is_websocket && _route_cache_enabled && send_cached_response(nc, hm, slot, capture)) {
+            return;
+        }
+        if (!is_websocket && handle_async_http_api(nc, hm, slot, capture)) {
+            return;
+        }
+#ifdef BOO_NETWORK_HAS_COROUTINE
+        if (!is_websocket && handle_coro_http_api(nc, hm, slot, capture)) {
+            return;
+        }
+#endif
+        http_request_view view(hm);
+        auto router = reactor_of(nc)->http_router;
+        routing::params p;
+        auto callback = router == nullptr ? nullptr : router->find(view.method, view.path, &p);
+        if (callback == nullptr || *callback == nullptr) {
+            if (_webroot_enabled && (view.method == "GET" || view.method == "HEAD")) {
                 return handle_webroot(nc, hm);
             }
-            mg_http_send_error(nc, 404, "not found");
-        });
+            return mg_http_send_error(nc, 404, "not found");
+        }
+        if (!is_websocket) {
+            note_route(conn_of(nc), router, callback);
+        }
+        http_context ctx(nc, nullptr, hm);
+        ctx.set_server(this);
+        ctx.set_admission(slot);
+        ctx.set_capture(std::move(capture));
+        ctx.set_websocket_handshake_done(is_websocket);
+        (*callback)(&ctx, &p);
     };
+
+    /*
+     * Runs each on every reactor thread with that reactor's part, then done
+     * with all parts on the worker pool once the last one finished. No
+     * reactor waits, nor does the work of done.
+     */
+    template<class T>
+    void gather(std::function<void(reactor * r, T & part)> each, std::function<void(std::vector<T> & parts)> done)
+    {
+        struct state_t {
+            std::vector<T> parts;
+            std::atomic<size_t> left{0};
+        };
+        auto st = std::make_shared<state_t>();
+        st->parts.resize(_reactors.size());
+        st->left = _reactors.size();
+        for (auto & r : _reactors) {
+            auto p = r.get();
+            p->post([this, p, st, each, done]() {
+                each(p, st->parts[p->index]);
+                if (--st->left == 0) {
+                    _workers->post([st, done]() {
+                        /* nothing may escape into the pool's thread */
+                        try {
+                            done(st->parts);
+                        } catch (...) {
+                        }
+                    });
+                }
+            });
+        }
+    }
+
+    void scrape(std::shared_ptr<http_context> ctx)
+    {
+        gather<reactor_gauges>([](reactor * r, reactor_gauges & g) {
+            r->gauges(g);
+        }, [this, ctx](std::vector<reactor_gauges> & gauges) {
+            send_metrics(*ctx, gauges);
+        });
+    }
+
+    void send_metrics(http_context & ctx, const std::vector<reactor_gauges> & gauges)
+    {
+        std::lock_guard<std::mutex> locker(_metrics_m);
+        _metrics_buf.clear();
+        prometheus_text out(_metrics_buf);
+        std::string labels;
+        auto per_reactor = [&labels](size_t index, const char * name = nullptr, const char * value = nullptr) -> const std::string & {
+            labels.clear();
+            prometheus_text::label(labels, "reactor", std::to_string(index));
+            if (name != nullptr) {
+                prometheus_text::label(labels, name, value);
+            }
+            return labels;
+        };
+        out.family("boo_connections", "gauge", "Open connections by kind.");
+        for (size_t i = 0; i < gauges.size(); ++i) {
+            out.sample("boo_connections", per_reactor(i, "kind", "http"), gauges[i].http_conns);
+            out.sample("boo_connections", per_reactor(i, "kind", "ws"), gauges[i].ws_conns);
+        }
+        out.family("boo_send_queue_messages", "gauge", "Messages waiting in the reactor send queue.");
+        for (size_t i = 0; i < gauges.size(); ++i) {
+            out.sample("boo_send_queue_messages", per_reactor(i), gauges[i].send_queue);
+        }
+        out.family("boo_streams_in_flight", "gauge", "Streamed responses not over yet.");
+        for (size_t i = 0; i < gauges.size(); ++i) {
+            out.sample("boo_streams_in_flight", per_reactor(i), gauges[i].streams);
+        }
+        out.family("boo_mbuf_bytes", "gauge", "Bytes in the connection buffers.");
+        for (size_t i = 0; i < gauges.size(); ++i) {
+            out.sample("boo_mbuf_bytes", per_reactor(i, "dir", "send"), gauges[i].send_mbuf);
+            out.sample("boo_mbuf_bytes", per_reactor(i, "dir", "recv"), gauges[i].recv_mbuf);
+        }
+        out.family("boo_loop_iteration_seconds", "histogram", "Time of a reactor loop iteration, waiting for events included.");
+        for (auto & r : _reactors) {
+            std::fill(_metrics_counts.begin(), _metrics_counts.end(), 0);
+            r->poll_time.add_to(_metrics_counts.data());
+            out.histogram("boo_loop_iteration_seconds", per_reactor(r->index), _metrics_counts.data(),
+                r->poll_sum_us.load(std::memory_order_relaxed));
+        }
+
+        /* the routes seen before keep their place, only new ones allocate */
+        for (auto & s : _metrics_routes) {
+            auto route = std::move(s.route);
+            auto latency = std::move(s.latency);
+            s = route_snapshot();
+            s.route = std::move(route);
+            s.latency = std::move(latency);
+            std::fill(s.latency.begin(), s.latency.end(), 0);
+        }
+        for (auto & r : _reactors) {
+            r->metrics.snapshot(_metrics_routes);
+        }
+        std::sort(_metrics_routes.begin(), _metrics_routes.end(), [](const route_snapshot & a, const route_snapshot & b) {
+            return a.route < b.route;
+        });
+        static const char * classes[] = { "unknown", "1xx", "2xx", "3xx", "4xx", "5xx" };
+        out.family("boo_http_requests_total", "counter", "HTTP/1 requests by route and status class.");
+        for (auto & s : _metrics_routes) {
+            for (size_t k = 0; k < 6; ++k) {
+                if (s.status[k] == 0) {
+                    continue;
+                }
+                labels.clear();
+                prometheus_text::label(labels, "route", s.route);
+                prometheus_text::label(labels, "code", classes[k]);
+                out.sample("boo_http_requests_total", labels, s.status[k]);
+            }
+        }
+        out.family("boo_http_bytes_total", "counter", "HTTP/1 request and response bytes by route.");
+        for (auto & s : _metrics_routes) {
+            labels.clear();
+            prometheus_text::label(labels, "route", s.route);
+            prometheus_text::label(labels, "dir", "in");
+            out.sample("boo_http_bytes_total", labels, s.bytes_in);
+            labels.clear();
+            prometheus_text::label(labels, "route", s.route);
+            prometheus_text::label(labels, "dir", "out");
+            out.sample("boo_http_bytes_total", labels, s.bytes_out);
+        }
+        out.family("boo_http_request_duration_seconds", "histogram", "From the request being read to the last byte of its response being written.");
+        for (auto & s : _metrics_routes) {
+            labels.clear();
+            prometheus_text::label(labels, "route", s.route);
+            out.histogram("boo_http_request_duration_seconds", labels, s.latency.data(), s.latency_sum_us);
+        }
+        http_headers hs{ { "Content-Type", "text/plain; version=0.0.4; charset=utf-8" } };
+        ctx.send(200, _metrics_buf, &hs);
+    }
+
+    /* stamps the first byte and the end of the headers of the request being read */
+    void trace_recv(conn_t * c)
+    {
+        auto nc = c->nc;
+        if (c->upload != nullptr || c->h2 != nullptr || is_websocket(nc)) {
+            return;
+        }
+        if (c->trace_next == 0) {
+            c->r->sample_next(c);
+        }
+        if (c->trace_next == 1 && c->headers_ns == 0) {
+            std::string_view io(nc->recv_mbuf.buf, nc->recv_mbuf.len);
+            if (io.find("\r\n\r\n") != std::string_view::npos) {
+                c->headers_ns = reactor::now_ns();
+            }
+        }
+    }
+
+    /* the request being dispatched on c counts for the route of cb, which router found */
+    template<class callback_t>
+    void note_route(conn_t * c, routing::router<callback_t> * router, const callback_t * cb)
+    {
+        if (c->timings.empty() || c->timings.back().seq != c->dispatch_seq) {
+            return;
+        }
+        auto & m = c->r->metrics;
+        auto stats = m.find(cb);
+        if (stats == nullptr) {
+            stats = m.add(cb, router->pattern(cb));
+        }
+        c->timings.back().route = stats;
+        if (c->timings.back().trace != nullptr) {
+            c->timings.back().trace->at[trace_routed] = reactor::now_ns();
+        }
+    }
+
+    /* a route not in a router, key is the name's address */
+    void note_route(conn_t * c, const char * name)
+    {
+        if (c->timings.empty() || c->timings.back().seq != c->dispatch_seq) {
+            return;
+        }
+        auto & m = c->r->metrics;
+        auto stats = m.find(name);
+        if (stats == nullptr) {
+            stats = m.add(name, name);
+        }
+        c->timings.back().route = stats;
+        if (c->timings.back().trace != nullptr) {
+            c->timings.back().trace->at[trace_routed] = reactor::now_ns();
+        }
+    }
     
+    /*
+     * Answers from the response cache when the route is cached and the entry
+     * is fresh, or parks the request behind a running handler for the same
+     * key when the route coalesces. Otherwise capture is set up to store and
+     * share what the handler sends.
+     */
+    bool send_cached_response(struct mg_connection * nc, struct http_message * hm, std::shared_ptr<void> slot,
+        http_context::capture_t & capture)
+    {
+        http_request_view req(hm);
+        if (req.method != "GET") {
+            return false;
+        }
+        routing::params p;
+        auto found = _cached_routes.find(req.method, req.path, &p);
+        if (found == nullptr) {
+            return false;
+        }
+        note_route(conn_of(nc), &_cached_routes, found);
+        auto & opts = **found;
+        thread_local std::string key;
+        response_cache::make_key(req, opts.vary, key);
+        auto now = reactor::now_ms();
+        auto hit = opts.ttl.count() > 0 ? _response_cache.get(key, now) : nullptr;
+        if (hit != nullptr) {
+            auto c = conn_of(nc);
+            iov_out o;
+            o.bufs.push_back(iov_buf{ hit->data(), hit->size() });
+            o.done = [hit](bool) {};
+            c->r->respond(c, c->dispatch_seq, std::move(o));
+            return true;
+        }
+        std::shared_ptr<flight> f;
+        if (opts.coalesce && !personal(hm, opts.vary)) {
+            std::lock_guard<std::mutex> locker(_flights_m);
+            auto i = _flights.find(key);
+            if (i != _flights.end()) {
+                http_context ctx(nc, nullptr, hm);
+                ctx.set_server(this);
+                ctx.set_admission(slot);
+                i->second->waiters.push_back(ctx.detach());
+                return true;
+            }
+            f = std::make_shared<flight>(this, key);
+            _flights[key] = f.get();
+        }
+        auto expires = opts.ttl.count() > 0 ? now + opts.ttl.count() : 0;
+        capture = [this, k = key, expires, f](int status_code, const http_headers * headers, const std::string & response) {
+            bool shared = status_code == 200 && (headers == nullptr || !headers->has(known_header::set_cookie));
+            if (expires != 0 && shared) {
+                _response_cache.put(k, std::string(response), expires);
+            }
+            if (f != nullptr) {
+                /* the waiters are other clients, they only get what the cache would have kept */
+                f->finish(shared ? std::make_shared<const std::string>(response) : nullptr);
+            }
+        };
+        return false;
+    }
+
+    /* carries credentials that are not part of the key, its response may be meant for it alone */
+    static bool personal(struct http_message * hm, const std::vector<std::string> & vary)
+    {
+        static const char * credentials[] = { "Cookie", "Authorization" };
+        for (auto name : credentials) {
+            if (mg_get_http_header(hm, name) == nullptr) {
+                continue;
+            }
+            bool keyed = std::any_of(vary.begin(), vary.end(), [name](const std::string & h) {
+                return http_headers::iequals(h, name);
+            });
+            if (!keyed) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /* files go out with sendfile where possible, everything else through mg_serve_http */
     void handle_webroot(struct mg_connection * nc, struct http_message * p)
     {
+        note_route(conn_of(nc), "webroot");
+#ifdef __linux__
+        known_etag known;
+        if (_assets != nullptr && send_cached(conn_of(nc), p, known)) {
+            return;
+        }
+        static_reply reply;
+        if (static_files::resolve(*_webroot_opts, p, reply, known.etag.empty() ? nullptr : &known)) {
+            return send_static(conn_of(nc), reply);
+        }
+#endif
         mg_serve_http(nc, (struct http_message *) p, *_webroot_opts);
     }
 
+    /*
+     * False when the request has to take the uncached path, which is given
+     * the cached file's ETag in known so both paths validate alike.
+     */
+    bool send_cached(conn_t * c, struct http_message * hm, known_etag & known)
+    {
+        http_request_view req(hm);
+        bool head = req.method == "HEAD";
+        if (!head && req.method != "GET") {
+            return false;
+        }
+        auto asset = _assets->find(req.path);
+        if (asset == nullptr) {
+            asset = _assets->load(*_webroot_opts, req.path);
+            if (asset == nullptr) {
+                return false;
+            }
+        }
+        if (!req.header("Range").empty() || !static_files::keep_alive(hm)) {
+            known = asset->validator();
+            return false;
+        }
+        auto & v = asset->choose(req.header("Accept-Encoding"));
+        std::vector<iov_buf> bufs;
+        std::string status;
+        if (static_files::not_modified(req, v.etag, asset->mtime)) {
+            status = "HTTP/1.1 304 Not Modified\r\n";
+            bufs.push_back(iov_buf{ v.not_modified.data(), v.not_modified.size() });
+        } else {
+            status = "HTTP/1.1 200 OK\r\n";
+            bufs.push_back(iov_buf{ v.response.data(), head ? v.head_len : v.response.size() });
+        }
+        status += date_header();
+        iov_out o;
+        o.head = std::move(status);
+        o.bufs = std::move(bufs);
+        o.done = [asset](bool) {};
+        c->r->respond(c, c->dispatch_seq, std::move(o));
+        return true;
+    }
+
+    /* "Date: ...\r\n", formatted once a second per thread */
+    static const std::string & date_header()
+    {
+        thread_local time_t at = 0;
+        thread_local std::string line;
+        time_t now = time(nullptr);
+        if (now != at) {
+            at = now;
+            line = "Date: " + static_files::http_date(now) + "\r\n";
+        }
+        return line;
+    }
+
+    void send_static(conn_t * c, static_reply & reply)
+    {
+        iov_out o;
+        http_context::format_head(o.head, reply.status, &reply.headers, reply.length);
+        if (reply.file) {
+            o.file = std::move(reply.file);
+            o.file_off = reply.offset;
+            o.file_len = reply.length;
+        }
+        c->r->respond(c, c->dispatch_seq, std::move(o));
+        if (!reply.keep_alive) {
+            /* the event handler settles it once dispatch_http had a chance to hold it back */
+            c->nc->flags |= MG_F_SEND_AND_CLOSE;
+        }
+    }
+
     void handle_ws_api(struct mg_connection * nc, struct websocket_message * hm)
     {
         if (!_ws_enabled) {
@@ -363,8 +3935,16 @@ public:
         if (_on_api != nullptr) {
             _on_api(conn_type_ws, method_iter->get<std::string>(), id_iter->get<std::string>(), input);
         }
+#ifdef BOO_NETWORK_HAS_COROUTINE
+        if (handle_coro_ws_api(ctx, routing::concat_method_path(method_iter->get<string>(), id_iter->get<string>()), req)) {
+            return;
+        }
+#endif
+        if (reactor_of(nc)->ws_router == nullptr) {
+            return;
+        }
         routing::params p;
-        _ws_router->route(routing::concat_method_path(method_iter->get<string>(), id_iter->get<string>()), &p,
+        reactor_of(nc)->ws_router->route(routing::concat_method_path(method_iter->get<string>(), id_iter->get<string>()), &p,
             [&ctx, &req](bool path_found, routing::params * p, std::function<void(ws_conn *, const json &)> call) {
                 if (path_found && call != nullptr) {
                     call(&ctx, req);
@@ -378,34 +3958,75 @@ public:
         _on_ws_close = on_ws_close;
     }
 
+    void set_ws_backpressure(const ws_backpressure_opts & opts)
+    {
+        _ws_backpressure = opts;
+    }
+
+    /* watermarks for http_context::stream producers, must be called before listen() */
+    void set_stream_opts(const stream_opts & opts)
+    {
+        _stream_opts = opts;
+    }
+
+    /* called on the reactor thread when a ws connection crosses its high or low watermark */
+    void set_on_ws_congestion(std::function<void(const ws_conn &, bool congested)> on_congestion)
+    {
+        _on_ws_congestion = on_congestion;
+    }
+
     void set_on_http_close(std::function<void(http_server * s, mg_connection * nc)> on_http_close)
     {
         _on_http_close = on_http_close;
     }
 
+    /* the reactor does this on every event of a connection with streams, reactor thread only */
     void handle_send_next(struct mg_connection * nc)
     {
-        if (_send_next.find(nc) == _send_next.end()) {
-            return;
-        }
-        auto sender = _send_next[nc];
-        if (!sender->send_complete()) {
-            sender->send(nc);
-            return;
-        } 
-        sender->send_ok(nc);
-        sender->close();
-        delete sender;
-        _send_next.erase(nc);
+        auto c = conn_of(nc);
+        c->r->pump_streams(c);
     }
 
     static void mongoose_http_ev_handler(struct mg_connection *nc, int ev, void *ev_data)
     {
-        auto s = (http_server*)(nc->user_data);
-        s->handle_send_next(nc);
+        auto r = reactor_of(nc);
+        auto s = r->server;
+        if (ev == MG_EV_ACCEPT) {
+            s->on_accept(r->add_conn(nc));
+        }
+        if (ev == MG_EV_SEND) {
+            /* account for what went out before a stream below queues more iov */
+            auto c = conn_of(nc);
+            int n = *(int *)ev_data;
+            if (n > 0) {
+                c->bytes_out += n;
+            }
+            c->iov_staged -= std::min<size_t>(c->iov_staged, n);
+        }
+        if (conn_of(nc)->timeout != 0) {
+            s->touch(conn_of(nc), ev);
+        }
         switch (ev) {
+            case MG_EV_RECV:
+                if (s->_route_metrics_enabled) {
+                    conn_of(nc)->recv_us = reactor::now_us();
+                }
+                if (s->_trace != nullptr) {
+                    s->trace_recv(conn_of(nc));
+                }
+                if (conn_of(nc)->upload != nullptr) {
+                    s->recv_upload(conn_of(nc));
+                    break;
+                }
+                if (s->_h2 != nullptr) {
+                    s->recv_h2(conn_of(nc));
+                }
+                if (s->_stream_http_router != nullptr) {
+                    s->begin_upload(conn_of(nc), 0);
+                }
+                break;
             case MG_EV_HTTP_REQUEST:
-                s->handle_http_api(nc, (struct http_message *) ev_data);
+                s->dispatch_http(nc, (struct http_message *) ev_data);
                 break;
             case MG_EV_WEBSOCKET_FRAME:
                 s->handle_ws_api(nc, (struct websocket_message *) ev_data);
@@ -413,46 +4034,164 @@ public:
             case MG_EV_WEBSOCKET_HANDSHAKE_DONE:
                 s->handle_http_api(nc, (struct http_message *) ev_data, true);
                 break;
+            case MG_EV_SEND:
+                if (!conn_of(nc)->iov.empty()) {
+                    r->write_iov(conn_of(nc));
+                }
+                r->flush_backlog(conn_of(nc));
+                if (conn_of(nc)->h2 != nullptr) {
+                    conn_of(nc)->h2->resume();
+                }
+                break;
+            case MG_EV_POLL:
+                if (!conn_of(nc)->iov.empty()) {
+                    r->write_iov(conn_of(nc));
+                }
+                if (conn_of(nc)->h2 != nullptr) {
+                    conn_of(nc)->h2->resume();
+                }
+                break;
             case MG_EV_CLOSE:
+                if (conn_of(nc)->upload != nullptr) {
+                    s->abandon_upload(std::move(conn_of(nc)->upload));
+                }
                 if (is_websocket(nc)) {
                     s->on_ws_close(ws_conn{ nc, s });
                 } else {
                     s->on_http_close(nc);
                 }
+                if (conn_of(nc)->accepted) {
+                    s->_conns--;
+                }
+                r->remove_conn(nc);
                 break;
         }
-        s->send();
+        if (ev != MG_EV_CLOSE && !conn_of(nc)->streams.empty()) {
+            r->pump_streams(conn_of(nc));
+        }
+        r->flush();
+        if (ev != MG_EV_CLOSE) {
+            r->settle_iov(conn_of(nc));
+        }
     };
-    
-    void listen(int port)
+
+    /*
+     * With reactors > 1 every reactor binds the port with SO_REUSEPORT and the
+     * kernel spreads accepts across them. reactors == 0 means one per core.
+     * Platforms without SO_REUSEPORT fall back to a single reactor.
+     */
+    void listen(int port, size_t reactors = 1)
     {
-        /* Open listening socket */
-        mg_mgr_init(&_mgr, NULL);
-        char addr[16];
-        sprintf(addr, ":%d", port);
-        auto nc = mg_bind(&_mgr, addr, http_server::mongoose_http_ev_handler);
-        nc->user_data = this;
-        mg_set_protocol_http_websocket(nc);
+        if (reactors == 0) {
+            reactors = std::max(1u, std::thread::hardware_concurrency());
+        }
+#ifndef SO_REUSEPORT
+        reactors = 1;
+#endif
+        for (size_t i = 0; i < reactors; ++i) {
+            auto r = new reactor(this, i, _send_queue_size);
+            r->ws_router = _ws_router;
+            r->http_router = _http_router;
+            if (_trace != nullptr) {
+                r->traces = trace_ring(_trace->ring_size);
+            }
+            _reactors.push_back(std::unique_ptr<reactor>(r));
+            /* Open listening socket */
+            epoll_iface::mgr_init(&r->mgr, NULL, _use_epoll);
+            if (!r->init_wakeup()) {
+                throw "create wakeup socket failed";
+            }
+            auto nc = reactors > 1 ? bind_reuseport(&r->mgr, port) : bind(&r->mgr, port);
+            if (nc == nullptr) {
+                throw "bind port failed";
+            }
+            r->add_conn(nc);
+            r->listener = nc;
+            mg_set_protocol_http_websocket(nc);
+        }
         _listening = true;
     }
 
+    size_t reactors()
+    {
+        return _reactors.size();
+    }
+
+    /*
+     * Reactor 0 runs on the calling thread, the others on their own threads.
+     * Returns once every reactor has stopped.
+     */
     void poll(size_t interval = 10)
     {
         if (!_listening) {
             throw "not listening port";
         }
-        _stoped = false;
-        while (!_stop) {
-            mg_mgr_poll(&_mgr, interval);
+        {
+            std::lock_guard<std::mutex> locker(_state_m);
+            _polling = true;
+            _drained = 0;
+        }
+        for (size_t i = 1; i < _reactors.size(); ++i) {
+            auto r = _reactors[i].get();
+            r->thread = std::thread([r, interval]() {
+                r->run(interval);
+            });
+        }
+        _reactors[0]->run(interval);
+        for (size_t i = 1; i < _reactors.size(); ++i) {
+            if (_reactors[i]->thread.joinable()) {
+                _reactors[i]->thread.join();
+            }
+        }
+        {
+            std::lock_guard<std::mutex> locker(_state_m);
+            _polling = false;
         }
-        mg_mgr_free(&_mgr);
-        _stoped = true;
+        _state_cv.notify_all();
     }
 
     ~http_server()
     {
         _stop = true;
     }
+
+private:
+    static struct mg_connection * bind(mg_mgr * mgr, int port)
+    {
+        char addr[16];
+        sprintf(addr, ":%d", port);
+        return mg_bind(mgr, addr, http_server::mongoose_http_ev_handler);
+    }
+
+    static struct mg_connection * bind_reuseport(mg_mgr * mgr, int port)
+    {
+#ifdef SO_REUSEPORT
+        sock_t sock = socket(AF_INET, SOCK_STREAM, 0);
+        if (sock == INVALID_SOCKET) {
+            return nullptr;
+        }
+        int on = 1;
+        union socket_address sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sin.sin_family = AF_INET;
+        sa.sin.sin_port = htons((uint16_t)port);
+        sa.sin.sin_addr.s_addr = htonl(INADDR_ANY);
+        if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (void *)&on, sizeof(on)) != 0 ||
+            setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, (void *)&on, sizeof(on)) != 0 ||
+            ::bind(sock, &sa.sa, sizeof(sa.sin)) != 0 ||
+            ::listen(sock, SOMAXCONN) != 0) {
+            closesocket(sock);
+            return nullptr;
+        }
+        auto nc = mg_add_sock(mgr, sock, http_server::mongoose_http_ev_handler);
+        if (nc != nullptr) {
+            nc->flags |= MG_F_LISTENING;
+        }
+        return nc;
+#else
+        return bind(mgr, port);
+#endif
+    }
 };
 
 } }
\ No newline at end of file
@@ -0,0 +1,102 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <cstddef>
+#include <utility>
+
+namespace boo { namespace network {
+
+/*
+ * Bounded lock-free multi-producer/single-consumer ring (Vyukov's sequence
+ * per cell scheme). Producers claim a slot with a CAS on the tail and publish
+ * it through the cell sequence, the consumer never blocks them. push() fails
+ * instead of waiting when the ring is full.
+ *
+ * T must be default constructible and move assignable, it never gets copied.
+ */
+template<class T>
+class mpsc_queue {
+    struct cell {
+        std::atomic<size_t> seq;
+        T data;
+    };
+
+    static const size_t cache_line = 64;
+
+    std::unique_ptr<cell[]> _cells;
+    size_t _mask;
+    alignas(cache_line) std::atomic<size_t> _tail{0};
+    alignas(cache_line) std::atomic<size_t> _head{0};
+
+public:
+    explicit mpsc_queue(size_t capacity = 1024)
+    {
+        size_t size = 2;
+        while (size < capacity) {
+            size <<= 1;
+        }
+        _cells.reset(new cell[size]);
+        _mask = size - 1;
+        for (size_t i = 0; i < size; ++i) {
+            _cells[i].seq.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    mpsc_queue(const mpsc_queue &) = delete;
+    mpsc_queue & operator=(const mpsc_queue &) = delete;
+
+    /* safe from any thread, returns false when the ring is full */
+    bool push(T && v)
+    {
+        size_t pos = _tail.load(std::memory_order_relaxed);
+        cell * c;
+        for (;;) {
+            c = &_cells[pos & _mask];
+            size_t seq = c->seq.load(std::memory_order_acquire);
+            intptr_t dif = (intptr_t)seq - (intptr_t)pos;
+            if (dif == 0) {
+                if (_tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (dif < 0) {
+                return false;
+            } else {
+                pos = _tail.load(std::memory_order_relaxed);
+            }
+        }
+        c->data = std::move(v);
+        c->seq.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    /* consumer thread only */
+    bool pop(T & out)
+    {
+        size_t pos = _head.load(std::memory_order_relaxed);
+        cell * c = &_cells[pos & _mask];
+        if (c->seq.load(std::memory_order_acquire) != pos + 1) {
+            return false;
+        }
+        out = std::move(c->data);
+        c->data = T();
+        c->seq.store(pos + _mask + 1, std::memory_order_release);
+        _head.store(pos + 1, std::memory_order_relaxed);
+        return true;
+    }
+
+    /* approximate when read concurrently with push/pop */
+    size_t size() const
+    {
+        size_t tail = _tail.load(std::memory_order_relaxed);
+        size_t head = _head.load(std::memory_order_relaxed);
+        return tail > head ? tail - head : 0;
+    }
+
+    size_t capacity() const
+    {
+        return _mask + 1;
+    }
+};
+
+}}
@@ -0,0 +1,130 @@
+#pragma once
+
+#include <string>
+#include <cstdio>
+#include <cstdint>
+#include <cstddef>
+
+#include "route_metrics.hpp"
+
+namespace boo { namespace network {
+
+/*
+ * Appends samples in the Prometheus text exposition format (version 0.0.4)
+ * to a caller's string, so a buffer that is cleared and reused does not
+ * allocate once it has grown to the usual size. Labels are passed already
+ * joined, as in `route="GET /",code="2xx"`; label() escapes a value.
+ */
+class prometheus_text {
+    std::string & _out;
+
+public:
+    explicit prometheus_text(std::string & out): _out(out) {}
+
+    /* the # HELP and # TYPE lines, once per metric name */
+    void family(const char * name, const char * type, const char * help)
+    {
+        _out.append("# HELP ").append(name).push_back(' ');
+        _out.append(help).push_back('\n');
+        _out.append("# TYPE ").append(name).push_back(' ');
+        _out.append(type).push_back('\n');
+    }
+
+    void sample(const char * name, const std::string & labels, uint64_t value)
+    {
+        char buf[24];
+        int n = snprintf(buf, sizeof(buf), "%llu", (unsigned long long)value);
+        line(name, "", labels, buf, n);
+    }
+
+    void sample_seconds(const char * name, const char * suffix, const std::string & labels, uint64_t us)
+    {
+        char buf[32];
+        int n = snprintf(buf, sizeof(buf), "%llu.%06llu", (unsigned long long)(us / 1000000), (unsigned long long)(us % 1000000));
+        line(name, suffix, labels, buf, n);
+    }
+
+    /*
+     * A histogram in seconds out of latency_histogram bucket counts. The
+     * le bounds are fixed; a latency_histogram bucket counts under the
+     * first bound none of its values exceed, so a bucket straddling a bound
+     * goes to the next one.
+     */
+    void histogram(const char * name, const std::string & labels, const uint64_t * counts, uint64_t sum_us)
+    {
+        static const struct { uint64_t us; const char * le; } bounds[] = {
+            { 100, "0.0001" }, { 250, "0.00025" }, { 500, "0.0005" },
+            { 1000, "0.001" }, { 2500, "0.0025" }, { 5000, "0.005" },
+            { 10000, "0.01" }, { 25000, "0.025" }, { 50000, "0.05" },
+            { 100000, "0.1" }, { 250000, "0.25" }, { 500000, "0.5" },
+            { 1000000, "1" }, { 2500000, "2.5" }, { 5000000, "5" }, { 10000000, "10" },
+        };
+        std::string with_le = labels;
+        if (!with_le.empty()) {
+            with_le.push_back(',');
+        }
+        size_t prefix = with_le.size();
+        uint64_t seen = 0;
+        size_t i = 0;
+        for (auto & b : bounds) {
+            for (; i < latency_histogram::bucket_count && latency_histogram::highest_of(i) <= b.us; ++i) {
+                seen += counts[i];
+            }
+            with_le.resize(prefix);
+            with_le.append("le=\"").append(b.le).push_back('"');
+            bucket(name, with_le, seen);
+        }
+        for (; i < latency_histogram::bucket_count; ++i) {
+            seen += counts[i];
+        }
+        with_le.resize(prefix);
+        with_le.append("le=\"+Inf\"");
+        bucket(name, with_le, seen);
+        sample_seconds(name, "_sum", labels, sum_us);
+        char buf[24];
+        int n = snprintf(buf, sizeof(buf), "%llu", (unsigned long long)seen);
+        line(name, "_count", labels, buf, n);
+    }
+
+    /* name="value" with \, " and newlines escaped */
+    static void label(std::string & labels, const char * name, const std::string & value)
+    {
+        if (!labels.empty()) {
+            labels.push_back(',');
+        }
+        labels.append(name).append("=\"");
+        for (auto ch : value) {
+            if (ch == '\\' || ch == '"') {
+                labels.push_back('\\');
+                labels.push_back(ch);
+            } else if (ch == '\n') {
+                labels.append("\\n");
+            } else {
+                labels.push_back(ch);
+            }
+        }
+        labels.push_back('"');
+    }
+
+private:
+    void bucket(const char * name, const std::string & labels, uint64_t count)
+    {
+        char buf[24];
+        int n = snprintf(buf, sizeof(buf), "%llu", (unsigned long long)count);
+        line(name, "_bucket", labels, buf, n);
+    }
+
+    void line(const char * name, const char * suffix, const std::string & labels, const char * value, int len)
+    {
+        _out.append(name).append(suffix);
+        if (!labels.empty()) {
+            _out.push_back('{');
+            _out.append(labels).push_back('}');
+        }
+        _out.push_back(' ');
+        _out.append(value, (size_t)len);
+        _out.push_back('\n');
+    }
+};
+
+}}
@@ -0,0 +1,187 @@
+#pragma once
+
+#include "http_message.hpp"
+#include <string>
+#include <string_view>
+#include <vector>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <algorithm>
+#include <unordered_map>
+#include <chrono>
+#include <cstdint>
+
+namespace boo { namespace network {
+
+struct route_cache_opts {
+    /* 0 stores nothing, which together with coalesce only merges concurrent requests */
+    std::chrono::milliseconds ttl{ 1000 };
+    /* request headers that take part in the key, e.g. "Accept-Language" */
+    std::vector<std::string> vary;
+    /*
+     * While the handler runs for a key, identical requests wait for its
+     * response instead of calling it again.
+     */
+    bool coalesce = false;
+};
+
+/*
+ * Serialized responses keyed by request, with a TTL per entry and LRU
+ * eviction once max_bytes is exceeded. Thread safe.
+ */
+class response_cache {
+public:
+    typedef std::shared_ptr<const std::string> response_ptr;
+
+private:
+    struct entry {
+        std::string key;
+        response_ptr response;
+        uint64_t expires;
+    };
+
+    size_t _max_bytes;
+    size_t _bytes = 0;
+    /* most recently used first */
+    std::list<entry> _lru;
+    std::unordered_map<std::string_view, std::list<entry>::iterator> _index;
+    std::mutex _m;
+    uint64_t _hits = 0;
+    uint64_t _misses = 0;
+
+public:
+    explicit response_cache(size_t max_bytes = 16 * 1024 * 1024): _max_bytes(max_bytes) {}
+
+    response_cache(const response_cache &) = delete;
+    response_cache & operator=(const response_cache &) = delete;
+
+    /*
+     * Path, query pairs in sorted order and the vary headers, so that
+     * /a?x=1&y=2 and /a?y=2&x=1 share an entry.
+     */
+    static void make_key(const http_request_view & req, const std::vector<std::string> & vary, std::string & key)
+    {
+        key.assign(req.path.data(), req.path.size());
+        if (!req.query.empty()) {
+            std::string_view pairs[32];
+            size_t n = 0;
+            std::string_view rest = req.query;
+            while (!rest.empty() && n < 32) {
+                auto amp = rest.find('&');
+                auto pair = rest.substr(0, amp);
+                rest = amp == std::string_view::npos ? std::string_view() : rest.substr(amp + 1);
+                if (!pair.empty()) {
+                    pairs[n++] = pair;
+                }
+            }
+            std::sort(pairs, pairs + n);
+            char sep = '?';
+            for (size_t i = 0; i < n; ++i) {
+                key.push_back(sep);
+                key.append(pairs[i].data(), pairs[i].size());
+                sep = '&';
+            }
+            if (!rest.empty()) {
+                /* too many to sort, keep the tail as it came */
+                key.push_back(sep);
+                key.append(rest.data(), rest.size());
+            }
+        }
+        for (auto & h : vary) {
+            key.push_back('\n');
+            auto v = req.header(h);
+            key.append(v.data(), v.size());
+        }
+    }
+
+    response_ptr get(const std::string & key, uint64_t now)
+    {
+        std::lock_guard<std::mutex> locker(_m);
+        auto i = _index.find(key);
+        if (i == _index.end()) {
+            _misses++;
+            return nullptr;
+        }
+        auto e = i->second;
+        if (e->expires <= now) {
+            _misses++;
+            erase(e);
+            return nullptr;
+        }
+        _hits++;
+        _lru.splice(_lru.begin(), _lru, e);
+        return e->response;
+    }
+
+    void put(const std::string & key, std::string && response, uint64_t expires)
+    {
+        size_t size = key.size() + response.size();
+        if (size > _max_bytes) {
+            return;
+        }
+        auto r = std::make_shared<const std::string>(std::move(response));
+        std::lock_guard<std::mutex> locker(_m);
+        auto i = _index.find(key);
+        if (i != _index.end()) {
+            erase(i->second);
+        }
+        while (_bytes + size > _max_bytes && !_lru.empty()) {
+            erase(std::prev(_lru.end()));
+        }
+        _lru.push_front(entry{ key, std::move(r), expires });
+        _index[_lru.front().key] = _lru.begin();
+        _bytes += size;
+    }
+
+    void clear()
+    {
+        std::lock_guard<std::mutex> locker(_m);
+        _index.clear();
+        _lru.clear();
+        _bytes = 0;
+    }
+
+    void set_max_bytes(size_t max_bytes)
+    {
+        std::lock_guard<std::mutex> locker(_m);
+        _max_bytes = max_bytes;
+        while (_bytes > _max_bytes && !_lru.empty()) {
+            erase(std::prev(_lru.end()));
+        }
+    }
+
+    size_t bytes()
+    {
+        std::lock_guard<std::mutex> locker(_m);
+        return _bytes;
+    }
+
+    size_t size()
+    {
+        std::lock_guard<std::mutex> locker(_m);
+        return _lru.size();
+    }
+
+    uint64_t hits()
+    {
+        std::lock_guard<std::mutex> locker(_m);
+        return _hits;
+    }
+
+    uint64_t misses()
+    {
+        std::lock_guard<std::mutex> locker(_m);
+        return _misses;
+    }
+
+private:
+    void erase(std::list<entry>::iterator e)
+    {
+        _bytes -= e->key.size() + e->response->size();
+        _index.erase(e->key);
+        _lru.erase(e);
+    }
+};
+
+}}
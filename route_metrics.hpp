@@ -0,0 +1,206 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <algorithm>
+#include <unordered_map>
+#include <cstdint>
+#include <cstddef>
+
+namespace boo { namespace network {
+
+/*
+ * Latency in microseconds, bucketed like HdrHistogram: values below
+ * sub_count are counted exactly, every power of two above is split into
+ * sub_count / 2 buckets, so a bucket is within 1/16 of its values. Longer
+ * than max_us lands in the last bucket. One thread records, any thread may
+ * read.
+ */
+class latency_histogram {
+public:
+    static constexpr int sub_bits = 5;
+    static constexpr size_t sub_count = (size_t)1 << sub_bits;
+    /* about 71 minutes */
+    static constexpr int max_bits = 32;
+    static constexpr uint64_t max_us = ((uint64_t)1 << max_bits) - 1;
+    static constexpr size_t bucket_count = sub_count + (max_bits - sub_bits) * (sub_count / 2);
+
+private:
+    std::atomic<uint64_t> _counts[bucket_count];
+
+public:
+    latency_histogram()
+    {
+        for (auto & n : _counts) {
+            n.store(0, std::memory_order_relaxed);
+        }
+    }
+
+    latency_histogram(const latency_histogram &) = delete;
+    latency_histogram & operator=(const latency_histogram &) = delete;
+
+    static size_t index_of(uint64_t us)
+    {
+        if (us < sub_count) {
+            return (size_t)us;
+        }
+        us = std::min(us, max_us);
+        int shift = 63 - __builtin_clzll(us) - sub_bits + 1;
+        return ((size_t)shift << (sub_bits - 1)) + (size_t)(us >> shift);
+    }
+
+    /* the lowest value counted in bucket i */
+    static uint64_t lowest_of(size_t i)
+    {
+        if (i < sub_count) {
+            return i;
+        }
+        int shift = (int)(i >> (sub_bits - 1)) - 1;
+        return (uint64_t)(i - ((size_t)shift << (sub_bits - 1))) << shift;
+    }
+
+    /* the highest value counted in bucket i */
+    static uint64_t highest_of(size_t i)
+    {
+        return i + 1 < bucket_count ? lowest_of(i + 1) - 1 : max_us;
+    }
+
+    /* recording thread only, a plain add is enough with a single writer */
+    void record(uint64_t us)
+    {
+        auto & n = _counts[index_of(us)];
+        n.store(n.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+
+    /* counts must have bucket_count entries */
+    void add_to(uint64_t * counts) const
+    {
+        for (size_t i = 0; i < bucket_count; ++i) {
+            counts[i] += _counts[i].load(std::memory_order_relaxed);
+        }
+    }
+};
+
+/* what a route saw, one writer */
+struct route_stats {
+    /* the pattern, e.g. "GET /users/{id}" */
+    const std::string route;
+    std::atomic<uint64_t> requests{0};
+    /* by status class: [1] is 1xx ... [5] is 5xx, [0] when the status line was not seen */
+    std::atomic<uint64_t> status[6] = {};
+    std::atomic<uint64_t> bytes_in{0};
+    std::atomic<uint64_t> bytes_out{0};
+    std::atomic<uint64_t> latency_sum_us{0};
+    latency_histogram latency;
+
+    explicit route_stats(std::string && r): route(std::move(r)) {}
+
+    void record(int status_code, uint64_t in, uint64_t out, uint64_t us)
+    {
+        size_t cls = status_code >= 100 && status_code < 600 ? (size_t)(status_code / 100) : 0;
+        add(requests, 1);
+        add(status[cls], 1);
+        add(bytes_in, in);
+        add(bytes_out, out);
+        add(latency_sum_us, us);
+        latency.record(us);
+    }
+
+private:
+    static void add(std::atomic<uint64_t> & n, uint64_t v)
+    {
+        n.store(n.load(std::memory_order_relaxed) + v, std::memory_order_relaxed);
+    }
+};
+
+/* a route summed over reactors, see http_server::route_metrics */
+struct route_snapshot {
+    std::string route;
+    uint64_t requests = 0;
+    uint64_t status[6] = {};
+    uint64_t bytes_in = 0;
+    uint64_t bytes_out = 0;
+    uint64_t latency_sum_us = 0;
+    /* per latency_histogram bucket */
+    std::vector<uint64_t> latency;
+
+    /* upper bound in microseconds of the latency below which q (0..1) of the requests fall */
+    uint64_t percentile(double q) const
+    {
+        uint64_t total = 0;
+        for (auto n : latency) {
+            total += n;
+        }
+        if (total == 0) {
+            return 0;
+        }
+        uint64_t want = std::max<uint64_t>(1, (uint64_t)(q * (double)total + 0.5));
+        uint64_t seen = 0;
+        for (size_t i = 0; i < latency.size(); ++i) {
+            seen += latency[i];
+            if (seen >= want) {
+                return latency_histogram::highest_of(i);
+            }
+        }
+        return latency_histogram::max_us;
+    }
+};
+
+/*
+ * The stats of one reactor by route. The reactor looks routes up without a
+ * lock; it only takes the lock to add one, which is what snapshot() holds
+ * off. Keys are the addresses of the routers' callbacks, so the pattern is
+ * only worked out the first time a route is seen.
+ */
+class route_metrics {
+    std::unordered_map<const void *, std::unique_ptr<route_stats>> _routes;
+    std::mutex _m;
+
+public:
+    route_stats * find(const void * key)
+    {
+        auto i = _routes.find(key);
+        return i == _routes.end() ? nullptr : i->second.get();
+    }
+
+    route_stats * add(const void * key, std::string route)
+    {
+        std::lock_guard<std::mutex> locker(_m);
+        auto & e = _routes[key];
+        if (e == nullptr) {
+            e.reset(new route_stats(std::move(route)));
+        }
+        return e.get();
+    }
+
+    /* adds this reactor's numbers to out, by route name */
+    void snapshot(std::vector<route_snapshot> & out)
+    {
+        std::lock_guard<std::mutex> locker(_m);
+        for (auto & i : _routes) {
+            auto & e = *i.second;
+            auto s = std::find_if(out.begin(), out.end(), [&e](const route_snapshot & r) {
+                return r.route == e.route;
+            });
+            if (s == out.end()) {
+                out.emplace_back();
+                s = std::prev(out.end());
+                s->route = e.route;
+                s->latency.assign(latency_histogram::bucket_count, 0);
+            }
+            s->requests += e.requests.load(std::memory_order_relaxed);
+            for (size_t k = 0; k < 6; ++k) {
+                s->status[k] += e.status[k].load(std::memory_order_relaxed);
+            }
+            s->bytes_in += e.bytes_in.load(std::memory_order_relaxed);
+            s->bytes_out += e.bytes_out.load(std::memory_order_relaxed);
+            s->latency_sum_us += e.latency_sum_us.load(std::memory_order_relaxed);
+            e.latency.add_to(s->latency.data());
+        }
+    }
+};
+
+}}
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <string>
+#include <string_view>
 #include <sstream>
 #include <functional>
 #include <memory>
@@ -325,7 +326,103 @@ public:
             r_callback(false, p, nullptr);
         }
     
+        /*
+         * Same matching as route(concat_method_path(method, path)) but walks
+         * the tree over string_views, nothing is allocated unless the route
+         * has parameters. Returns nullptr when no callback matches.
+         */
+        const callback_t * find(std::string_view method, std::string_view path, params * p)
+        {
+            auto n = match(_head.get(), path, method, p);
+            return n == nullptr ? nullptr : &n->callback;
+        }
+
+        /*
+         * The route a callback returned by find() was registered with, as
+         * "GET /users/{id}"; empty when it is not in this router. Walks the
+         * whole tree.
+         */
+        std::string pattern(const callback_t * cb)
+        {
+            vector<node<callback_t> *> trail;
+            if (!find_trail(_head.get(), cb, trail) || trail.empty()) {
+                return std::string();
+            }
+            /* the method is the last segment */
+            std::string out = trail.back()->path + " ";
+            for (size_t i = 0; i + 1 < trail.size(); ++i) {
+                out += trail[i]->is == a_param ? "/{" + trail[i]->path + "}" : "/" + trail[i]->path;
+            }
+            if (trail.size() == 1) {
+                out += "/";
+            }
+            return out;
+        }
+
     private:
+        static bool find_trail(node<callback_t> * n, const callback_t * cb, vector<node<callback_t> *> & trail)
+        {
+            for (auto c = n->left.get(); c != nullptr; c = c->right.get()) {
+                if (c->is == a_callback) {
+                    if (&c->callback == cb) {
+                        return true;
+                    }
+                    continue;
+                }
+                trail.push_back(c);
+                if (find_trail(c, cb, trail)) {
+                    return true;
+                }
+                trail.pop_back();
+            }
+            return false;
+        }
+
+        static std::string_view next_segment(std::string_view & rest)
+        {
+            while (!rest.empty() && rest[0] == '/') {
+                rest.remove_prefix(1);
+            }
+            auto pos = rest.find('/');
+            auto seg = rest.substr(0, pos);
+            rest = pos == std::string_view::npos ? std::string_view() : rest.substr(pos);
+            return seg;
+        }
+
+        node<callback_t> * match(node<callback_t> * n, std::string_view rest, std::string_view method, params * p)
+        {
+            auto seg = next_segment(rest);
+            bool is_method = seg.empty();
+            if (is_method) {
+                seg = method;
+            }
+            for (auto c = n->left.get(); c != nullptr; c = c->right.get()) {
+                if (c->is == a_path && c->path == seg) {
+                    /* matched */
+                } else if (c->is == a_param && !is_method) {
+                    /* matched */
+                } else {
+                    continue;
+                }
+                if (is_method) {
+                    auto cb = c->find_callback_child();
+                    if (cb != nullptr && cb->callback != nullptr) {
+                        return cb.get();
+                    }
+                    continue;
+                }
+                auto found = match(c, rest, method, p);
+                if (found == nullptr) {
+                    continue;
+                }
+                if (c->is == a_param) {
+                    (*p)[c->path] = param(std::string(seg));
+                }
+                return found;
+            }
+            return nullptr;
+        }
+
         vector<shared_ptr<node<callback_t>>> match_path(string req_path, params * p, shared_ptr<node<callback_t>> n = nullptr)
         {
             if (n == nullptr) {
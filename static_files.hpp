@@ -0,0 +1,513 @@
+#pragma once
+
+#include "3rd/mongoose.h"
+#include "http_message.hpp"
+#include "headers.hpp"
+#include <string>
+#include <string_view>
+#include <cstring>
+#include <ctime>
+#include <cstdint>
+
+#ifndef _WIN32
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace boo { namespace network {
+
+/* owns a file descriptor, closes it on destruction */
+class unique_fd {
+    int _fd = -1;
+public:
+    unique_fd() {}
+    explicit unique_fd(int fd): _fd(fd) {}
+    unique_fd(unique_fd && o) noexcept : _fd(o.release()) {}
+    unique_fd(const unique_fd &) = delete;
+
+    unique_fd & operator=(unique_fd && o) noexcept
+    {
+        reset(o.release());
+        return *this;
+    }
+
+    ~unique_fd()
+    {
+        reset();
+    }
+
+    int get() const
+    {
+        return _fd;
+    }
+
+    int release()
+    {
+        int fd = _fd;
+        _fd = -1;
+        return fd;
+    }
+
+    void reset(int fd = -1)
+    {
+#ifndef _WIN32
+        if (_fd >= 0) {
+            ::close(_fd);
+        }
+#endif
+        _fd = fd;
+    }
+
+    explicit operator bool() const
+    {
+        return _fd >= 0;
+    }
+};
+
+/* the answer to a GET or HEAD on a static file */
+struct static_reply {
+    int status = 200;
+    http_headers headers;
+    /* Content-Length */
+    size_t length = 0;
+    /* the part of file to send as body, not set for HEAD, 304 and 416 */
+    unique_fd file;
+    int64_t offset = 0;
+    bool keep_alive = true;
+};
+
+/* an ETag already handed out for a file, valid while the file keeps this mtime and size */
+struct known_etag {
+    std::string etag;
+    time_t mtime = 0;
+    int64_t size = 0;
+};
+
+/*
+ * Plain files below document_root with ETag, Last-Modified, conditional
+ * requests and single byte ranges. Whatever mg_serve_http does beyond that
+ * (directory listing and redirects, auth, CGI, SSI, DAV, rewrites, hidden
+ * files, errors) is left to it: resolve() returns false and the caller falls
+ * back to mg_serve_http.
+ */
+class static_files {
+public:
+    /* known, when given, replaces the mtime.size ETag so that a file has one validator */
+    static bool resolve(const mg_serve_http_opts & opts, m_http_message * hm, static_reply & out,
+        const known_etag * known = nullptr)
+    {
+#ifdef _WIN32
+        return false;
+#else
+        http_request_view req(hm);
+        bool head = req.method == "HEAD";
+        if (!head && req.method != "GET") {
+            return false;
+        }
+        std::string path;
+        struct stat st;
+        if (!locate(opts, req.path, path, st)) {
+            return false;
+        }
+        unique_fd file(::open(path.c_str(), O_RDONLY | O_CLOEXEC));
+        if (!file) {
+            return false;
+        }
+        if (fstat(file.get(), &st) != 0 || !S_ISREG(st.st_mode)) {
+            return false;
+        }
+
+        bool same = known != nullptr && known->mtime == st.st_mtime && known->size == (int64_t)st.st_size;
+        auto etag = same ? known->etag : etag_of(st);
+        auto last_modified = http_date(st.st_mtime);
+        out.keep_alive = keep_alive(hm);
+        out.headers.set(known_header::date, http_date(time(nullptr)));
+        out.headers.set(known_header::last_modified, last_modified);
+        out.headers.set(known_header::etag, etag);
+        if (opts.extra_headers != nullptr && opts.extra_headers[0] != '\0') {
+            add_extra_headers(opts.extra_headers, out.headers);
+        }
+        if (!out.keep_alive) {
+            out.headers.set(known_header::connection, "close");
+        }
+
+        if (not_modified(req, etag, st.st_mtime)) {
+            out.status = 304;
+            return true;
+        }
+
+        int64_t size = st.st_size;
+        int64_t from = 0;
+        int64_t to = size - 1;
+        out.headers.set(known_header::content_type, mime_type(path, opts.custom_mime_types));
+        out.headers.set("Accept-Ranges", "bytes");
+        auto range = req.header("Range");
+        if (!range.empty() && !head && range_applies(req, etag, last_modified)) {
+            switch (parse_range(range, size, from, to)) {
+                case range_none:
+                    break;
+                case range_ok:
+                    out.status = 206;
+                    out.headers.set(known_header::content_range,
+                        "bytes " + std::to_string(from) + "-" + std::to_string(to) + "/" + std::to_string(size));
+                    break;
+                case range_unsatisfiable:
+                    out.status = 416;
+                    out.headers.set(known_header::content_range, "bytes */" + std::to_string(size));
+                    out.length = 0;
+                    return true;
+            }
+        }
+        out.length = (size_t)(to - from + 1);
+        if (!head && out.length > 0) {
+            out.file = std::move(file);
+            out.offset = from;
+        }
+        return true;
+#endif
+    }
+
+#ifndef _WIN32
+    /* the regular file uri maps to, false when it is none or mg_serve_http must handle it */
+    static bool locate(const mg_serve_http_opts & opts, std::string_view uri, std::string & path, struct stat & st)
+    {
+        if (opts.document_root == nullptr || opts.per_directory_auth_file != nullptr || opts.global_auth_file != nullptr
+            || opts.ip_acl != nullptr || opts.dav_document_root != nullptr) {
+            return false;
+        }
+#if MG_ENABLE_HTTP_URL_REWRITES
+        if (opts.url_rewrites != nullptr) {
+            return false;
+        }
+#endif
+        if (!local_path(opts.document_root, uri, path)) {
+            return false;
+        }
+        if (stat(path.c_str(), &st) != 0) {
+            return false;
+        }
+        if (S_ISDIR(st.st_mode)) {
+            if (path.back() != '/' || !find_index(opts, path, st)) {
+                return false;
+            }
+        }
+        return S_ISREG(st.st_mode) && plain_file(opts, path);
+    }
+#endif
+
+    static bool keep_alive(m_http_message * hm)
+    {
+        auto c = mg_get_http_header(hm, "Connection");
+        if (c != nullptr) {
+            auto v = to_string_view(*c);
+            if (http_headers::iequals(v, "close")) {
+                return false;
+            }
+            if (http_headers::iequals(v, "keep-alive")) {
+                return true;
+            }
+        }
+        return to_string_view(hm->proto) == "HTTP/1.1";
+    }
+
+    /* whether an If-None-Match list matches etag, with weak comparison */
+    static bool etag_matches(std::string_view list, std::string_view etag)
+    {
+        while (!list.empty()) {
+            auto comma = list.find(',');
+            auto tag = list.substr(0, comma);
+            list = comma == std::string_view::npos ? std::string_view() : list.substr(comma + 1);
+            while (!tag.empty() && tag[0] == ' ') {
+                tag.remove_prefix(1);
+            }
+            while (!tag.empty() && tag.back() == ' ') {
+                tag.remove_suffix(1);
+            }
+            if (tag.substr(0, 2) == "W/") {
+                tag.remove_prefix(2);
+            }
+            if (tag == "*" || tag == etag) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /* If-None-Match wins over If-Modified-Since */
+    static bool not_modified(const http_request_view & req, std::string_view etag, time_t mtime)
+    {
+        auto inm = req.header("If-None-Match");
+        if (!inm.empty()) {
+            return etag_matches(inm, etag);
+        }
+        auto ims = req.header("If-Modified-Since");
+        time_t t;
+        return !ims.empty() && parse_http_date(ims, t) && mtime <= t;
+    }
+
+    /* IMF-fixdate, e.g. Sun, 06 Nov 1994 08:49:37 GMT */
+    static std::string http_date(time_t t)
+    {
+        struct tm tm;
+#ifdef _WIN32
+        gmtime_s(&tm, &t);
+#else
+        gmtime_r(&t, &tm);
+#endif
+        char buf[40];
+        strftime(buf, sizeof(buf), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+        return buf;
+    }
+
+    static bool parse_http_date(std::string_view s, time_t & t)
+    {
+        static const char * months = "JanFebMarAprMayJunJulAugSepOctNovDec";
+        char mon[4] = { 0 };
+        int d, y, hh, mm, ss;
+        std::string str(s);
+        if (sscanf(str.c_str(), "%*3s, %d %3s %d %d:%d:%d GMT", &d, mon, &y, &hh, &mm, &ss) != 6) {
+            return false;
+        }
+        auto m = strstr(months, mon);
+        if (m == nullptr || strlen(mon) != 3 || (m - months) % 3 != 0) {
+            return false;
+        }
+        /* days from civil, avoids timegm which is not portable */
+        int month = (int)(m - months) / 3 + 1;
+        int yy = y - (month <= 2);
+        int era = (yy >= 0 ? yy : yy - 399) / 400;
+        int yoe = yy - era * 400;
+        int doy = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+        int doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+        int64_t days = (int64_t)era * 146097 + doe - 719468;
+        t = (time_t)(days * 86400 + hh * 3600 + mm * 60 + ss);
+        return true;
+    }
+
+    enum range_result {
+        /* no usable Range header, send the whole file */
+        range_none,
+        range_ok,
+        range_unsatisfiable
+    };
+
+    /* a single "bytes=" range, multiple ranges are answered with the whole file */
+    static range_result parse_range(std::string_view h, int64_t size, int64_t & from, int64_t & to)
+    {
+        if (h.substr(0, 6) != "bytes=" || h.find(',') != std::string_view::npos) {
+            return range_none;
+        }
+        h.remove_prefix(6);
+        auto dash = h.find('-');
+        if (dash == std::string_view::npos) {
+            return range_none;
+        }
+        int64_t a = 0, b = 0;
+        bool has_a = parse_int(h.substr(0, dash), a);
+        bool has_b = parse_int(h.substr(dash + 1), b);
+        if (!has_a && !has_b) {
+            return range_none;
+        }
+        if (!has_a) {
+            /* suffix: the last b bytes */
+            if (b == 0 || size == 0) {
+                return range_unsatisfiable;
+            }
+            from = b < size ? size - b : 0;
+            to = size - 1;
+            return range_ok;
+        }
+        if (has_b && b < a) {
+            return range_none;
+        }
+        if (a >= size) {
+            return range_unsatisfiable;
+        }
+        from = a;
+        to = has_b && b < size ? b : size - 1;
+        return range_ok;
+    }
+
+    static std::string etag_of(const struct stat & st)
+    {
+        /* same form as mg_serve_http, so caches stay valid across the switch */
+        char buf[64];
+        snprintf(buf, sizeof(buf), "\"%lx.%lld\"", (unsigned long)st.st_mtime, (long long)st.st_size);
+        return buf;
+    }
+
+    static const char * mime_type(const std::string & path, const char * custom)
+    {
+        static const char * types[][2] = {
+            { ".html", "text/html" },
+            { ".htm", "text/html" },
+            { ".css", "text/css" },
+            { ".js", "application/javascript" },
+            { ".mjs", "application/javascript" },
+            { ".json", "application/json" },
+            { ".map", "application/json" },
+            { ".xml", "text/xml" },
+            { ".txt", "text/plain" },
+            { ".ico", "image/x-icon" },
+            { ".gif", "image/gif" },
+            { ".jpg", "image/jpeg" },
+            { ".jpeg", "image/jpeg" },
+            { ".png", "image/png" },
+            { ".svg", "image/svg+xml" },
+            { ".webp", "image/webp" },
+            { ".avif", "image/avif" },
+            { ".bmp", "image/bmp" },
+            { ".woff", "font/woff" },
+            { ".woff2", "font/woff2" },
+            { ".ttf", "font/ttf" },
+            { ".wasm", "application/wasm" },
+            { ".pdf", "application/pdf" },
+            { ".zip", "application/zip" },
+            { ".gz", "application/gzip" },
+            { ".tar", "application/x-tar" },
+            { ".wav", "audio/wav" },
+            { ".mp3", "audio/mpeg" },
+            { ".ogg", "audio/ogg" },
+            { ".m4a", "audio/mp4" },
+            { ".mp4", "video/mp4" },
+            { ".m4v", "video/x-m4v" },
+            { ".webm", "video/webm" },
+            { ".mov", "video/quicktime" },
+            { ".mpg", "video/mpeg" },
+            { ".mpeg", "video/mpeg" },
+            { ".avi", "video/x-msvideo" },
+            { ".m3u8", "application/vnd.apple.mpegurl" },
+            { ".ts", "video/mp2t" },
+        };
+        static thread_local std::string custom_type;
+        std::string_view p(path);
+        if (custom != nullptr) {
+            struct mg_str k, v;
+            while ((custom = mg_next_comma_list_entry(custom, &k, &v)) != NULL) {
+                if (p.size() > k.len && http_headers::iequals(p.substr(p.size() - k.len), to_string_view(k))) {
+                    custom_type.assign(v.p, v.len);
+                    return custom_type.c_str();
+                }
+            }
+        }
+        for (auto & t : types) {
+            size_t n = strlen(t[0]);
+            if (p.size() > n && http_headers::iequals(p.substr(p.size() - n), t[0])) {
+                return t[1];
+            }
+        }
+        return "text/plain";
+    }
+
+private:
+    static bool parse_int(std::string_view s, int64_t & v)
+    {
+        if (s.empty() || s.size() > 18) {
+            return false;
+        }
+        v = 0;
+        for (char c : s) {
+            if (c < '0' || c > '9') {
+                return false;
+            }
+            v = v * 10 + (c - '0');
+        }
+        return true;
+    }
+
+    /* url decoded uri below root, false for anything that climbs out of it */
+    static bool local_path(const char * root, std::string_view uri, std::string & out)
+    {
+        if (uri.empty() || uri[0] != '/') {
+            return false;
+        }
+        std::string decoded(uri.size() + 1, '\0');
+        int n = mg_url_decode(uri.data(), (int)uri.size(), &decoded[0], (int)decoded.size(), 0);
+        if (n < 0) {
+            return false;
+        }
+        decoded.resize(n);
+        if (decoded.find('\0') != std::string::npos || decoded.find('\\') != std::string::npos) {
+            return false;
+        }
+        for (size_t i = 0; i < decoded.size();) {
+            auto next = decoded.find('/', i + 1);
+            auto seg = std::string_view(decoded).substr(i + 1, next == std::string::npos ? std::string::npos : next - i - 1);
+            if (seg == ".." || seg == ".") {
+                return false;
+            }
+            if (next == std::string::npos) {
+                break;
+            }
+            i = next;
+        }
+        out = root;
+        while (!out.empty() && out.back() == '/') {
+            out.pop_back();
+        }
+        out += decoded;
+        return true;
+    }
+
+    static bool find_index(const mg_serve_http_opts & opts, std::string & path, struct stat & st)
+    {
+        const char * list = opts.index_files != nullptr ? opts.index_files : "index.html,index.htm,index.shtml,index.cgi,index.php";
+        struct mg_str name;
+        while ((list = mg_next_comma_list_entry(list, &name, NULL)) != NULL) {
+            std::string candidate = path + std::string(name.p, name.len);
+            if (stat(candidate.c_str(), &st) == 0 && S_ISREG(st.st_mode)) {
+                path = candidate;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /* not something mg_serve_http would run or hide */
+    static bool plain_file(const mg_serve_http_opts & opts, const std::string & path)
+    {
+        auto matches = [&](const char * pattern) {
+            return pattern != nullptr && mg_match_prefix(pattern, (int)strlen(pattern), path.c_str()) > 0;
+        };
+#if MG_ENABLE_HTTP_CGI
+        if (matches(opts.cgi_file_pattern != nullptr ? opts.cgi_file_pattern : "**.cgi$|**.php$")) {
+            return false;
+        }
+#endif
+#if MG_ENABLE_HTTP_SSI
+        if (matches(opts.ssi_pattern != nullptr ? opts.ssi_pattern : "**.shtml$|**.shtm$")) {
+            return false;
+        }
+#endif
+        return !matches(opts.hidden_file_pattern);
+    }
+
+    static void add_extra_headers(const char * extra, http_headers & headers)
+    {
+        std::string_view rest(extra);
+        while (!rest.empty()) {
+            auto eol = rest.find("\r\n");
+            auto line = rest.substr(0, eol);
+            rest = eol == std::string_view::npos ? std::string_view() : rest.substr(eol + 2);
+            auto colon = line.find(':');
+            if (colon == std::string_view::npos) {
+                continue;
+            }
+            auto value = line.substr(colon + 1);
+            while (!value.empty() && value[0] == ' ') {
+                value.remove_prefix(1);
+            }
+            headers.add(line.substr(0, colon), value);
+        }
+    }
+
+    /* If-Range needs a strong match, otherwise the whole file is sent */
+    static bool range_applies(const http_request_view & req, std::string_view etag, std::string_view last_modified)
+    {
+        auto ir = req.header("If-Range");
+        return ir.empty() || ir == etag || ir == last_modified;
+    }
+};
+
+}}
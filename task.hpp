@@ -0,0 +1,190 @@
+#pragma once
+
+#if defined(__cpp_impl_coroutine) && defined(__has_include)
+#if __has_include(<coroutine>)
+#define BOO_NETWORK_HAS_COROUTINE 1
+#endif
+#endif
+
+#ifdef BOO_NETWORK_HAS_COROUTINE
+
+#include <coroutine>
+#include <exception>
+#include <optional>
+#include <utility>
+
+namespace boo { namespace network {
+
+/*
+ * Lazy coroutine returning T. It starts when awaited and resumes its awaiter
+ * when it finishes; exceptions propagate to the awaiter.
+ */
+template<class T = void>
+class task;
+
+class task_promise_base {
+public:
+    std::coroutine_handle<> continuation;
+    std::exception_ptr error;
+
+    struct final_awaiter {
+        bool await_ready() noexcept
+        {
+            return false;
+        }
+
+        template<class P>
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) noexcept
+        {
+            auto c = h.promise().continuation;
+            return c ? c : std::noop_coroutine();
+        }
+
+        void await_resume() noexcept {}
+    };
+
+    std::suspend_always initial_suspend() noexcept
+    {
+        return {};
+    }
+
+    final_awaiter final_suspend() noexcept
+    {
+        return {};
+    }
+
+    void unhandled_exception()
+    {
+        error = std::current_exception();
+    }
+};
+
+template<class T>
+class task {
+public:
+    struct promise_type : task_promise_base {
+        std::optional<T> value;
+
+        task get_return_object()
+        {
+            return task(std::coroutine_handle<promise_type>::from_promise(*this));
+        }
+
+        void return_value(T v)
+        {
+            value = std::move(v);
+        }
+    };
+
+    task(task && t) noexcept : _h(std::exchange(t._h, {})) {}
+    task(const task &) = delete;
+
+    ~task()
+    {
+        if (_h) {
+            _h.destroy();
+        }
+    }
+
+    bool await_ready()
+    {
+        return !_h || _h.done();
+    }
+
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiter)
+    {
+        _h.promise().continuation = awaiter;
+        return _h;
+    }
+
+    T await_resume()
+    {
+        if (_h.promise().error) {
+            std::rethrow_exception(_h.promise().error);
+        }
+        return std::move(*_h.promise().value);
+    }
+
+private:
+    explicit task(std::coroutine_handle<promise_type> h): _h(h) {}
+
+    std::coroutine_handle<promise_type> _h;
+};
+
+template<>
+class task<void> {
+public:
+    struct promise_type : task_promise_base {
+        task get_return_object()
+        {
+            return task(std::coroutine_handle<promise_type>::from_promise(*this));
+        }
+
+        void return_void() {}
+    };
+
+    task(task && t) noexcept : _h(std::exchange(t._h, {})) {}
+    task(const task &) = delete;
+
+    ~task()
+    {
+        if (_h) {
+            _h.destroy();
+        }
+    }
+
+    bool await_ready()
+    {
+        return !_h || _h.done();
+    }
+
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiter)
+    {
+        _h.promise().continuation = awaiter;
+        return _h;
+    }
+
+    void await_resume()
+    {
+        if (_h.promise().error) {
+            std::rethrow_exception(_h.promise().error);
+        }
+    }
+
+private:
+    explicit task(std::coroutine_handle<promise_type> h): _h(h) {}
+
+    std::coroutine_handle<promise_type> _h;
+};
+
+/* eager, fire and forget coroutine; its frame frees itself when it finishes */
+class detached_task {
+public:
+    struct promise_type {
+        detached_task get_return_object()
+        {
+            return {};
+        }
+
+        std::suspend_never initial_suspend() noexcept
+        {
+            return {};
+        }
+
+        std::suspend_never final_suspend() noexcept
+        {
+            return {};
+        }
+
+        void return_void() {}
+
+        void unhandled_exception()
+        {
+            std::terminate();
+        }
+    };
+};
+
+}}
+
+#endif
@@ -0,0 +1,242 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <deque>
+#include <vector>
+#include <functional>
+
+namespace boo { namespace network {
+
+/*
+ * Hierarchical timing wheel (Varghese & Lauck) with millisecond ticks: four
+ * levels of 256 slots cover 2^32 ms, a timer is inserted in O(1) into the
+ * level matching its distance and cascades down as the wheel turns. Timers
+ * are intrusive list nodes recycled through a free list, ids carry a
+ * generation so a stale id never cancels a reused node.
+ *
+ * Not thread safe, meant to be driven by a single poll loop.
+ */
+class timer_wheel {
+public:
+    typedef uint64_t timer_id;
+
+private:
+    static const int bits = 8;
+    static const int levels = 4;
+    static const uint64_t slots = 1 << bits;
+    static const uint64_t mask = slots - 1;
+    static const uint64_t max_delay = ((uint64_t)1 << (bits * levels)) - 1;
+
+    struct node {
+        node * prev = nullptr;
+        node * next = nullptr;
+        uint64_t expires = 0;
+        uint32_t index = 0;
+        uint32_t gen = 1;
+        std::function<void()> fn;
+    };
+
+    uint64_t _now;
+    size_t _size = 0;
+    node _heads[levels][slots];
+    std::deque<node> _nodes;
+    std::vector<node *> _free;
+
+public:
+    explicit timer_wheel(uint64_t now = 0): _now(now)
+    {
+        for (int l = 0; l < levels; ++l) {
+            for (uint64_t s = 0; s < slots; ++s) {
+                reset(&_heads[l][s]);
+            }
+        }
+    }
+
+    timer_wheel(const timer_wheel &) = delete;
+    timer_wheel & operator=(const timer_wheel &) = delete;
+
+    /* fn runs from advance() once delay ms have passed, the id is never 0 */
+    timer_id add(uint64_t delay, std::function<void()> fn)
+    {
+        node * n;
+        if (!_free.empty()) {
+            n = _free.back();
+            _free.pop_back();
+        } else {
+            _nodes.emplace_back();
+            n = &_nodes.back();
+            n->index = (uint32_t)(_nodes.size() - 1);
+        }
+        n->fn = std::move(fn);
+        n->expires = _now + (delay < 1 ? 1 : (delay > max_delay ? max_delay : delay));
+        place(n);
+        _size++;
+        return ((uint64_t)n->gen << 32) | n->index;
+    }
+
+    /* false when the timer already fired or was cancelled */
+    bool cancel(timer_id id)
+    {
+        uint32_t index = (uint32_t)id;
+        if (index >= _nodes.size()) {
+            return false;
+        }
+        node * n = &_nodes[index];
+        if (n->gen != (uint32_t)(id >> 32) || n->next == nullptr) {
+            return false;
+        }
+        unlink(n);
+        release(n);
+        _size--;
+        return true;
+    }
+
+    /* fire everything due up to now, returns the number of callbacks run */
+    size_t advance(uint64_t now)
+    {
+        size_t fired = 0;
+        if (_size == 0) {
+            _now = now > _now ? now : _now;
+            return 0;
+        }
+        while (_now < now) {
+            _now++;
+            int wrapped = 0;
+            /* a level turns over when all the bits below it are zero */
+            while (wrapped + 1 < levels && (_now & (((uint64_t)1 << (bits * (wrapped + 1))) - 1)) == 0) {
+                wrapped++;
+            }
+            for (int l = wrapped; l >= 1; --l) {
+                cascade(l, (_now >> (bits * l)) & mask);
+            }
+            fired += fire(&_heads[0][_now & mask]);
+            if (_size == 0) {
+                _now = now;
+                break;
+            }
+        }
+        return fired;
+    }
+
+    /*
+     * Milliseconds until the next slot that may hold a due timer, at most
+     * max. Timers on the upper levels are accounted for by the next cascade.
+     */
+    uint64_t next_timeout(uint64_t max) const
+    {
+        if (_size == 0) {
+            return max;
+        }
+        uint64_t limit = max < slots ? max : slots;
+        for (uint64_t d = 1; d <= limit; ++d) {
+            auto h = &_heads[0][(_now + d) & mask];
+            if (h->next != h) {
+                return d;
+            }
+        }
+        uint64_t to_cascade = slots - (_now & mask);
+        return to_cascade < max ? to_cascade : max;
+    }
+
+    uint64_t now() const
+    {
+        return _now;
+    }
+
+    size_t size() const
+    {
+        return _size;
+    }
+
+private:
+    static void reset(node * h)
+    {
+        h->prev = h;
+        h->next = h;
+    }
+
+    static void unlink(node * n)
+    {
+        n->prev->next = n->next;
+        n->next->prev = n->prev;
+        n->prev = nullptr;
+        n->next = nullptr;
+    }
+
+    static void push(node * h, node * n)
+    {
+        n->prev = h->prev;
+        n->next = h;
+        h->prev->next = n;
+        h->prev = n;
+    }
+
+    void release(node * n)
+    {
+        n->fn = nullptr;
+        n->gen++;
+        _free.push_back(n);
+    }
+
+    void place(node * n)
+    {
+        /* cascading may hand over timers due this very tick, they go to the slot fired next */
+        if (n->expires < _now) {
+            n->expires = _now;
+        }
+        uint64_t delta = n->expires - _now;
+        int l = 0;
+        while (l + 1 < levels && delta >= ((uint64_t)1 << (bits * (l + 1)))) {
+            l++;
+        }
+        push(&_heads[l][(n->expires >> (bits * l)) & mask], n);
+    }
+
+    void cascade(int level, uint64_t slot)
+    {
+        node list;
+        splice(&_heads[level][slot], &list);
+        while (list.next != &list) {
+            node * n = list.next;
+            unlink(n);
+            place(n);
+        }
+    }
+
+    size_t fire(node * head)
+    {
+        if (head->next == head) {
+            return 0;
+        }
+        /* callbacks may add or cancel timers, work on a detached list */
+        node list;
+        splice(head, &list);
+        size_t fired = 0;
+        while (list.next != &list) {
+            node * n = list.next;
+            unlink(n);
+            auto fn = std::move(n->fn);
+            release(n);
+            _size--;
+            fired++;
+            fn();
+        }
+        return fired;
+    }
+
+    static void splice(node * from, node * to)
+    {
+        if (from->next == from) {
+            reset(to);
+            return;
+        }
+        to->next = from->next;
+        to->prev = from->prev;
+        to->next->prev = to;
+        to->prev->next = to;
+        reset(from);
+    }
+};
+
+}}
@@ -0,0 +1,243 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <chrono>
+#include <algorithm>
+#include <iterator>
+#include <cstdio>
+#include <cstdint>
+#include <cstddef>
+
+#include "3rd/json.hpp"
+
+namespace boo { namespace network {
+
+/* the moments of a request a trace_record stamps, in the order they normally happen */
+enum trace_point {
+    trace_accept,
+    trace_first_byte,
+    trace_headers,
+    trace_routed,
+    trace_handler_returned,
+    trace_first_write,
+    trace_last_write,
+    trace_point_count
+};
+
+/* one sampled request, times are steady_clock nanoseconds and 0 when the point was not seen */
+struct trace_record {
+    uint64_t at[trace_point_count] = {};
+    size_t reactor = 0;
+    uint64_t conn = 0;
+    /* the request's position among those on the connection */
+    uint64_t seq = 0;
+    std::string method;
+    std::string path;
+    std::string route;
+    int status = 0;
+    uint64_t bytes_in = 0;
+    uint64_t bytes_out = 0;
+
+    static const char * point_name(int p)
+    {
+        static const char * names[] = {
+            "accept", "first_byte", "headers", "routed", "handler_returned", "first_write", "last_write"
+        };
+        return p >= 0 && p < trace_point_count ? names[p] : "";
+    }
+
+    /* where the request starts, accept belongs to the connection */
+    uint64_t start() const
+    {
+        for (int p = trace_first_byte; p < trace_point_count; ++p) {
+            if (at[p] != 0) {
+                return at[p];
+            }
+        }
+        return 0;
+    }
+};
+
+/*
+ * The last capacity records of a reactor, the oldest is overwritten. Slots
+ * are allocated up front and reused, only touched on the reactor thread.
+ */
+class trace_ring {
+    std::vector<trace_record> _slots;
+    size_t _next = 0;
+    bool _full = false;
+
+public:
+    explicit trace_ring(size_t capacity = 0): _slots(capacity) {}
+
+    void push(trace_record & r)
+    {
+        if (_slots.empty()) {
+            return;
+        }
+        auto & slot = _slots[_next];
+        /* keeps the strings' buffers of the slot */
+        std::copy(std::begin(r.at), std::end(r.at), std::begin(slot.at));
+        slot.reactor = r.reactor;
+        slot.conn = r.conn;
+        slot.seq = r.seq;
+        slot.method.assign(r.method);
+        slot.path.assign(r.path);
+        slot.route.assign(r.route);
+        slot.status = r.status;
+        slot.bytes_in = r.bytes_in;
+        slot.bytes_out = r.bytes_out;
+        if (++_next == _slots.size()) {
+            _next = 0;
+            _full = true;
+        }
+    }
+
+    /* appends the records to out, oldest first */
+    void copy_to(std::vector<trace_record> & out) const
+    {
+        if (_full) {
+            out.insert(out.end(), _slots.begin() + _next, _slots.end());
+        }
+        out.insert(out.end(), _slots.begin(), _slots.begin() + _next);
+    }
+};
+
+/*
+ * Chrome trace event format, loads in chrome://tracing and Perfetto: a
+ * complete event per request on pid reactor, tid connection, with the
+ * phases between its points nested below it.
+ */
+inline std::string chrome_trace_json(const std::vector<trace_record> & records)
+{
+    static const struct { const char * name; int from; int to; } phases[] = {
+        { "read", trace_first_byte, trace_headers },
+        { "route", trace_headers, trace_routed },
+        { "handler", trace_routed, trace_handler_returned },
+        { "queued", trace_handler_returned, trace_first_write },
+        { "write", trace_first_write, trace_last_write },
+    };
+    auto us = [](uint64_t ns) {
+        return (double)ns / 1000.0;
+    };
+    nlohmann::json events = nlohmann::json::array();
+    for (auto & r : records) {
+        auto start = r.start();
+        auto end = r.at[trace_last_write];
+        if (start == 0 || end < start) {
+            continue;
+        }
+        nlohmann::json args = {
+            { "method", r.method }, { "path", r.path }, { "status", r.status }, { "seq", r.seq },
+            { "bytes_in", r.bytes_in }, { "bytes_out", r.bytes_out }
+        };
+        events.push_back({
+            { "name", r.route.empty() ? r.method + " " + r.path : r.route }, { "cat", "http" }, { "ph", "X" },
+            { "ts", us(start) }, { "dur", us(end - start) }, { "pid", r.reactor }, { "tid", r.conn }, { "args", args }
+        });
+        if (r.at[trace_accept] != 0) {
+            events.push_back({
+                { "name", "accept" }, { "cat", "http" }, { "ph", "i" }, { "s", "t" },
+                { "ts", us(r.at[trace_accept]) }, { "pid", r.reactor }, { "tid", r.conn }
+            });
+        }
+        for (auto & p : phases) {
+            auto from = r.at[p.from];
+            auto to = r.at[p.to];
+            /* a detached handler may return after its response was written */
+            if (from == 0 || to < from) {
+                continue;
+            }
+            events.push_back({
+                { "name", p.name }, { "cat", "http" }, { "ph", "X" },
+                { "ts", us(from) }, { "dur", us(to - from) }, { "pid", r.reactor }, { "tid", r.conn }
+            });
+        }
+    }
+    nlohmann::json out = { { "traceEvents", events }, { "displayTimeUnit", "ns" } };
+    /* methods and paths are the client's bytes, not always UTF-8 */
+    return out.dump(-1, ' ', false, nlohmann::json::error_handler_t::replace);
+}
+
+/*
+ * The OTLP/JSON body of an export request (what an OpenTelemetry
+ * collector takes on /v1/traces): a server span per request with the points
+ * as span events. Trace and span ids are derived from seed and the request.
+ */
+inline std::string otlp_trace_json(const std::vector<trace_record> & records, const std::string & service, uint64_t seed)
+{
+    /* steady_clock has no epoch, shift by where the wall clock is now */
+    int64_t shift = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count()
+        - std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    auto unix_ns = [shift](uint64_t ns) {
+        return std::to_string((int64_t)ns + shift);
+    };
+    auto mix = [](uint64_t x) {
+        /* splitmix64 */
+        x += 0x9e3779b97f4a7c15ull;
+        x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+        x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+        return x ^ (x >> 31);
+    };
+    auto hex = [](uint64_t v) {
+        char buf[17];
+        snprintf(buf, sizeof(buf), "%016llx", (unsigned long long)v);
+        return std::string(buf, 16);
+    };
+    auto str = [](const char * key, const std::string & v) {
+        return nlohmann::json{ { "key", key }, { "value", { { "stringValue", v } } } };
+    };
+    auto num = [](const char * key, uint64_t v) {
+        return nlohmann::json{ { "key", key }, { "value", { { "intValue", std::to_string(v) } } } };
+    };
+    nlohmann::json spans = nlohmann::json::array();
+    for (auto & r : records) {
+        auto start = r.start();
+        auto end = r.at[trace_last_write];
+        if (start == 0 || end < start) {
+            continue;
+        }
+        uint64_t id = mix(seed ^ mix(((uint64_t)r.reactor << 48) ^ r.conn) ^ mix(r.seq ^ start));
+        nlohmann::json attrs = nlohmann::json::array({
+            str("http.request.method", r.method), str("url.path", r.path),
+            num("http.response.status_code", (uint64_t)r.status),
+            num("http.request.size", r.bytes_in), num("http.response.size", r.bytes_out),
+            num("boo.reactor", r.reactor), num("boo.connection", r.conn)
+        });
+        /* the pattern without the method, webroot and unrouted have none */
+        auto space = r.route.find(' ');
+        if (space != std::string::npos) {
+            attrs.push_back(str("http.route", r.route.substr(space + 1)));
+        }
+        nlohmann::json events = nlohmann::json::array();
+        for (int p = 0; p < trace_point_count; ++p) {
+            if (r.at[p] != 0) {
+                events.push_back({ { "timeUnixNano", unix_ns(r.at[p]) }, { "name", trace_record::point_name(p) } });
+            }
+        }
+        nlohmann::json span = {
+            { "traceId", hex(mix(id)) + hex(mix(id + 1)) }, { "spanId", hex(id) },
+            { "name", r.route.empty() ? r.method : r.route }, { "kind", 2 },
+            { "startTimeUnixNano", unix_ns(start) }, { "endTimeUnixNano", unix_ns(end) },
+            { "attributes", attrs }, { "events", events }
+        };
+        /* 5xx is an error for a server span */
+        if (r.status >= 500) {
+            span["status"] = { { "code", 2 } };
+        }
+        spans.push_back(span);
+    }
+    nlohmann::json out = {
+        { "resourceSpans", nlohmann::json::array({ {
+            { "resource", { { "attributes", nlohmann::json::array({ str("service.name", service) }) } } },
+            { "scopeSpans", nlohmann::json::array({ {
+                { "scope", { { "name", "boo.network" } } },
+                { "spans", spans }
+            } }) }
+        } }) }
+    };
+    return out.dump(-1, ' ', false, nlohmann::json::error_handler_t::replace);
+}
+
+}}
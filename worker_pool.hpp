@@ -0,0 +1,92 @@
+#pragma once
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <deque>
+#include <vector>
+
+namespace boo { namespace network {
+
+/*
+ * Fixed set of threads running posted tasks in FIFO order. The destructor
+ * finishes the queued tasks before joining.
+ */
+class worker_pool {
+    std::vector<std::thread> _threads;
+    std::deque<std::function<void()>> _tasks;
+    std::mutex _m;
+    std::condition_variable _cv;
+    bool _stop = false;
+
+public:
+    explicit worker_pool(size_t n)
+    {
+        if (n == 0) {
+            n = 1;
+        }
+        for (size_t i = 0; i < n; ++i) {
+            _threads.push_back(std::thread([this]() {
+                run();
+            }));
+        }
+    }
+
+    worker_pool(const worker_pool &) = delete;
+    worker_pool & operator=(const worker_pool &) = delete;
+
+    ~worker_pool()
+    {
+        {
+            std::lock_guard<std::mutex> locker(_m);
+            _stop = true;
+        }
+        _cv.notify_all();
+        for (auto & t : _threads) {
+            t.join();
+        }
+    }
+
+    void post(std::function<void()> task)
+    {
+        {
+            std::lock_guard<std::mutex> locker(_m);
+            _tasks.push_back(std::move(task));
+        }
+        _cv.notify_one();
+    }
+
+    size_t size() const
+    {
+        return _threads.size();
+    }
+
+    size_t pending()
+    {
+        std::lock_guard<std::mutex> locker(_m);
+        return _tasks.size();
+    }
+
+private:
+    void run()
+    {
+        for (;;) {
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> locker(_m);
+                _cv.wait(locker, [this]() {
+                    return _stop || !_tasks.empty();
+                });
+                if (_tasks.empty()) {
+                    return;
+                }
+                task = std::move(_tasks.front());
+                _tasks.pop_front();
+            }
+            task();
+        }
+    }
+};
+
+}}
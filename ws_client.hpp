@@ -2,6 +2,7 @@
 
 #include "3rd/mongoose.h"
 #include "routing.hpp"
+#include "epoll_iface.hpp"
 #include "3rd/json.hpp"
 #include <string>
 #include <mutex>
@@ -24,6 +25,7 @@ class ws_client
     bool _stopped = false;
     bool _handshake_done = false;
     bool _reconnect_when_closed = false;
+    bool _use_epoll = false;
 
     boo::network::routing::router<std::function<void(ws_client*, const nlohmann::json &)>> * _router;
 
@@ -57,6 +59,11 @@ public:
         _reconnect_when_closed = reconnect;
     }
 
+    void use_epoll(bool use = true)
+    {
+        _use_epoll = use;
+    }
+
     bool connect()
     {
         if (_url == "") {
@@ -128,7 +135,7 @@ private:
     bool do_connect()
     {
         _connecting = false;
-        mg_mgr_init(&_mgr, nullptr);
+        epoll_iface::mgr_init(&_mgr, nullptr, _use_epoll);
         _nc = mg_connect_ws(&_mgr, ws_client::mongoose_ev_handler, _url.c_str(), "websocket", NULL);
         if (_nc == nullptr) {
             return false;